@@ -1,642 +1,8540 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <iomanip>
 #include <ctime>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <random>
+#include <condition_variable>
+#include <charconv>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <deque>
+#include <memory>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <csignal>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define BANK_X86_SIMD 1
+#endif
 
 using namespace std;
 
 // Forward declarations
 class Transaction;
 class Account;
+class Customer;
+
+// Fixed-point amount of money, stored as a whole number of cents.
+// Integer cents keep every sum exact and independent of the order it is
+// computed in, and fit in a single atomic word.
+class Money {
+private:
+    int64_t cents;
+
+public:
+    // Constructors
+    Money() : cents(0) {}
+    Money(double dollars) : cents(llround(dollars * 100)) {} // Rounds to the nearest cent
+
+    static Money fromCents(int64_t amountInCents) {
+        Money money;
+        money.cents = amountInCents;
+        return money;
+    }
+
+    // Getters
+    int64_t getCents() const { return cents; }
+    double toDouble() const { return cents / 100.0; }
+
+    // Arithmetic
+    Money operator+(const Money& other) const { return fromCents(cents + other.cents); }
+    Money operator-(const Money& other) const { return fromCents(cents - other.cents); }
+    Money operator-() const { return fromCents(-cents); }
+    Money& operator+=(const Money& other) { cents += other.cents; return *this; }
+    Money& operator-=(const Money& other) { cents -= other.cents; return *this; }
+
+    // Comparisons
+    bool operator==(const Money& other) const { return cents == other.cents; }
+    bool operator!=(const Money& other) const { return cents != other.cents; }
+    bool operator<(const Money& other) const { return cents < other.cents; }
+    bool operator>(const Money& other) const { return cents > other.cents; }
+    bool operator<=(const Money& other) const { return cents <= other.cents; }
+    bool operator>=(const Money& other) const { return cents >= other.cents; }
+
+    // Always printed with two decimals
+    friend ostream& operator<<(ostream& os, const Money& money) {
+        int64_t absolute = money.cents < 0 ? -money.cents : money.cents;
+        if (money.cents < 0) {
+            os << '-';
+        }
+        os << absolute / 100 << '.' << (char)('0' + absolute % 100 / 10) << (char)('0' + absolute % 10);
+        return os;
+    }
+};
+
+// Log levels, from quietest to most verbose
+enum class LogLevel : uint8_t {
+    Silent,
+    Error,
+    Info,
+    Debug
+};
+
+// Asynchronous logger.
+// Each thread formats its lines into its own buffer; a background thread
+// collects the buffers every few milliseconds (or sooner when one fills up)
+// and writes them out with one large write per buffer. Logging never waits
+// for I/O, only for the short swap of its own buffer.
+class Logger {
+private:
+    static const size_t WAKE_THRESHOLD = 64 * 1024; // Bytes that trigger an early drain
+
+    // Lines written by one thread
+    struct ThreadBuffer {
+        mutex bufferMutex;
+        string data;
+    };
+
+    // Registers the calling thread's buffer and hands its leftovers back on thread exit
+    struct ThreadBufferHandle {
+        ThreadBuffer* buffer;
+        ThreadBufferHandle() : buffer(new ThreadBuffer()) { instance().registerBuffer(buffer); }
+        ~ThreadBufferHandle() { instance().unregisterBuffer(buffer); }
+    };
+
+    static atomic<uint8_t> level;
+
+    mutex registryMutex;            // Guards buffers, orphaned and outputFd
+    vector<ThreadBuffer*> buffers;
+    string orphaned;                // Data left behind by threads that exited
+    int outputFd;
+
+    mutex stateMutex;               // Guards the fields below
+    condition_variable wakeup;
+    condition_variable flushed;
+    bool stopping;
+    uint64_t flushRequested;
+    uint64_t flushCompleted;
+    thread writer;
+
+    Logger() : outputFd(STDOUT_FILENO), stopping(false), flushRequested(0), flushCompleted(0) {
+        writer = thread([this]() { run(); });
+    }
+
+    ~Logger() {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        writer.join();
+        if (outputFd != STDOUT_FILENO) {
+            close(outputFd);
+        }
+    }
+
+    void registerBuffer(ThreadBuffer* buffer) {
+        lock_guard<mutex> lock(registryMutex);
+        buffers.push_back(buffer);
+    }
+
+    void unregisterBuffer(ThreadBuffer* buffer) {
+        lock_guard<mutex> lock(registryMutex);
+        orphaned += buffer->data;
+        buffers.erase(find(buffers.begin(), buffers.end(), buffer));
+        delete buffer;
+    }
+
+    // Collect every thread's pending lines and write them out
+    void drain() {
+        string pending;
+        int fd;
+        {
+            lock_guard<mutex> lock(registryMutex);
+            pending.swap(orphaned);
+            for (ThreadBuffer* buffer : buffers) {
+                lock_guard<mutex> bufferLock(buffer->bufferMutex);
+                pending += buffer->data;
+                buffer->data.clear();
+            }
+            fd = outputFd;
+        }
+        size_t written = 0;
+        while (written < pending.size()) {
+            ssize_t result = ::write(fd, pending.data() + written, pending.size() - written);
+            if (result <= 0) {
+                break;
+            }
+            written += (size_t)result;
+        }
+    }
+
+    // Background writer loop
+    void run() {
+        unique_lock<mutex> lock(stateMutex);
+        while (true) {
+            wakeup.wait_for(lock, chrono::milliseconds(5));
+            bool stop = stopping;
+            uint64_t target = flushRequested;
+            lock.unlock();
+            drain();
+            lock.lock();
+            flushCompleted = target;
+            flushed.notify_all();
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+public:
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    static bool enabled(LogLevel lineLevel) {
+        return lineLevel != LogLevel::Silent && (uint8_t)lineLevel <= level.load(memory_order_relaxed);
+    }
+
+    static void setLevel(LogLevel newLevel) { level.store((uint8_t)newLevel); }
+    static LogLevel getLevel() { return (LogLevel)level.load(); }
+
+    // Send output to a file (appending) instead of stdout
+    bool setOutputFile(const string& path) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        flush();
+        lock_guard<mutex> lock(registryMutex);
+        if (outputFd != STDOUT_FILENO) {
+            close(outputFd);
+        }
+        outputFd = fd;
+        return true;
+    }
+
+    // Wait until everything logged so far has been written
+    void flush() {
+        unique_lock<mutex> lock(stateMutex);
+        uint64_t ticket = ++flushRequested;
+        wakeup.notify_one();
+        flushed.wait(lock, [&]() { return flushCompleted >= ticket; });
+    }
+
+    // Append one finished line to the calling thread's buffer
+    void write(const string& line) {
+        thread_local ThreadBufferHandle handle;
+        size_t size;
+        {
+            lock_guard<mutex> lock(handle.buffer->bufferMutex);
+            handle.buffer->data += line;
+            size = handle.buffer->data.size();
+        }
+        if (size >= WAKE_THRESHOLD) {
+            wakeup.notify_one();
+        }
+    }
+};
+
+atomic<uint8_t> Logger::level((uint8_t)LogLevel::Info);
+
+// Appends formatted values to a string with to_chars. Floating-point
+// values are printed with two decimals. Log lines and statements share it.
+class TextWriter {
+protected:
+    string& text;
+
+    template <typename Integer>
+    TextWriter& appendInteger(Integer value) {
+        char digits[24];
+        to_chars_result result = to_chars(digits, digits + sizeof(digits), value);
+        text.append(digits, result.ptr);
+        return *this;
+    }
+
+public:
+    // Constructor
+    explicit TextWriter(string& target) : text(target) {}
+
+    TextWriter(const TextWriter&) = delete;
+    TextWriter& operator=(const TextWriter&) = delete;
+
+    TextWriter& operator<<(const char* value) { text += value; return *this; }
+    TextWriter& operator<<(const string& value) { text += value; return *this; }
+    TextWriter& operator<<(string_view value) { text += value; return *this; }
+    TextWriter& operator<<(char c) { text += c; return *this; }
+    TextWriter& operator<<(int value) { return appendInteger(value); }
+    TextWriter& operator<<(long value) { return appendInteger(value); }
+    TextWriter& operator<<(long long value) { return appendInteger(value); }
+    TextWriter& operator<<(unsigned value) { return appendInteger(value); }
+    TextWriter& operator<<(unsigned long value) { return appendInteger(value); }
+    TextWriter& operator<<(unsigned long long value) { return appendInteger(value); }
+
+    TextWriter& operator<<(double value) {
+        char digits[64];
+        to_chars_result result = to_chars(digits, digits + sizeof(digits), value, chars_format::fixed, 2);
+        text.append(digits, result.ptr);
+        return *this;
+    }
+
+    TextWriter& operator<<(const Money& money) {
+        int64_t cents = money.getCents();
+        if (cents < 0) {
+            text += '-';
+            cents = -cents;
+        }
+        appendInteger(cents / 100);
+        text += '.';
+        text += (char)('0' + cents % 100 / 10);
+        text += (char)('0' + cents % 10);
+        return *this;
+    }
+};
+
+// One log line, formatted into a reused per-thread string; the line is
+// handed to the Logger when it goes out of scope. A line logged while
+// another is still being formatted (e.g. from a function called in its
+// arguments) gets the next string, so neither corrupts the other.
+class LogLine : public TextWriter {
+private:
+    struct Scratch {
+        deque<string> buffers; // One per nesting level; deque keeps references stable
+        size_t depth = 0;
+    };
+
+    static Scratch& scratch() {
+        thread_local Scratch perThread;
+        return perThread;
+    }
+
+    static string& acquire() {
+        Scratch& own = scratch();
+        if (own.depth == own.buffers.size()) {
+            own.buffers.emplace_back();
+        }
+        return own.buffers[own.depth++];
+    }
+
+public:
+    // Constructor
+    explicit LogLine(LogLevel) : TextWriter(acquire()) {
+        text.clear();
+    }
+
+    // Destructor: finish the line and pass it on
+    ~LogLine() {
+        text += '\n';
+        Logger::instance().write(text);
+        scratch().depth--;
+    }
+
+    // Lets operator<< overloads taking TextWriter& apply to a temporary line
+    TextWriter& ref() { return *this; }
+};
+
+// Logging macros; the arguments are not evaluated when the level is off.
+// The for loop runs its body at most once and, unlike a bare if/else,
+// can't pick up an else written after the logging statement.
+#define LOG_AT(lineLevel) \
+    for (bool logLineOn = Logger::enabled(lineLevel); logLineOn; logLineOn = false) LogLine(lineLevel).ref()
+#define LOG_ERROR LOG_AT(LogLevel::Error)
+#define LOG_INFO LOG_AT(LogLevel::Info)
+#define LOG_DEBUG LOG_AT(LogLevel::Debug)
+
+// Cheap timestamp for latency measurements: the CPU time-stamp counter on
+// x86-64 (a few ns to read against ~25 ns for steady_clock), nanoseconds
+// elsewhere. Callers convert ticks to nanoseconds when reporting.
+inline uint64_t readLatencyTicks() {
+#ifdef BANK_X86_SIMD
+    return __rdtsc();
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// One completed trace span
+struct TraceEvent {
+    const char* name; // String literal
+    uint64_t startTicks;
+    uint64_t durationTicks;
+};
+
+// Collects trace spans and exports them as Chrome trace-event JSON, which
+// chrome://tracing and Perfetto open directly.
+// Every thread appends to its own buffer, so recording takes no lock: the
+// owner writes the event and then publishes the new count with a release
+// store, and the exporter reads up to the published count. Buffers grow in
+// chunks up to MAX_CHUNKS; spans past that are counted as dropped.
+class Tracer {
+private:
+    static const size_t CHUNK_EVENTS = 4096;
+    static const size_t MAX_CHUNKS = 256; // About 1M spans per thread
+
+    struct ThreadBuffer {
+        atomic<TraceEvent*> chunks[MAX_CHUNKS];
+        atomic<size_t> count;
+        atomic<uint64_t> dropped;
+        int threadNumber;
+        ThreadBuffer* next;
+    };
+
+    atomic<ThreadBuffer*> buffers; // Lock-free list, newest first; never freed
+    atomic<int> threadCount;
+    atomic<bool> recording;
+    uint64_t startTicks; // Tick and clock readings when recording started,
+    chrono::steady_clock::time_point startTime; // to calibrate ticks against
+
+    Tracer() : buffers(nullptr), threadCount(0), recording(false), startTicks(0) {}
+
+    ThreadBuffer& localBuffer() {
+        thread_local ThreadBuffer* buffer = nullptr;
+        if (!buffer) {
+            buffer = new ThreadBuffer();
+            buffer->threadNumber = threadCount.fetch_add(1) + 1;
+            buffer->next = buffers.load(memory_order_relaxed);
+            while (!buffers.compare_exchange_weak(buffer->next, buffer, memory_order_release, memory_order_relaxed)) {
+            }
+        }
+        return *buffer;
+    }
+
+public:
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    static bool active() {
+        return instance().recording.load(memory_order_relaxed);
+    }
+
+    void start() {
+        startTicks = readLatencyTicks();
+        startTime = chrono::steady_clock::now();
+        recording.store(true);
+    }
+
+    void stop() {
+        recording.store(false);
+    }
+
+    void record(const char* name, uint64_t spanStart, uint64_t durationTicks) {
+        ThreadBuffer& buffer = localBuffer();
+        size_t index = buffer.count.load(memory_order_relaxed);
+        size_t chunkIndex = index / CHUNK_EVENTS;
+        if (chunkIndex >= MAX_CHUNKS) {
+            buffer.dropped.store(buffer.dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+            return;
+        }
+        TraceEvent* chunk = buffer.chunks[chunkIndex].load(memory_order_relaxed);
+        if (!chunk) {
+            chunk = new TraceEvent[CHUNK_EVENTS];
+            buffer.chunks[chunkIndex].store(chunk, memory_order_relaxed);
+        }
+        chunk[index % CHUNK_EVENTS] = TraceEvent{name, spanStart, durationTicks};
+        buffer.count.store(index + 1, memory_order_release);
+    }
+
+    // Write every span recorded so far as Chrome trace-event JSON
+    // (complete "X" events, timestamps in microseconds since start()).
+    // Returns the number of spans written.
+    size_t writeChromeTrace(ostream& out) const {
+        double microsPerTick = 0.001;
+#ifdef BANK_X86_SIMD
+        uint64_t elapsedTicks = readLatencyTicks() - startTicks;
+        double elapsedMicros = chrono::duration<double, micro>(chrono::steady_clock::now() - startTime).count();
+        microsPerTick = elapsedTicks ? elapsedMicros / elapsedTicks : 0.001;
+#endif
+        size_t written = 0;
+        uint64_t dropped = 0;
+        out << fixed << setprecision(3);
+        out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+        for (const ThreadBuffer* buffer = buffers.load(memory_order_acquire); buffer; buffer = buffer->next) {
+            size_t count = buffer->count.load(memory_order_acquire);
+            dropped += buffer->dropped.load(memory_order_relaxed);
+            for (size_t i = 0; i < count; i++) {
+                const TraceEvent& event = buffer->chunks[i / CHUNK_EVENTS].load(memory_order_relaxed)[i % CHUNK_EVENTS];
+                if (event.startTicks < startTicks) {
+                    continue; // Recorded before the latest start()
+                }
+                out << (written ? "," : "") << "\n  {\"name\": \"" << event.name
+                    << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->threadNumber
+                    << ", \"ts\": " << (event.startTicks - startTicks) * microsPerTick
+                    << ", \"dur\": " << event.durationTicks * microsPerTick << "}";
+                written++;
+            }
+        }
+        out << "\n], \"otherData\": {\"dropped_spans\": " << dropped << "}}\n";
+        return written;
+    }
+};
+
+// Records the enclosing scope as a trace span while the Tracer is recording
+class TraceScope {
+private:
+    const char* name;
+    uint64_t startTicks; // 0 when not recording
+
+public:
+    // Constructor
+    explicit TraceScope(const char* spanName)
+        : name(spanName), startTicks(Tracer::active() ? readLatencyTicks() : 0) {}
+
+    // Destructor: record the span
+    ~TraceScope() {
+        if (startTicks) {
+            Tracer::instance().record(name, startTicks, readLatencyTicks() - startTicks);
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+// Trace spans are compiled in only with -DBANK_TRACING; otherwise
+// TRACE_SCOPE expands to nothing and costs nothing
+#ifdef BANK_TRACING
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#endif
+
+// Traces a whole run: starts recording on construction and writes the
+// Chrome trace file on destruction. An empty path does nothing.
+class TraceSession {
+private:
+    string path;
+
+public:
+    // Constructor
+    explicit TraceSession(const string& tracePath) : path(tracePath) {
+        if (path.empty()) {
+            return;
+        }
+#ifdef BANK_TRACING
+        Tracer::instance().start();
+#else
+        LOG_ERROR << "Tracing is not compiled in; rebuild with -DBANK_TRACING to write " << path;
+        path.clear();
+#endif
+    }
+
+    // Destructor
+    ~TraceSession() {
+        if (path.empty()) {
+            return;
+        }
+        Tracer::instance().stop();
+        ofstream out(path);
+        size_t spans = Tracer::instance().writeChromeTrace(out);
+        out.close();
+        if (!out) {
+            LOG_ERROR << "Cannot write trace to " << path;
+        } else {
+            LOG_INFO << "Trace with " << (uint64_t)spans << " spans written to " << path;
+        }
+    }
+
+    TraceSession(const TraceSession&) = delete;
+    TraceSession& operator=(const TraceSession&) = delete;
+};
+
+// Types of banking transactions
+enum class TransactionType : uint8_t {
+    Deposit,
+    Withdrawal,
+    Interest
+};
 
 // Transaction class to represent banking transactions
+// Fixed-size record: the date is kept as a timestamp and only formatted
+// when the transaction is displayed.
 class Transaction {
 private:
-    double amount;
-    string type;
-    string date;
+    int64_t timestamp; // Microseconds since the epoch
+    int64_t amount;    // Amount in cents
+    TransactionType type;
 
 public:
-    // Constructor
-    Transaction(double amt, const string& transType) : amount(amt), type(transType) {
-        // Simple date format for demonstration
-        time_t now = time(0);
-        char* dt = ctime(&now);
-        date = string(dt);
-        date.pop_back(); // Remove newline character
+    // Constructors
+    Transaction() : timestamp(0), amount(0), type(TransactionType::Deposit) {}
+
+    Transaction(Money amt, TransactionType transType)
+        : timestamp(currentTimestamp()), amount(amt.getCents()), type(transType) {}
+
+    Transaction(Money amt, TransactionType transType, int64_t time)
+        : timestamp(time), amount(amt.getCents()), type(transType) {}
+
+    // Microseconds since the epoch
+    static int64_t currentTimestamp() {
+        return chrono::duration_cast<chrono::microseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
     }
 
     // Getters
-    double getAmount() const { return amount; }
-    string getType() const { return type; }
-    string getDate() const { return date; }
+    Money getAmount() const { return Money::fromCents(amount); }
+    TransactionType getType() const { return type; }
+    int64_t getTimestamp() const { return timestamp; }
+
+    const char* getTypeName() const {
+        switch (type) {
+            case TransactionType::Deposit: return "Deposit";
+            case TransactionType::Withdrawal: return "Withdrawal";
+            case TransactionType::Interest: return "Interest";
+        }
+        return "Unknown";
+    }
+
+    // Format the timestamp the same way ctime() does, without the newline.
+    // The last second formatted on each thread is cached, since runs of
+    // transactions and statements tend to share it.
+    string_view formatDate() const {
+        thread_local time_t cachedSeconds = -1;
+        thread_local char cached[32];
+        thread_local size_t cachedLength = 0;
+        time_t seconds = (time_t)(timestamp / 1000000);
+        if (seconds != cachedSeconds) {
+            cachedLength = 0;
+            if (ctime_r(&seconds, cached)) {
+                cachedLength = strlen(cached) - 1; // Drop the newline
+            }
+            cachedSeconds = seconds;
+        }
+        return string_view(cached, cachedLength);
+    }
+
+    string getDate() const {
+        return string(formatDate());
+    }
 
     // Display transaction details
     void displayTransaction() const {
-        cout << "Transaction: " << type << " - $" << fixed << setprecision(2) 
-             << amount << " on " << date << endl;
+        LOG_INFO << *this;
+    }
+
+    // Append "Transaction: <type> - $<amount> on <date>" to a log line or statement
+    friend TextWriter& operator<<(TextWriter& line, const Transaction& trans) {
+        return line << "Transaction: " << trans.getTypeName() << " - $" << trans.getAmount()
+                    << " on " << trans.formatDate();
     }
 };
 
-// Base Account class
-class Account {
-protected:
-    static int nextAccountNumber; // Static member for auto-generating account numbers
-    int accountNumber;
-    double balance;
-    string ownerName;
-    vector<Transaction> transactionHistory;
+static_assert(is_trivially_copyable<Transaction>::value, "Transaction must stay a plain record");
+static_assert(sizeof(Transaction) <= 24, "Transaction should stay compact");
 
+// Disk tier for transaction histories.
+// Older transactions are sealed into small immutable segments appended to one
+// shared file (an unlinked temporary file, so it goes away with the process;
+// durability comes from the journal and snapshots). Segments are columnar
+// and compressed: a type column, then timestamp deltas and amounts as
+// zigzag varints. An account's segments are chained through the location
+// of the previous one, so the account only has to remember its newest.
+// Sealing only encodes a segment and queues it; a background thread writes
+// queued segments to the file, and readers find them in the queue meanwhile.
+class HistoryStore {
 public:
-    // Constructor
-    Account(const string& owner, double initialBalance = 0.0) 
-        : ownerName(owner), balance(initialBalance) {
-        accountNumber = nextAccountNumber++;
+    static const uint64_t NO_SEGMENT = ~0ull;
+
+private:
+    static const uint64_t MEMORY_BIT = 1ull << 62; // Segment kept in memory because there is no file
+    static const size_t MAX_QUEUED = 16 << 20;     // Sealing waits while this much is unwritten
+    static const size_t WRITE_BATCH = 256 << 10;   // The writer starts early once this much is queued
+    static constexpr int WRITE_INTERVAL_US = 1000; // Otherwise it gathers segments for this long
+
+    struct SegmentHeader {
+        uint64_t previous;   // Location of the account's previous segment
+        uint32_t count;
+        uint32_t payloadSize;
+    };
+
+    int fd;
+    mutex memoryMutex;       // Guards memory
+    string memory;
+
+    mutex queueMutex;        // Guards the fields below
+    condition_variable queuedWork;
+    condition_variable drained;
+    string queued;           // Segments not handed to the writer yet, from file offset queuedStart
+    uint64_t queuedStart;
+    string writing;          // Segments being written, from file offset writingStart
+    uint64_t writingStart;
+    map<uint64_t, string> unwritten; // Runs the file refused, by offset (kept in memory)
+    atomic<uint64_t> flushedEnd;     // Everything before this is in the file or in 'unwritten'
+    atomic<bool> anyUnwritten;
+    bool stopping;
+    thread writer;
+
+    // Background loop: write queued segments, one pwrite per batch
+    void run() {
+        unique_lock<mutex> lock(queueMutex);
+        while (true) {
+            queuedWork.wait(lock, [&]() { return stopping || !queued.empty(); });
+            if (queued.empty()) {
+                return;
+            }
+            // Let more segments join this write
+            queuedWork.wait_for(lock, chrono::microseconds(WRITE_INTERVAL_US),
+                                [&]() { return stopping || queued.size() >= WRITE_BATCH; });
+            writing.swap(queued);
+            writingStart = queuedStart;
+            queuedStart += writing.size();
+            drained.notify_all();
+            lock.unlock();
+
+            // Readers may copy from 'writing' meanwhile; only this thread changes it
+            size_t done = 0;
+            while (done < writing.size()) {
+                ssize_t result = pwrite(fd, writing.data() + done, writing.size() - done,
+                                        (off_t)(writingStart + done));
+                if (result > 0) {
+                    done += (size_t)result;
+                } else if (result == 0 || errno != EINTR) {
+                    break;
+                }
+            }
+
+            lock.lock();
+            if (done < writing.size()) {
+                LOG_ERROR << "Error: Cannot write transaction history to disk; keeping it in memory";
+                unwritten[writingStart] = writing;
+                anyUnwritten.store(true, memory_order_release);
+            }
+            writing.clear();
+            writingStart = queuedStart;
+            flushedEnd.store(queuedStart, memory_order_release);
+        }
+    }
+
+    // Copy bytes of a segment that has not reached the file (caller holds
+    // queueMutex); false if the range is not held in memory
+    bool readQueuedLocked(uint64_t location, void* data, size_t size) {
+        const string* source = nullptr;
+        uint64_t start = 0;
+        if (location >= queuedStart) {
+            source = &queued;
+            start = queuedStart;
+        } else if (location >= writingStart && !writing.empty()) {
+            source = &writing;
+            start = writingStart;
+        } else {
+            auto it = unwritten.upper_bound(location);
+            if (it == unwritten.begin()) {
+                return false;
+            }
+            --it;
+            source = &it->second;
+            start = it->first;
+        }
+        if (location - start + size > source->size()) {
+            return false;
+        }
+        memcpy(data, source->data() + (location - start), size);
+        return true;
+    }
+
+    HistoryStore()
+        : fd(-1), queuedStart(0), writingStart(0), flushedEnd(0), anyUnwritten(false), stopping(false) {
+        const char* tmpdir = getenv("TMPDIR");
+        string directory = tmpdir ? tmpdir : "/tmp";
+#ifdef O_TMPFILE
+        fd = open(directory.c_str(), O_TMPFILE | O_RDWR, 0600);
+#endif
+        if (fd < 0) {
+            string path = directory + "/bank-history-XXXXXX";
+            fd = mkstemp(&path[0]);
+            if (fd >= 0) {
+                unlink(path.c_str());
+            }
+        }
+        if (fd >= 0) {
+            writer = thread([this]() { run(); });
+        }
+    }
+
+    ~HistoryStore() {
+        if (fd >= 0) {
+            {
+                lock_guard<mutex> lock(queueMutex);
+                stopping = true;
+            }
+            queuedWork.notify_one();
+            writer.join();
+            close(fd);
+        }
+    }
+
+    static void putVarint(string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out += (char)(value | 0x80);
+            value >>= 7;
+        }
+        out += (char)value;
+    }
+
+    static uint64_t getVarint(const char*& in) {
+        uint64_t value = 0;
+        for (int shift = 0; ; shift += 7) {
+            uint8_t byte = (uint8_t)*in++;
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+    }
+
+    static uint64_t zigzag(int64_t value) { return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63); }
+    static int64_t unzigzag(uint64_t value) { return (int64_t)(value >> 1) ^ -(int64_t)(value & 1); }
+
+    // Read raw bytes of a segment
+    bool readAt(uint64_t location, void* data, size_t size) {
+        if (location & MEMORY_BIT) {
+            lock_guard<mutex> lock(memoryMutex);
+            uint64_t offset = location & ~MEMORY_BIT;
+            if (offset + size > memory.size()) {
+                return false;
+            }
+            memcpy(data, memory.data() + offset, size);
+            return true;
+        }
+        if (location + size > flushedEnd.load(memory_order_acquire) || anyUnwritten.load(memory_order_acquire)) {
+            lock_guard<mutex> lock(queueMutex);
+            if (readQueuedLocked(location, data, size)) {
+                return true;
+            }
+        }
+        size_t done = 0;
+        while (done < size) {
+            ssize_t result = pread(fd, (char*)data + done, size - done, (off_t)(location + done));
+            if (result <= 0) {
+                return false;
+            }
+            done += (size_t)result;
+        }
+        return true;
+    }
+
+public:
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    static HistoryStore& instance() {
+        static HistoryStore store;
+        return store;
+    }
+
+    // Queue transactions as a new segment following 'previous'; returns its
+    // location. Only waits if the writer has fallen far behind.
+    uint64_t seal(const Transaction* entries, uint32_t count, uint64_t previous) {
+        string segment(sizeof(SegmentHeader), '\0');
+        for (uint32_t i = 0; i < count; i++) {
+            segment += (char)entries[i].getType();
+        }
+        int64_t lastTimestamp = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            putVarint(segment, zigzag(entries[i].getTimestamp() - lastTimestamp));
+            lastTimestamp = entries[i].getTimestamp();
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            putVarint(segment, zigzag(entries[i].getAmount().getCents()));
+        }
+        SegmentHeader header = {previous, count, (uint32_t)(segment.size() - sizeof(SegmentHeader))};
+        memcpy(&segment[0], &header, sizeof(header));
+
+        if (fd >= 0) {
+            unique_lock<mutex> lock(queueMutex);
+            drained.wait(lock, [&]() { return queued.size() < MAX_QUEUED; });
+            uint64_t offset = queuedStart + queued.size();
+            bool wake = queued.empty() || (queued.size() < WRITE_BATCH && queued.size() + segment.size() >= WRITE_BATCH);
+            queued += segment;
+            if (wake) {
+                queuedWork.notify_one();
+            }
+            return offset;
+        }
+        lock_guard<mutex> lock(memoryMutex);
+        uint64_t location = memory.size() | MEMORY_BIT;
+        memory += segment;
+        return location;
+    }
+
+    // Visit the transactions of a segment chain, oldest segment first
+    template <typename Visitor>
+    void forEach(uint64_t newest, Visitor visit) {
+        vector<uint64_t> chain;
+        SegmentHeader header;
+        for (uint64_t location = newest; location != NO_SEGMENT; location = header.previous) {
+            if (!readAt(location, &header, sizeof(header))) {
+                break;
+            }
+            chain.push_back(location);
+        }
+
+        string payload;
+        for (size_t i = chain.size(); i-- > 0; ) {
+            readAt(chain[i], &header, sizeof(header));
+            payload.resize(header.payloadSize);
+            if (!readAt(chain[i] + sizeof(header), &payload[0], payload.size())) {
+                return;
+            }
+            const char* types = payload.data();
+            const char* in = types + header.count;
+            vector<int64_t> timestamps(header.count);
+            int64_t timestamp = 0;
+            for (uint32_t j = 0; j < header.count; j++) {
+                timestamp += unzigzag(getVarint(in));
+                timestamps[j] = timestamp;
+            }
+            for (uint32_t j = 0; j < header.count; j++) {
+                Money amount = Money::fromCents(unzigzag(getVarint(in)));
+                visit(Transaction(amount, (TransactionType)types[j], timestamps[j]));
+            }
+        }
+    }
+};
+
+// Transaction history of one account, kept in tiers:
+//  - entries restored from a snapshot stay in the memory-mapped file and are
+//    read (and paged in) only when visited;
+//  - sealed entries live in compressed segments in the HistoryStore;
+//  - the most recent entries sit in a fixed-size in-memory ring.
+// Memory per account is therefore bounded however old the account is.
+// Writers reserve an index with fetch_add, fill the ring slot and publish
+// it without locking. Once the ring is three quarters full, the oldest
+// entries are sealed under sealMutex (encoded and queued; the HistoryStore
+// writes them to disk in the background); a writer only waits when the
+// ring is completely full. Readers hold sealMutex so the in-memory window
+// does not move under them.
+class TransactionLog {
+private:
+    static const uint32_t HOT_CAPACITY = 16; // Recent transactions kept in memory
+    static const uint32_t SEAL_BATCH = 8;    // Oldest transactions sealed at a time
+
+    struct Ring {
+        Transaction entries[HOT_CAPACITY];
+        atomic<uint32_t> published[HOT_CAPACITY]; // index + 1 once entries[index % HOT_CAPACITY] is written
+
+        Ring() {
+            for (atomic<uint32_t>& flag : published) {
+                flag.store(0, memory_order_relaxed);
+            }
+        }
+    };
+
+    atomic<uint32_t> count;     // Entries reserved so far
+    atomic<uint32_t> sealed;    // Oldest entries already moved to the HistoryStore
+    atomic<Ring*> ring;         // Allocated with the first transaction
+    mutable mutex sealMutex;    // Guards lastSegment and moving 'sealed'
+    uint64_t lastSegment;       // Newest sealed segment
+    const Transaction* archived; // Entries in a mapped snapshot, before all others
+    uint32_t archivedCount;
+
+    Ring* getRing() {
+        Ring* hot = ring.load(memory_order_acquire);
+        if (!hot) {
+            Ring* fresh = new Ring();
+            if (ring.compare_exchange_strong(hot, fresh, memory_order_acq_rel)) {
+                hot = fresh;
+            } else {
+                delete fresh;
+            }
+        }
+        return hot;
+    }
+
+    // Move up to SEAL_BATCH of the oldest published entries to the
+    // HistoryStore (caller holds sealMutex); returns false if the oldest is not written yet
+    bool sealLocked(Ring* hot) {
+        uint32_t first = sealed.load(memory_order_relaxed);
+        Transaction batch[SEAL_BATCH];
+        uint32_t n = 0;
+        while (n < SEAL_BATCH &&
+               hot->published[(first + n) % HOT_CAPACITY].load(memory_order_acquire) == first + n + 1) {
+            batch[n] = hot->entries[(first + n) % HOT_CAPACITY];
+            n++;
+        }
+        if (n == 0) {
+            return false;
+        }
+        lastSegment = HistoryStore::instance().seal(batch, n, lastSegment);
+        sealed.store(first + n, memory_order_release);
+        return true;
+    }
+
+public:
+    // Constructor
+    TransactionLog()
+        : count(0), sealed(0), ring(nullptr), lastSegment(HistoryStore::NO_SEGMENT),
+          archived(nullptr), archivedCount(0) {}
+
+    // Destructor
+    ~TransactionLog() {
+        delete ring.load();
+    }
+
+    TransactionLog(const TransactionLog&) = delete;
+    TransactionLog& operator=(const TransactionLog&) = delete;
+
+    // Add a transaction; safe to call from several threads at once
+    void append(const Transaction& transaction) {
+        Ring* hot = getRing();
+        uint32_t index = count.fetch_add(1, memory_order_relaxed);
+
+        // The slot is free once the entry HOT_CAPACITY before it is sealed
+        while (index - sealed.load(memory_order_acquire) >= HOT_CAPACITY) {
+            bool progress;
+            {
+                lock_guard<mutex> lock(sealMutex);
+                progress = index - sealed.load(memory_order_relaxed) < HOT_CAPACITY || sealLocked(hot);
+            }
+            if (!progress) {
+                this_thread::yield(); // Another writer is still filling the oldest slot
+            }
+        }
+        hot->entries[index % HOT_CAPACITY] = transaction;
+        hot->published[index % HOT_CAPACITY].store(index + 1, memory_order_release);
+
+        // Seal early so writers rarely have to wait
+        uint32_t oldest = sealed.load(memory_order_acquire);
+        if (index >= oldest && index + 1 - oldest >= HOT_CAPACITY - HOT_CAPACITY / 4) {
+            unique_lock<mutex> lock(sealMutex, try_to_lock);
+            if (lock.owns_lock()) {
+                sealLocked(hot);
+            }
+        }
+    }
+
+    // Use entries kept in a mapped snapshot as the oldest part of the history
+    // (before the log is shared between threads)
+    void attachArchive(const Transaction* entries, uint32_t entryCount) {
+        archived = entries;
+        archivedCount = entryCount;
+    }
+
+    // Visit published transactions, oldest first, across all tiers
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        for (uint32_t index = 0; index < archivedCount; index++) {
+            visit(archived[index]);
+        }
+        lock_guard<mutex> lock(sealMutex);
+        if (lastSegment != HistoryStore::NO_SEGMENT) {
+            HistoryStore::instance().forEach(lastSegment, visit);
+        }
+        Ring* hot = ring.load(memory_order_acquire);
+        if (!hot) {
+            return;
+        }
+        uint32_t total = count.load(memory_order_acquire);
+        for (uint32_t index = sealed.load(memory_order_relaxed); index < total; index++) {
+            if (hot->published[index % HOT_CAPACITY].load(memory_order_acquire) != index + 1) break;
+            visit(hot->entries[index % HOT_CAPACITY]);
+        }
+    }
+
+    size_t size() const { return archivedCount + count.load(memory_order_acquire); }
+    bool empty() const { return size() == 0; }
+};
+
+// Kinds of accounts
+enum class AccountType : uint8_t {
+    Regular,
+    Savings
+};
+
+// Aggregates over all balances in a ledger
+struct BalanceStats {
+    Money total;
+    Money minBalance;
+    Money maxBalance;
+    size_t maxSlot; // First slot holding maxBalance
+};
+
+// Customer and account counts with the total balance, read together
+struct SystemTotals {
+    size_t customers;
+    size_t accounts;
+    Money total;
+};
+
+// An account on its way from one shard to another. Its balance, terms and
+// customer move; its transaction history does not: the moved account starts
+// with an empty history, and the old shard keeps the earlier transactions
+// only until its next snapshot.
+struct AccountMove {
+    int accountNumber;
+    AccountType type;
+    Money balance;
+    Money limit;              // Savings only
+    double rate;              // Savings only
+    int withdrawalsThisMonth; // Savings only
+    string ownerName;
+    int customerID;           // 0 if the account has no customer
+    string customerName;
+
+    AccountMove()
+        : accountNumber(0), type(AccountType::Regular), rate(0.0), withdrawalsThisMonth(0), customerID(0) {}
+};
+
+// Order-statistics index over ledger balances.
+// A counted B+tree keyed by (balance, slot): leaves hold sorted keys and are
+// linked in key order, and inner nodes keep the number of keys under each
+// child. Rank, k-th element, top-K and range queries run in O(log n) plus the
+// size of the answer. Nodes are wide, so the inner levels of even a large
+// index stay in cache and a balance change costs a few leaf cache misses.
+// Not thread-safe on its own; BalanceLedger guards it.
+class BalanceOrderIndex {
+private:
+    static const uint32_t NIL = UINT32_MAX;
+    static const uint32_t LEAF_CAPACITY = 64;
+    static const uint32_t INNER_CAPACITY = 64;
+
+    struct Key {
+        int64_t balance;
+        uint32_t slot;
+    };
+
+    struct Leaf {
+        uint32_t size;
+        uint32_t prev; // Neighbouring leaves in key order
+        uint32_t next;
+        Key keys[LEAF_CAPACITY];
+    };
+
+    // children[i] holds the keys from separators[i] up to separators[i + 1];
+    // separators[0] is unused. counts[i] is the number of keys under children[i].
+    struct Inner {
+        uint32_t size;
+        Key separators[INNER_CAPACITY];
+        uint32_t children[INNER_CAPACITY];
+        uint32_t counts[INNER_CAPACITY];
+    };
+
+    vector<Leaf> leaves;
+    vector<Inner> inners;
+    vector<uint32_t> freeLeaves;
+    vector<uint32_t> freeInners;
+    vector<int64_t> balances; // Indexed balance of each slot
+    vector<uint8_t> removed;  // 1 for slots taken out of the index
+    uint32_t removedCount;
+    uint32_t root;
+    uint32_t height;          // 0 while the root is a leaf
+    uint32_t lastLeaf;
+
+    static bool keyLess(const Key& a, const Key& b) {
+        return a.balance < b.balance || (a.balance == b.balance && a.slot < b.slot);
+    }
+
+    uint32_t allocateLeaf() {
+        if (!freeLeaves.empty()) {
+            uint32_t leaf = freeLeaves.back();
+            freeLeaves.pop_back();
+            return leaf;
+        }
+        leaves.emplace_back();
+        return (uint32_t)(leaves.size() - 1);
+    }
+
+    uint32_t allocateInner() {
+        if (!freeInners.empty()) {
+            uint32_t inner = freeInners.back();
+            freeInners.pop_back();
+            return inner;
+        }
+        inners.emplace_back();
+        return (uint32_t)(inners.size() - 1);
+    }
+
+    // Position of the first key not below 'key' in a leaf
+    uint32_t lowerBound(const Leaf& leaf, const Key& key) const {
+        uint32_t lo = 0, hi = leaf.size;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            if (keyLess(leaf.keys[mid], key)) lo = mid + 1; else hi = mid;
+        }
+        return lo;
+    }
+
+    // Child of an inner node whose range contains 'key'
+    uint32_t childIndex(const Inner& inner, const Key& key) const {
+        uint32_t lo = 1, hi = inner.size;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            if (keyLess(key, inner.separators[mid])) hi = mid; else lo = mid + 1;
+        }
+        return lo - 1;
+    }
+
+    uint32_t nodeSize(uint32_t node, uint32_t level) const {
+        return level == 0 ? leaves[node].size : inners[node].size;
+    }
+
+    uint32_t subtreeCount(uint32_t node, uint32_t level) const {
+        if (level == 0) {
+            return leaves[node].size;
+        }
+        uint32_t total = 0;
+        for (uint32_t i = 0; i < inners[node].size; i++) {
+            total += inners[node].counts[i];
+        }
+        return total;
+    }
+
+    // Drop entry i of an inner node
+    void removeEntry(Inner& inner, uint32_t i) {
+        uint32_t tail = inner.size - i - 1;
+        memmove(&inner.separators[i], &inner.separators[i + 1], tail * sizeof(Key));
+        memmove(&inner.children[i], &inner.children[i + 1], tail * sizeof(uint32_t));
+        memmove(&inner.counts[i], &inner.counts[i + 1], tail * sizeof(uint32_t));
+        inner.size--;
+    }
+
+    // Unlink a leaf from the leaf list and free it
+    void releaseLeaf(uint32_t leaf) {
+        uint32_t prev = leaves[leaf].prev, next = leaves[leaf].next;
+        if (prev != NIL) leaves[prev].next = next;
+        if (next != NIL) leaves[next].prev = prev; else lastLeaf = prev;
+        freeLeaves.push_back(leaf);
+    }
+
+    // Insert under a node at the given level. If the node had to split,
+    // returns true with the new right sibling and its first key.
+    bool insertInto(uint32_t node, uint32_t level, const Key& key, Key& splitKey, uint32_t& splitNode) {
+        if (level == 0) {
+            Leaf& leaf = leaves[node];
+            uint32_t pos = lowerBound(leaf, key);
+            memmove(&leaf.keys[pos + 1], &leaf.keys[pos], (leaf.size - pos) * sizeof(Key));
+            leaf.keys[pos] = key;
+            if (++leaf.size < LEAF_CAPACITY) {
+                return false;
+            }
+            uint32_t right = allocateLeaf(); // May move the leaves
+            Leaf& left = leaves[node];
+            Leaf& sibling = leaves[right];
+            uint32_t half = LEAF_CAPACITY / 2;
+            sibling.size = LEAF_CAPACITY - half;
+            memcpy(sibling.keys, left.keys + half, sibling.size * sizeof(Key));
+            left.size = half;
+            sibling.prev = node;
+            sibling.next = left.next;
+            if (left.next != NIL) leaves[left.next].prev = right; else lastLeaf = right;
+            left.next = right;
+            splitKey = sibling.keys[0];
+            splitNode = right;
+            return true;
+        }
+
+        uint32_t i = childIndex(inners[node], key);
+        inners[node].counts[i]++;
+        Key childKey;
+        uint32_t childNode;
+        if (!insertInto(inners[node].children[i], level - 1, key, childKey, childNode)) {
+            return false;
+        }
+
+        // The child split: add its new sibling after it
+        uint32_t rightCount = subtreeCount(childNode, level - 1);
+        Inner& inner = inners[node];
+        uint32_t tail = inner.size - i - 1;
+        memmove(&inner.separators[i + 2], &inner.separators[i + 1], tail * sizeof(Key));
+        memmove(&inner.children[i + 2], &inner.children[i + 1], tail * sizeof(uint32_t));
+        memmove(&inner.counts[i + 2], &inner.counts[i + 1], tail * sizeof(uint32_t));
+        inner.separators[i + 1] = childKey;
+        inner.children[i + 1] = childNode;
+        inner.counts[i + 1] = rightCount;
+        inner.counts[i] -= rightCount;
+        if (++inner.size < INNER_CAPACITY) {
+            return false;
+        }
+
+        uint32_t right = allocateInner(); // May move the inner nodes
+        Inner& left = inners[node];
+        Inner& sibling = inners[right];
+        uint32_t half = INNER_CAPACITY / 2;
+        sibling.size = INNER_CAPACITY - half;
+        memcpy(sibling.separators, left.separators + half, sibling.size * sizeof(Key));
+        memcpy(sibling.children, left.children + half, sibling.size * sizeof(uint32_t));
+        memcpy(sibling.counts, left.counts + half, sibling.size * sizeof(uint32_t));
+        left.size = half;
+        splitKey = sibling.separators[0];
+        splitNode = right;
+        return true;
+    }
+
+    // Remove a key (which must be present) under a node at the given level
+    void eraseFrom(uint32_t node, uint32_t level, const Key& key) {
+        if (level == 0) {
+            Leaf& leaf = leaves[node];
+            uint32_t pos = lowerBound(leaf, key);
+            memmove(&leaf.keys[pos], &leaf.keys[pos + 1], (leaf.size - pos - 1) * sizeof(Key));
+            leaf.size--;
+            return;
+        }
+        uint32_t i = childIndex(inners[node], key);
+        inners[node].counts[i]--;
+        eraseFrom(inners[node].children[i], level - 1, key);
+        rebalanceChild(node, level, i);
+    }
+
+    // Merge child i with a neighbour once it falls below a quarter full and
+    // the pair fits in three quarters of a node; drop it if it is empty.
+    void rebalanceChild(uint32_t node, uint32_t level, uint32_t i) {
+        Inner& parent = inners[node];
+        uint32_t capacity = level == 1 ? LEAF_CAPACITY : INNER_CAPACITY;
+        uint32_t childSize = nodeSize(parent.children[i], level - 1);
+        if (childSize >= capacity / 4 || parent.size == 1) {
+            return;
+        }
+
+        uint32_t l = i + 1 < parent.size ? i : i - 1;
+        uint32_t left = parent.children[l], right = parent.children[l + 1];
+        uint32_t leftSize = nodeSize(left, level - 1), rightSize = nodeSize(right, level - 1);
+        if (leftSize + rightSize <= capacity * 3 / 4) {
+            if (level == 1) {
+                memcpy(leaves[left].keys + leftSize, leaves[right].keys, rightSize * sizeof(Key));
+                leaves[left].size += rightSize;
+                releaseLeaf(right);
+            } else {
+                Inner& target = inners[left];
+                const Inner& source = inners[right];
+                target.separators[leftSize] = parent.separators[l + 1];
+                memcpy(target.separators + leftSize + 1, source.separators + 1, (rightSize - 1) * sizeof(Key));
+                memcpy(target.children + leftSize, source.children, rightSize * sizeof(uint32_t));
+                memcpy(target.counts + leftSize, source.counts, rightSize * sizeof(uint32_t));
+                target.size += rightSize;
+                freeInners.push_back(right);
+            }
+            parent.counts[l] += parent.counts[l + 1];
+            removeEntry(parent, l + 1);
+        } else if (childSize == 0 && level == 1) {
+            releaseLeaf(parent.children[i]);
+            removeEntry(parent, i);
+        }
+    }
+
+    // Leaf holding the first key not below 'key' (or the leaf it would go in)
+    uint32_t findLeaf(const Key& key) const {
+        uint32_t node = root;
+        for (uint32_t level = height; level > 0; level--) {
+            node = inners[node].children[childIndex(inners[node], key)];
+        }
+        return node;
+    }
+
+    void insertKey(const Key& key) {
+        Key splitKey;
+        uint32_t splitNode;
+        if (!insertInto(root, height, key, splitKey, splitNode)) {
+            return;
+        }
+        uint32_t oldRoot = root;
+        uint32_t newRoot = allocateInner();
+        Inner& inner = inners[newRoot];
+        inner.size = 2;
+        inner.children[0] = oldRoot;
+        inner.children[1] = splitNode;
+        inner.separators[1] = splitKey;
+        inner.counts[1] = subtreeCount(splitNode, height);
+        inner.counts[0] = subtreeCount(oldRoot, height);
+        root = newRoot;
+        height++;
+    }
+
+    void eraseKey(const Key& key) {
+        eraseFrom(root, height, key);
+        while (height > 0 && inners[root].size == 1) {
+            freeInners.push_back(root);
+            root = inners[root].children[0];
+            height--;
+        }
+    }
+
+public:
+    // Constructor
+    BalanceOrderIndex() : removedCount(0), height(0) {
+        root = allocateLeaf();
+        leaves[root].size = 0;
+        leaves[root].prev = leaves[root].next = NIL;
+        lastLeaf = root;
+    }
+
+    // Index a new slot (slots are added in order 0, 1, 2, ...)
+    void add(int64_t balance) {
+        uint32_t slot = (uint32_t)balances.size();
+        balances.push_back(balance);
+        removed.push_back(0);
+        insertKey(Key{balance, slot});
+    }
+
+    // Take a slot out of the index for good; later updates to it are ignored
+    void remove(uint32_t slot) {
+        if (removed[slot]) {
+            return;
+        }
+        eraseKey(Key{balances[slot], slot});
+        removed[slot] = 1;
+        removedCount++;
+    }
+
+    // Move a slot to its new balance
+    void update(uint32_t slot, int64_t balance) {
+        if (removed[slot] || balances[slot] == balance) {
+            return;
+        }
+        eraseKey(Key{balances[slot], slot});
+        balances[slot] = balance;
+        insertKey(Key{balance, slot});
+    }
+
+    // Re-index every slot with balanceOf(slot): sort the keys and build the
+    // tree bottom-up from nodes three quarters full. Cheaper than update()
+    // once a large share of the slots have moved.
+    template <typename BalanceOf>
+    void rebuild(BalanceOf balanceOf) {
+        const uint32_t LEAF_FILL = LEAF_CAPACITY * 3 / 4;
+        const uint32_t INNER_FILL = INNER_CAPACITY * 3 / 4;
+        vector<Key> keys;
+        keys.reserve(size());
+        for (uint32_t slot = 0; slot < balances.size(); slot++) {
+            if (!removed[slot]) {
+                balances[slot] = balanceOf(slot);
+                keys.push_back(Key{balances[slot], slot});
+            }
+        }
+        size_t n = keys.size();
+        sort(keys.begin(), keys.end(), keyLess);
+        leaves.clear();
+        inners.clear();
+        freeLeaves.clear();
+        freeInners.clear();
+
+        // Nodes of the level just built, with their first keys and key counts
+        size_t leafCount = max<size_t>(1, (n + LEAF_FILL - 1) / LEAF_FILL);
+        vector<uint32_t> level(leafCount);
+        vector<Key> firstKeys(leafCount);
+        vector<uint32_t> counts(leafCount);
+        leaves.resize(leafCount);
+        for (size_t l = 0; l < leafCount; l++) {
+            size_t begin = n * l / leafCount, end = n * (l + 1) / leafCount;
+            Leaf& leaf = leaves[l];
+            leaf.size = (uint32_t)(end - begin);
+            memcpy(leaf.keys, keys.data() + begin, leaf.size * sizeof(Key));
+            leaf.prev = l ? (uint32_t)(l - 1) : NIL;
+            leaf.next = l + 1 < leafCount ? (uint32_t)(l + 1) : NIL;
+            level[l] = (uint32_t)l;
+            firstKeys[l] = leaf.size ? leaf.keys[0] : Key{0, 0};
+            counts[l] = leaf.size;
+        }
+        lastLeaf = (uint32_t)(leafCount - 1);
+        height = 0;
+        while (level.size() > 1) {
+            size_t parents = (level.size() + INNER_FILL - 1) / INNER_FILL;
+            vector<uint32_t> upper(parents);
+            vector<Key> upperKeys(parents);
+            vector<uint32_t> upperCounts(parents);
+            for (size_t p = 0; p < parents; p++) {
+                size_t begin = level.size() * p / parents, end = level.size() * (p + 1) / parents;
+                uint32_t node = allocateInner();
+                Inner& inner = inners[node];
+                inner.size = (uint32_t)(end - begin);
+                uint32_t total = 0;
+                for (size_t i = begin; i < end; i++) {
+                    inner.separators[i - begin] = firstKeys[i];
+                    inner.children[i - begin] = level[i];
+                    inner.counts[i - begin] = counts[i];
+                    total += counts[i];
+                }
+                upper[p] = node;
+                upperKeys[p] = firstKeys[begin];
+                upperCounts[p] = total;
+            }
+            level.swap(upper);
+            firstKeys.swap(upperKeys);
+            counts.swap(upperCounts);
+            height++;
+        }
+        root = level[0];
+    }
+
+    // Number of slots in the index (removed ones do not count)
+    size_t size() const { return balances.size() - removedCount; }
+    int64_t getBalance(uint32_t slot) const { return balances[slot]; }
+
+    // Slot with the k-th smallest balance (k from 0); k must be below size()
+    uint32_t kth(size_t k) const {
+        uint32_t node = root;
+        for (uint32_t level = height; level > 0; level--) {
+            const Inner& inner = inners[node];
+            uint32_t i = 0;
+            while (k >= inner.counts[i]) {
+                k -= inner.counts[i];
+                i++;
+            }
+            node = inner.children[i];
+        }
+        return leaves[node].keys[k].slot;
+    }
+
+    // Number of slots with a balance below the given one
+    size_t countBelow(int64_t balance) const {
+        Key key = {balance, 0};
+        size_t count = 0;
+        uint32_t node = root;
+        for (uint32_t level = height; level > 0; level--) {
+            const Inner& inner = inners[node];
+            uint32_t i = childIndex(inner, key);
+            for (uint32_t j = 0; j < i; j++) {
+                count += inner.counts[j];
+            }
+            node = inner.children[i];
+        }
+        return count + lowerBound(leaves[node], key);
+    }
+
+    // Up to k slots with the highest balances, highest first
+    vector<uint32_t> top(size_t k) const {
+        vector<uint32_t> out;
+        out.reserve(min(k, size()));
+        for (uint32_t leaf = lastLeaf; leaf != NIL && out.size() < k; leaf = leaves[leaf].prev) {
+            for (uint32_t i = leaves[leaf].size; i > 0 && out.size() < k; i--) {
+                out.push_back(leaves[leaf].keys[i - 1].slot);
+            }
+        }
+        return out;
+    }
+
+    // Slots with balances in [lo, hi], lowest first
+    vector<uint32_t> range(int64_t lo, int64_t hi) const {
+        vector<uint32_t> out;
+        Key key = {lo, 0};
+        uint32_t leaf = findLeaf(key);
+        for (uint32_t i = lowerBound(leaves[leaf], key); leaf != NIL; leaf = leaves[leaf].next, i = 0) {
+            for (; i < leaves[leaf].size; i++) {
+                if (leaves[leaf].keys[i].balance > hi) {
+                    return out;
+                }
+                out.push_back(leaves[leaf].keys[i].slot);
+            }
+        }
+        return out;
+    }
+};
+
+// Columnar (structure-of-arrays) copy of per-account data.
+// Each account owns one slot; balances (in cents), types and owners sit in
+// separate contiguous columns so summary scans read only the bytes they need.
+// Balances are updated with atomic adds, so accounts can post changes without
+// a lock. The scans use AVX-512 or AVX2 when the CPU supports them.
+//
+// The ledger also keeps aggregates over the balances: the total is a running
+// atomic sum, per-type counts are counters, and min/max come from a segment
+// tree over blocks of BLOCK_SLOTS slots. A BalanceOrderIndex over the same
+// balances answers rank, percentile, top-K and range queries.
+// A balance change takes no lock: it only marks its slot in a dirty bitmap
+// (plus a bit per dirty word, so finding the marks is cheap). Queries
+// refresh the dirty slots first: each dirty block is rescanned and its
+// ancestors re-merged, so the minimum and maximum stay exact when balances
+// go down too, and each dirty slot is moved in the order index once.
+// An account that leaves (moves to another shard) keeps its slot, but the
+// slot is marked removed and drops out of every aggregate and query.
+class BalanceLedger {
+private:
+    static const size_t BLOCK_SLOTS = 64;
+    static const int TYPE_COUNT = 2; // Number of AccountType values
+    static const uint8_t REMOVED_TYPE = TYPE_COUNT; // Type column value of a removed slot
+    static_assert(BLOCK_SLOTS % 64 == 0, "A word of dirty bits must not span blocks");
+
+    // Minimum, maximum and first slot holding the maximum of a range of slots
+    struct RangeSummary {
+        int64_t minValue;
+        int64_t maxValue;
+        size_t maxSlot;
+    };
+
+    vector<int64_t> balances;
+    vector<uint8_t> types;
+    vector<int32_t> owners; // Owning customer index, -1 if unassigned
+    atomic<int64_t> totalCents;
+    size_t typeCounts[TYPE_COUNT];
+    size_t removedSlots;
+    // Brought up to date lazily, so the const queries refresh them too
+    mutable vector<RangeSummary> tree; // tree[1] is the root; block b is leaf leafBase + b
+    size_t leafBase;
+    mutable BalanceOrderIndex order;
+    mutable mutex treeMutex;           // Guards tree, order and the counters
+    mutable vector<uint64_t> dirty;      // One bit per slot changed since the last refresh
+    mutable vector<uint64_t> dirtyWords; // One bit per word of 'dirty' that may have bits set
+    mutable vector<pair<size_t, uint64_t>> refreshing; // Scratch: words taken by a refresh
+
+    static RangeSummary emptySummary() {
+        return RangeSummary{INT64_MAX, INT64_MIN, 0};
+    }
+
+    // Combine two neighbouring ranges; ties keep the left (earlier) slot
+    static RangeSummary merge(const RangeSummary& left, const RangeSummary& right) {
+        RangeSummary merged = left;
+        if (right.minValue < merged.minValue) {
+            merged.minValue = right.minValue;
+        }
+        if (right.maxValue > merged.maxValue) {
+            merged.maxValue = right.maxValue;
+            merged.maxSlot = right.maxSlot;
+        }
+        return merged;
+    }
+
+    // Scan one block (caller holds treeMutex). Other slots in the block may
+    // be changing, so each balance is read atomically (and in order with the
+    // dirty marks, see addBalance).
+    RangeSummary summarizeBlock(size_t block) const {
+        RangeSummary summary = emptySummary();
+        size_t end = min(balances.size(), (block + 1) * BLOCK_SLOTS);
+        for (size_t i = block * BLOCK_SLOTS; i < end; i++) {
+            if (types[i] == REMOVED_TYPE) {
+                continue;
+            }
+            int64_t value = __atomic_load_n(&balances[i], __ATOMIC_SEQ_CST);
+            if (value < summary.minValue) summary.minValue = value;
+            if (value > summary.maxValue) {
+                summary.maxValue = value;
+                summary.maxSlot = i;
+            }
+        }
+        return summary;
+    }
+
+    // Store a node's new summary; false if it did not change
+    bool updateNode(size_t node, const RangeSummary& summary) const {
+        RangeSummary& current = tree[node];
+        if (current.minValue == summary.minValue && current.maxValue == summary.maxValue &&
+            current.maxSlot == summary.maxSlot) {
+            return false;
+        }
+        current = summary;
+        return true;
+    }
+
+    // Rescan a block and re-merge its ancestors, stopping as soon as a node
+    // is unchanged (caller holds treeMutex)
+    void refreshBlock(size_t block) const {
+        size_t node = leafBase + block;
+        if (!updateNode(node, summarizeBlock(block))) {
+            return;
+        }
+        for (node /= 2; node > 0; node /= 2) {
+            if (!updateNode(node, merge(tree[2 * node], tree[2 * node + 1]))) {
+                return;
+            }
+        }
+    }
+
+    // Bring the tree and the order index up to date with every slot marked
+    // dirty (caller holds treeMutex). Each word is cleared before its slots
+    // are read, so a change that races with the refresh stays marked.
+    // Moving a slot in the order index costs a few cache misses, so once
+    // more than 1/16 of the slots are dirty the index is rebuilt instead.
+    void refreshDirtyLocked() const {
+        refreshing.clear();
+        size_t dirtySlots = 0;
+        for (size_t group = 0; group < dirtyWords.size(); group++) {
+            if (!__atomic_load_n(&dirtyWords[group], __ATOMIC_RELAXED)) {
+                continue;
+            }
+            uint64_t words = __atomic_exchange_n(&dirtyWords[group], 0, __ATOMIC_SEQ_CST);
+            while (words) {
+                size_t word = group * 64 + __builtin_ctzll(words);
+                words &= words - 1;
+                uint64_t bits = __atomic_exchange_n(&dirty[word], 0, __ATOMIC_SEQ_CST);
+                if (bits) {
+                    refreshBlock(word * 64 / BLOCK_SLOTS);
+                    refreshing.push_back(make_pair(word, bits));
+                    dirtySlots += __builtin_popcountll(bits);
+                }
+            }
+        }
+        if (dirtySlots > balances.size() / 16) {
+            order.rebuild([&](uint32_t slot) { return __atomic_load_n(&balances[slot], __ATOMIC_SEQ_CST); });
+            return;
+        }
+        for (const pair<size_t, uint64_t>& entry : refreshing) {
+            for (uint64_t bits = entry.second; bits; bits &= bits - 1) {
+                uint32_t slot = (uint32_t)(entry.first * 64 + __builtin_ctzll(bits));
+                order.update(slot, __atomic_load_n(&balances[slot], __ATOMIC_SEQ_CST));
+            }
+        }
+    }
+
+    // Double the number of leaves and rebuild the tree (caller holds treeMutex)
+    void growTree() {
+        leafBase *= 2;
+        tree.assign(2 * leafBase, emptySummary());
+        size_t blocks = (balances.size() + BLOCK_SLOTS - 1) / BLOCK_SLOTS;
+        for (size_t block = 0; block < blocks; block++) {
+            tree[leafBase + block] = summarizeBlock(block);
+        }
+        for (size_t node = leafBase - 1; node > 0; node--) {
+            tree[node] = merge(tree[2 * node], tree[2 * node + 1]);
+        }
+    }
+
+    enum SimdLevel { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+
+    static SimdLevel detectSimd() {
+#ifdef BANK_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+            return SIMD_AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return SIMD_AVX2;
+        }
+#endif
+        return SIMD_SCALAR;
+    }
+
+    static SimdLevel simdLevel() {
+        static const SimdLevel level = detectSimd();
+        return level;
+    }
+
+    // Scalar kernels (also used for the tails of the vector kernels)
+    static void sumMinMaxScalar(const int64_t* values, size_t begin, size_t end,
+                                int64_t& sum, int64_t& minValue, int64_t& maxValue) {
+        for (size_t i = begin; i < end; i++) {
+            sum += values[i];
+            if (values[i] < minValue) minValue = values[i];
+            if (values[i] > maxValue) maxValue = values[i];
+        }
+    }
+
+    static size_t findFirstScalar(const int64_t* values, size_t begin, size_t end, int64_t value) {
+        for (size_t i = begin; i < end; i++) {
+            if (values[i] == value) return i;
+        }
+        return end;
+    }
+
+#ifdef BANK_X86_SIMD
+    __attribute__((target("avx2")))
+    static void sumMinMaxAvx2(const int64_t* values, size_t n,
+                              int64_t& sum, int64_t& minValue, int64_t& maxValue) {
+        __m256i vsum = _mm256_setzero_si256();
+        __m256i vmin = _mm256_set1_epi64x(minValue);
+        __m256i vmax = _mm256_set1_epi64x(maxValue);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(values + i));
+            vsum = _mm256_add_epi64(vsum, x);
+            vmin = _mm256_blendv_epi8(vmin, x, _mm256_cmpgt_epi64(vmin, x));
+            vmax = _mm256_blendv_epi8(vmax, x, _mm256_cmpgt_epi64(x, vmax));
+        }
+        int64_t lanes[4];
+        _mm256_storeu_si256((__m256i*)lanes, vsum);
+        sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        _mm256_storeu_si256((__m256i*)lanes, vmin);
+        for (int64_t lane : lanes) if (lane < minValue) minValue = lane;
+        _mm256_storeu_si256((__m256i*)lanes, vmax);
+        for (int64_t lane : lanes) if (lane > maxValue) maxValue = lane;
+        sumMinMaxScalar(values, i, n, sum, minValue, maxValue);
+    }
+
+    __attribute__((target("avx2")))
+    static size_t findFirstAvx2(const int64_t* values, size_t n, int64_t value) {
+        __m256i target = _mm256_set1_epi64x(value);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m256i equal = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(values + i)), target);
+            int mask = _mm256_movemask_pd(_mm256_castsi256_pd(equal));
+            if (mask) return i + __builtin_ctz(mask);
+        }
+        return findFirstScalar(values, i, n, value);
+    }
+
+    // GCC 12's AVX-512 headers trip -Wmaybe-uninitialized inside _mm512_min_epi64
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+    __attribute__((target("avx512f")))
+    static void sumMinMaxAvx512(const int64_t* values, size_t n,
+                                int64_t& sum, int64_t& minValue, int64_t& maxValue) {
+        __m512i vsum = _mm512_setzero_si512();
+        __m512i vmin = _mm512_set1_epi64(minValue);
+        __m512i vmax = _mm512_set1_epi64(maxValue);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m512i x = _mm512_loadu_si512((const void*)(values + i));
+            vsum = _mm512_add_epi64(vsum, x);
+            vmin = _mm512_min_epi64(vmin, x);
+            vmax = _mm512_max_epi64(vmax, x);
+        }
+        int64_t lanes[8];
+        _mm512_storeu_si512((void*)lanes, vsum);
+        for (int64_t lane : lanes) sum += lane;
+        _mm512_storeu_si512((void*)lanes, vmin);
+        for (int64_t lane : lanes) if (lane < minValue) minValue = lane;
+        _mm512_storeu_si512((void*)lanes, vmax);
+        for (int64_t lane : lanes) if (lane > maxValue) maxValue = lane;
+        sumMinMaxScalar(values, i, n, sum, minValue, maxValue);
+    }
+#pragma GCC diagnostic pop
+
+    __attribute__((target("avx512f")))
+    static size_t findFirstAvx512(const int64_t* values, size_t n, int64_t value) {
+        __m512i target = _mm512_set1_epi64(value);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __mmask8 mask = _mm512_cmpeq_epi64_mask(_mm512_loadu_si512((const void*)(values + i)), target);
+            if (mask) return i + __builtin_ctz(mask);
+        }
+        return findFirstScalar(values, i, n, value);
+    }
+
+#endif
+
+public:
+    // Constructor
+    BalanceLedger() : totalCents(0), typeCounts(), removedSlots(0), tree(2, emptySummary()), leafBase(1) {}
+
+    // Add a slot for a new account and return its index
+    uint32_t addAccount(Money balance, AccountType type) {
+        lock_guard<mutex> lock(treeMutex);
+        balances.push_back(balance.getCents());
+        types.push_back((uint8_t)type);
+        owners.push_back(-1);
+        if (balances.size() > dirty.size() * 64) {
+            dirty.push_back(0);
+            if (dirty.size() > dirtyWords.size() * 64) {
+                dirtyWords.push_back(0);
+            }
+        }
+        totalCents.fetch_add(balance.getCents(), memory_order_relaxed);
+        typeCounts[(int)type]++;
+        order.add(balance.getCents());
+
+        size_t slot = balances.size() - 1;
+        if (slot / BLOCK_SLOTS >= leafBase) {
+            growTree();
+        } else {
+            refreshBlock(slot / BLOCK_SLOTS);
+        }
+        return (uint32_t)slot;
+    }
+
+    // Post a balance change; safe to call from several threads at once.
+    // The change and the checks of its marks are sequentially consistent
+    // with the refresh clearing them: if a mark is seen set, the refresh
+    // that clears it reads the new balance, so a query that starts after
+    // this returns sees it. (On x86 this costs nothing over relaxed.)
+    void addBalance(uint32_t slot, int64_t deltaCents) {
+        __atomic_fetch_add(&balances[slot], deltaCents, __ATOMIC_SEQ_CST);
+        totalCents.fetch_add(deltaCents, memory_order_relaxed);
+        uint64_t bit = 1ull << (slot % 64);
+        size_t word = slot / 64;
+        if (!(__atomic_load_n(&dirty[word], __ATOMIC_SEQ_CST) & bit)) {
+            __atomic_fetch_or(&dirty[word], bit, __ATOMIC_SEQ_CST);
+        }
+        uint64_t wordBit = 1ull << (word % 64);
+        if (!(__atomic_load_n(&dirtyWords[word / 64], __ATOMIC_SEQ_CST) & wordBit)) {
+            __atomic_fetch_or(&dirtyWords[word / 64], wordBit, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    // Refresh min/max and the order index now (e.g. after a bulk import),
+    // instead of in the next query
+    void refresh() {
+        lock_guard<mutex> lock(treeMutex);
+        refreshDirtyLocked();
+    }
+
+    // Drop an account's slot from the totals, counts and queries. Its
+    // balance must no longer change.
+    void removeAccount(uint32_t slot) {
+        lock_guard<mutex> lock(treeMutex);
+        if (types[slot] == REMOVED_TYPE) {
+            return;
+        }
+        refreshDirtyLocked();
+        totalCents.fetch_sub(balances[slot], memory_order_relaxed);
+        typeCounts[types[slot]]--;
+        types[slot] = REMOVED_TYPE;
+        owners[slot] = -1;
+        removedSlots++;
+        order.remove(slot);
+        refreshBlock(slot / BLOCK_SLOTS);
+    }
+
+    void setOwner(uint32_t slot, int32_t owner) { owners[slot] = owner; }
+
+    // Getters
+    size_t size() const { return balances.size(); }
+    size_t accountCount() const { return balances.size() - removedSlots; } // Slots not removed
+    bool isRemoved(uint32_t slot) const { return types[slot] == REMOVED_TYPE; }
+    Money getBalance(uint32_t slot) const { return Money::fromCents(__atomic_load_n(&balances[slot], __ATOMIC_RELAXED)); }
+    AccountType getType(uint32_t slot) const { return (AccountType)types[slot]; }
+    int32_t getOwner(uint32_t slot) const { return owners[slot]; }
+
+    // Running total, minimum, maximum and first slot with the maximum balance
+    BalanceStats stats() const {
+        BalanceStats current = {Money(), Money(), Money(), 0};
+        lock_guard<mutex> lock(treeMutex);
+        refreshDirtyLocked();
+        if (accountCount() == 0) {
+            return current;
+        }
+        current.total = Money::fromCents(totalCents.load(memory_order_relaxed));
+        current.minBalance = Money::fromCents(tree[1].minValue);
+        current.maxBalance = Money::fromCents(tree[1].maxValue);
+        current.maxSlot = tree[1].maxSlot;
+        return current;
+    }
+
+    // The same figures recomputed with a full scan of the balance column
+    BalanceStats computeStats() const {
+        TRACE_SCOPE("BalanceLedger::computeStats");
+        BalanceStats stats = {Money(), Money(), Money(), 0};
+        size_t n = balances.size();
+        if (accountCount() == 0) {
+            return stats;
+        }
+        const int64_t* values = balances.data();
+        int64_t sum = 0, minValue = INT64_MAX, maxValue = INT64_MIN;
+        size_t maxSlot = 0;
+        // The vector kernels cannot skip removed slots
+        SimdLevel level = removedSlots ? SIMD_SCALAR : simdLevel();
+        switch (level) {
+#ifdef BANK_X86_SIMD
+            case SIMD_AVX512:
+                sumMinMaxAvx512(values, n, sum, minValue, maxValue);
+                maxSlot = findFirstAvx512(values, n, maxValue);
+                break;
+            case SIMD_AVX2:
+                sumMinMaxAvx2(values, n, sum, minValue, maxValue);
+                maxSlot = findFirstAvx2(values, n, maxValue);
+                break;
+#endif
+            default:
+                for (size_t i = 0; i < n; i++) {
+                    if (types[i] == REMOVED_TYPE) {
+                        continue;
+                    }
+                    sum += values[i];
+                    if (values[i] < minValue) minValue = values[i];
+                    if (values[i] > maxValue) {
+                        maxValue = values[i];
+                        maxSlot = i;
+                    }
+                }
+                break;
+        }
+        stats.total = Money::fromCents(sum);
+        stats.minBalance = Money::fromCents(minValue);
+        stats.maxBalance = Money::fromCents(maxValue);
+        stats.maxSlot = maxSlot;
+        return stats;
+    }
+
+    // Number of accounts of the given type
+    size_t countType(AccountType type) const {
+        lock_guard<mutex> lock(treeMutex);
+        return typeCounts[(int)type];
+    }
+
+    // Slot with the k-th lowest balance (k from 0); k must be below size()
+    uint32_t slotAtRank(size_t k) const {
+        lock_guard<mutex> lock(treeMutex);
+        refreshDirtyLocked();
+        return order.kth(k);
+    }
+
+    // Nearest-rank percentile of the balances (0-100); the ledger must not be empty
+    Money percentile(double percent) const {
+        lock_guard<mutex> lock(treeMutex);
+        refreshDirtyLocked();
+        size_t n = order.size();
+        double rank = ceil(percent / 100.0 * n);
+        size_t k = rank < 1 ? 0 : min((size_t)rank - 1, n - 1);
+        return Money::fromCents(order.getBalance(order.kth(k)));
+    }
+
+    // Number of slots with a balance below the given amount
+    size_t countBelow(Money balance) const {
+        lock_guard<mutex> lock(treeMutex);
+        refreshDirtyLocked();
+        return order.countBelow(balance.getCents());
+    }
+
+    // Up to k slots with the highest balances, highest first
+    vector<uint32_t> topSlots(size_t k) const {
+        lock_guard<mutex> lock(treeMutex);
+        refreshDirtyLocked();
+        return order.top(k);
+    }
+
+    // Slots with balances in [lo, hi], lowest first
+    vector<uint32_t> slotsInRange(Money lo, Money hi) const {
+        lock_guard<mutex> lock(treeMutex);
+        refreshDirtyLocked();
+        return order.range(lo.getCents(), hi.getCents());
+    }
+};
+
+// Outcome of a single banking operation
+enum class OperationStatus : uint8_t {
+    Success,
+    AccountNotFound,
+    InvalidAmount,
+    InsufficientFunds,
+    WithdrawalLimitReached, // Savings: monthly withdrawal count used up
+    ExceedsWithdrawalLimit, // Savings: amount above the per-withdrawal limit
+    NotDurable,             // Applied, but the journal failed before recording it
+    TransferDecided,        // Cross-shard: this side was already prepared, or the transfer aborted
+    AccountExists,          // Moving in: the number is taken here, or no more accounts fit
+    TransferPending         // Moving out: the account has a prepared cross-shard transfer
+};
+
+const char* operationStatusName(OperationStatus status) {
+    switch (status) {
+        case OperationStatus::Success: return "Success";
+        case OperationStatus::AccountNotFound: return "AccountNotFound";
+        case OperationStatus::InvalidAmount: return "InvalidAmount";
+        case OperationStatus::InsufficientFunds: return "InsufficientFunds";
+        case OperationStatus::WithdrawalLimitReached: return "WithdrawalLimitReached";
+        case OperationStatus::ExceedsWithdrawalLimit: return "ExceedsWithdrawalLimit";
+        case OperationStatus::NotDurable: return "NotDurable";
+        case OperationStatus::TransferDecided: return "TransferDecided";
+        case OperationStatus::AccountExists: return "AccountExists";
+        case OperationStatus::TransferPending: return "TransferPending";
+    }
+    return "Unknown";
+}
+
+// Interned name strings.
+// Every distinct name is stored once and referred to by a NameId; accounts
+// and customers keep only the ID and hand out string_views into the pool.
+// Characters live in 64 KB blocks and entries in fixed-size chunks listed in
+// a fixed directory, so neither ever moves and view() needs no lock.
+typedef uint32_t NameId;
+
+class NamePool {
+private:
+    struct Entry {
+        const char* data;
+        uint32_t length;
+    };
+
+    static const size_t BLOCK_BYTES = 64 * 1024;
+    static const size_t CHUNK_ENTRIES = 4096;
+    static const size_t MAX_CHUNKS = 16384; // Room for 64M distinct names
+
+    atomic<Entry*> chunks[MAX_CHUNKS];
+    vector<unique_ptr<char[]>> blocks;
+    char* currentBlock;
+    size_t blockUsed;
+    uint32_t count;
+    unordered_map<string_view, NameId> ids; // Keys point into the blocks
+    mutable shared_mutex poolMutex;
+
+    NamePool() : currentBlock(nullptr), blockUsed(BLOCK_BYTES), count(0) {
+        for (atomic<Entry*>& chunk : chunks) {
+            chunk.store(nullptr, memory_order_relaxed);
+        }
+    }
+
+    // Copy the characters into a block (caller holds poolMutex exclusively)
+    const char* store(string_view text) {
+        if (text.empty()) {
+            return "";
+        }
+        if (text.size() > BLOCK_BYTES / 4) {
+            // Long names get a block of their own
+            blocks.emplace_back(new char[text.size()]);
+            memcpy(blocks.back().get(), text.data(), text.size());
+            return blocks.back().get();
+        }
+        if (blockUsed + text.size() > BLOCK_BYTES) {
+            blocks.emplace_back(new char[BLOCK_BYTES]);
+            currentBlock = blocks.back().get();
+            blockUsed = 0;
+        }
+        char* target = currentBlock + blockUsed;
+        memcpy(target, text.data(), text.size());
+        blockUsed += text.size();
+        return target;
+    }
+
+public:
+    ~NamePool() {
+        for (atomic<Entry*>& chunk : chunks) {
+            delete[] chunk.load(memory_order_relaxed);
+        }
+    }
+
+    NamePool(const NamePool&) = delete;
+    NamePool& operator=(const NamePool&) = delete;
+
+    // Process-wide pool
+    static NamePool& instance() {
+        static NamePool pool;
+        return pool;
+    }
+
+    // ID of a name, adding it on first use
+    NameId intern(string_view text) {
+        {
+            shared_lock<shared_mutex> lock(poolMutex);
+            auto it = ids.find(text);
+            if (it != ids.end()) {
+                return it->second;
+            }
+        }
+        unique_lock<shared_mutex> lock(poolMutex);
+        auto it = ids.find(text);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        if (count >= CHUNK_ENTRIES * MAX_CHUNKS) {
+            throw length_error("name pool is full");
+        }
+        NameId id = count;
+        Entry* chunk = chunks[id / CHUNK_ENTRIES].load(memory_order_relaxed);
+        if (!chunk) {
+            chunk = new Entry[CHUNK_ENTRIES];
+            chunks[id / CHUNK_ENTRIES].store(chunk, memory_order_release);
+        }
+        const char* data = store(text);
+        chunk[id % CHUNK_ENTRIES] = Entry{data, (uint32_t)text.size()};
+        ids.emplace(string_view(data, text.size()), id);
+        count++;
+        return id;
+    }
+
+    // Characters of an interned name
+    string_view view(NameId id) const {
+        const Entry& entry = chunks[id / CHUNK_ENTRIES].load(memory_order_acquire)[id % CHUNK_ENTRIES];
+        return string_view(entry.data, entry.length);
+    }
+
+    // Number of distinct names
+    size_t size() const {
+        shared_lock<shared_mutex> lock(poolMutex);
+        return count;
+    }
+};
+
+// Base Account class
+class Account {
+protected:
+    static atomic<int> nextAccountNumber; // Static member for auto-generating account numbers
+    int accountNumber;
+    atomic<int64_t> balance;   // Balance in cents, updated with atomic instructions
+    NameId ownerName;          // Interned in NamePool
+    TransactionLog transactionHistory;
+    BalanceLedger* ledger;     // Columnar copy of the balance (set by Operations)
+    uint32_t ledgerSlot;
+    Customer* customer;        // Owning customer, null until assigned
+    mutable mutex accountMutex; // Serializes transfers and displayInfo on this account
+
+    // Pass a balance change on to the ledger and the customer's running total
+    // (defined after Customer)
+    void postBalanceChange(int64_t deltaCents);
+
+    // Add to the balance without taking a lock
+    void credit(Money amount) {
+        balance.fetch_add(amount.getCents());
+        postBalanceChange(amount.getCents());
+    }
+
+    // Take from the balance if it covers the amount, without taking a lock.
+    // On failure 'current' holds the balance that was too low.
+    bool tryDebit(Money amount, int64_t& current) {
+        current = balance.load();
+        while (current >= amount.getCents()) {
+            if (balance.compare_exchange_weak(current, current - amount.getCents())) {
+                postBalanceChange(-amount.getCents());
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    // Constructor; a non-zero number restores an existing account
+    Account(string_view owner, Money initialBalance = 0.0, int number = 0)
+        : balance(initialBalance.getCents()), ownerName(NamePool::instance().intern(owner)), ledger(nullptr), ledgerSlot(0),
+          customer(nullptr) {
+        if (number > 0) {
+            // Keep automatic numbers clear of restored ones
+            int next = nextAccountNumber.load();
+            while (next <= number && !nextAccountNumber.compare_exchange_weak(next, number + 1)) {
+            }
+            accountNumber = number;
+        } else {
+            accountNumber = nextAccountNumber.fetch_add(1);
+        }
+    }
+
+    // Virtual destructor for proper inheritance
+    virtual ~Account() {}
+
+    // Apply a deposit without printing anything; a plain deposit is a
+    // single atomic add
+    OperationStatus tryDeposit(Money amount) {
+        TRACE_SCOPE("Account::deposit");
+        if (amount <= 0) {
+            return OperationStatus::InvalidAmount;
+        }
+        credit(amount);
+        transactionHistory.append(Transaction(amount, TransactionType::Deposit));
+        return OperationStatus::Success;
+    }
+
+    // Apply a withdrawal without printing anything, under this class's own
+    // rules. Non-virtual: callers that know the concrete class (see
+    // Operations::withConcreteAccount) call it directly so it inlines.
+    OperationStatus tryWithdrawDirect(Money amount) {
+        TRACE_SCOPE("Account::withdraw");
+        if (amount <= 0) {
+            return OperationStatus::InvalidAmount;
+        }
+        int64_t current;
+        if (!tryDebit(amount, current)) {
+            return OperationStatus::InsufficientFunds;
+        }
+        transactionHistory.append(Transaction(amount, TransactionType::Withdrawal));
+        return OperationStatus::Success;
+    }
+
+    // Apply a withdrawal without printing anything; a compare-and-swap loop
+    // that refuses to overdraw
+    virtual OperationStatus tryWithdraw(Money amount) {
+        return tryWithdrawDirect(amount);
+    }
+
+    // Apply a transfer without printing anything
+    // Both accounts are locked, lower account number first so concurrent
+    // transfers cannot deadlock, so transfers between the same accounts
+    // apply one at a time.
+    OperationStatus tryTransfer(Account& toAccount, Money amount) {
+        TRACE_SCOPE("Account::transfer");
+        Account* first = accountNumber <= toAccount.accountNumber ? this : &toAccount;
+        Account* second = accountNumber <= toAccount.accountNumber ? &toAccount : this;
+        unique_lock<mutex> firstLock(first->accountMutex);
+        unique_lock<mutex> secondLock;
+        if (second != first) {
+            secondLock = unique_lock<mutex>(second->accountMutex);
+        }
+
+        OperationStatus status = this->tryWithdraw(amount);
+        if (status == OperationStatus::Success) {
+            toAccount.tryDeposit(amount);
+        }
+        return status;
+    }
+
+    // Print the error message for a failed withdrawal
+    virtual void reportWithdrawalError(OperationStatus status) const {
+        if (status == OperationStatus::InvalidAmount) {
+            LOG_ERROR << "Error: Withdrawal amount must be positive!";
+        } else if (status == OperationStatus::InsufficientFunds) {
+            LOG_ERROR << "Error: Insufficient funds! Balance: $" << getBalance();
+        }
+    }
+
+    // Re-apply a change read back from the journal. The original operation
+    // already passed its checks, so none are repeated here.
+    virtual void replayTransaction(Money amount, TransactionType type, int64_t timestamp) {
+        credit(type == TransactionType::Withdrawal ? -amount : amount);
+        transactionHistory.append(Transaction(amount, type, timestamp));
+    }
+
+    // Monthly withdrawal counting, for accounts with a monthly cap: the
+    // current month, and giving back one withdrawal counted in 'month'
+    // (false if there is no cap or that month has been reset since)
+    virtual uint64_t getWithdrawalMonth() const { return 0; }
+    virtual bool releaseWithdrawal(uint64_t) { return false; }
+
+    // Virtual methods for polymorphism
+    virtual bool deposit(Money amount) {
+        return depositAndReport(amount) == OperationStatus::Success;
+    }
+
+    virtual bool withdraw(Money amount) {
+        return withdrawAndReport(amount) == OperationStatus::Success;
+    }
+
+    // Transfer money to another account
+    bool transfer(Account& toAccount, Money amount) {
+        return transferAndReport(toAccount, amount) == OperationStatus::Success;
+    }
+
+    // The same three operations, printing the outcome and returning the status
+    OperationStatus depositAndReport(Money amount) {
+        OperationStatus status = tryDeposit(amount);
+        if (status != OperationStatus::Success) {
+            LOG_ERROR << "Error: Deposit amount must be positive!";
+            return status;
+        }
+        LOG_INFO << "Deposited $" << amount
+             << " to account " << accountNumber;
+        return status;
+    }
+
+    OperationStatus withdrawAndReport(Money amount) {
+        OperationStatus status = tryWithdraw(amount);
+        if (status != OperationStatus::Success) {
+            reportWithdrawalError(status);
+            return status;
+        }
+        LOG_INFO << "Withdrew $" << amount
+             << " from account " << accountNumber;
+        return status;
+    }
+
+    OperationStatus transferAndReport(Account& toAccount, Money amount) {
+        OperationStatus status = tryTransfer(toAccount, amount);
+        if (status != OperationStatus::Success) {
+            reportWithdrawalError(status);
+            return status;
+        }
+        LOG_INFO << "Withdrew $" << amount
+             << " from account " << accountNumber;
+        LOG_INFO << "Deposited $" << amount
+             << " to account " << toAccount.accountNumber;
+        LOG_INFO << "Transfer successful: $" << amount
+             << " from account " << accountNumber
+             << " to account " << toAccount.accountNumber;
+        return status;
+    }
+
+    // Append the account's statement (the displayInfo text) to 'out'
+    virtual void writeStatement(TextWriter& out) const {
+        lock_guard<mutex> lock(accountMutex);
+        out << "\n--- Account Information ---\n";
+        out << "Account Number: " << accountNumber << '\n';
+        out << "Owner: " << getOwnerName() << '\n';
+        out << "Balance: $" << getBalance() << '\n';
+        out << "Transaction History:\n";
+        if (transactionHistory.empty()) {
+            out << "  No transactions\n";
+        } else {
+            transactionHistory.forEach([&](const Transaction& trans) {
+                out << "  " << trans << '\n';
+            });
+        }
+    }
+
+    // Display account information
+    virtual void displayInfo() const {
+        thread_local string text;
+        text.clear();
+        TextWriter out(text);
+        writeStatement(out);
+        text.pop_back(); // The log line adds the final newline
+        LOG_INFO << text;
+    }
+
+    // Attach the account to its slot in a ledger
+    void attachLedger(BalanceLedger* accountLedger, uint32_t slot) {
+        ledger = accountLedger;
+        ledgerSlot = slot;
+    }
+
+    // Record the customer that owns the account
+    void setCustomer(Customer* owningCustomer) {
+        customer = owningCustomer;
+    }
+
+    // Use transactions kept in a mapped snapshot as the start of the history
+    void attachHistory(const Transaction* entries, uint32_t entryCount) {
+        transactionHistory.attachArchive(entries, entryCount);
+    }
+
+    const TransactionLog& getHistory() const { return transactionHistory; }
+
+    // Getters
+    int getAccountNumber() const { return accountNumber; }
+    Money getBalance() const { return Money::fromCents(balance.load()); }
+    uint32_t getLedgerSlot() const { return ledgerSlot; }
+    string_view getOwnerName() const { return NamePool::instance().view(ownerName); }
+    Customer* getCustomer() const { return customer; }
+
+    // Operator overloading
+    // += operator for adding transactions
+    Account& operator+=(const Transaction& trans) {
+        if (trans.getType() == TransactionType::Deposit) {
+            deposit(trans.getAmount());
+        }
+        return *this;
+    }
+
+    // == operator for comparing accounts (by balance)
+    bool operator==(const Account& other) const {
+        return getBalance() == other.getBalance();
+    }
+
+    // > operator for comparing balances
+    bool operator>(const Account& other) const {
+        return getBalance() > other.getBalance();
+    }
+
+    // Friend function for << operator
+    friend ostream& operator<<(ostream& os, const Account& account) {
+        os << "Account " << account.accountNumber << " (" << account.getOwnerName()
+           << "): $" << account.getBalance();
+        return os;
+    }
+
+    friend TextWriter& operator<<(TextWriter& line, const Account& account) {
+        return line << "Account " << account.accountNumber << " (" << account.getOwnerName()
+                    << "): $" << account.getBalance();
+    }
+};
+
+// Initialize static member
+atomic<int> Account::nextAccountNumber(1001);
+
+// Account product policies. A product picks one of each and the
+// ProductAccount template compiles its rules in, so a new product costs
+// nothing at run time.
+
+// Monthly withdrawal-count caps
+struct NoWithdrawalCap {
+    static constexpr bool CAPPED = false;
+    static constexpr int MAX_PER_MONTH = 0;
+};
+
+template <int Count>
+struct MonthlyWithdrawalCap {
+    static constexpr bool CAPPED = true;
+    static constexpr int MAX_PER_MONTH = Count;
+};
+
+// Per-withdrawal amount limits
+struct NoWithdrawalLimit {
+    static constexpr bool LIMITED = false;
+};
+
+struct AccountWithdrawalLimit { // The limit is set per account
+    static constexpr bool LIMITED = true;
+};
+
+// Interest schedules: interest in cents for one month at an annual rate
+struct NoInterest {
+    static constexpr bool PAYS = false;
+    static int64_t monthlyInterest(int64_t, double) { return 0; }
+};
+
+struct MonthlyCompoundInterest {
+    static constexpr bool PAYS = true;
+    static int64_t monthlyInterest(int64_t balanceCents, double annualRate) {
+        return llround(balanceCents * (annualRate / 12));
+    }
+};
+
+// Savings account product
+struct SavingsProduct {
+    typedef MonthlyWithdrawalCap<6> WithdrawalCap; // Federal savings account limit
+    typedef AccountWithdrawalLimit WithdrawalLimit;
+    typedef MonthlyCompoundInterest InterestSchedule;
+    static constexpr const char* NAME = "Savings Account";
+    static constexpr const char* KIND = "savings account"; // As used in messages
+};
+
+// An account whose withdrawal and interest rules come from a Product's
+// policies. The rules are resolved at compile time: tryWithdrawDirect and
+// applyInterest inline into callers that know the concrete class, and the
+// virtual tryWithdraw only forwards to them.
+template <typename Product>
+class ProductAccount : public Account {
+protected:
+    typedef typename Product::WithdrawalCap WithdrawalCap;
+    typedef typename Product::WithdrawalLimit WithdrawalLimit;
+    typedef typename Product::InterestSchedule InterestSchedule;
+
+    double interestRate;
+    Money withdrawalLimit;
+    // Withdrawals used this month in the low 32 bits; the high 32 bits count
+    // monthly resets so a late give-back can't touch the next month's count
+    atomic<uint64_t> withdrawalsThisMonth;
+
+    static int usedThisMonth(uint64_t counter) { return (int)(uint32_t)counter; }
+    static uint64_t monthOf(uint64_t counter) { return counter >> 32; }
+
+public:
+    // Constructor
+    ProductAccount(string_view owner, Money initialBalance, double rate, Money limit, int number)
+        : Account(owner, initialBalance, number), interestRate(rate),
+          withdrawalLimit(limit), withdrawalsThisMonth(0) {}
+
+    // Withdraw under the product's rules (hides Account::tryWithdrawDirect)
+    OperationStatus tryWithdrawDirect(Money amount) {
+        TRACE_SCOPE("ProductAccount::withdraw");
+        if constexpr (WithdrawalCap::CAPPED) {
+            if (usedThisMonth(withdrawalsThisMonth.load()) >= WithdrawalCap::MAX_PER_MONTH) {
+                return OperationStatus::WithdrawalLimitReached;
+            }
+        }
+        if constexpr (WithdrawalLimit::LIMITED) {
+            if (amount > withdrawalLimit) {
+                return OperationStatus::ExceedsWithdrawalLimit;
+            }
+        }
+        if constexpr (!WithdrawalCap::CAPPED) {
+            return Account::tryWithdrawDirect(amount);
+        } else {
+            // Reserve one of this month's withdrawals before touching the balance;
+            // a concurrent withdrawal may have taken the last one
+            uint64_t counter = withdrawalsThisMonth.load();
+            do {
+                if (usedThisMonth(counter) >= WithdrawalCap::MAX_PER_MONTH) {
+                    return OperationStatus::WithdrawalLimitReached;
+                }
+            } while (!withdrawalsThisMonth.compare_exchange_weak(counter, counter + 1));
+            uint64_t month = monthOf(counter);
+
+            OperationStatus status = Account::tryWithdrawDirect(amount); // Call base class method
+            if (status != OperationStatus::Success) {
+                releaseWithdrawal(month); // Give the reservation back
+            }
+            return status;
+        }
+    }
+
+    uint64_t getWithdrawalMonth() const override {
+        return monthOf(withdrawalsThisMonth.load());
+    }
+
+    // Give back a withdrawal, unless the month was reset meanwhile
+    bool releaseWithdrawal(uint64_t month) override {
+        if constexpr (!WithdrawalCap::CAPPED) {
+            return false;
+        } else {
+            uint64_t counter = withdrawalsThisMonth.load();
+            while (monthOf(counter) == month && usedThisMonth(counter) > 0) {
+                if (withdrawalsThisMonth.compare_exchange_weak(counter, counter - 1)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+
+    // Override withdraw method with the product's restrictions
+    OperationStatus tryWithdraw(Money amount) override final {
+        return tryWithdrawDirect(amount);
+    }
+
+    // Replayed withdrawals also count towards this month's limit
+    void replayTransaction(Money amount, TransactionType type, int64_t timestamp) override {
+        if (WithdrawalCap::CAPPED && type == TransactionType::Withdrawal) {
+            withdrawalsThisMonth.fetch_add(1);
+        }
+        Account::replayTransaction(amount, type, timestamp);
+    }
+
+    // Product-specific error messages
+    void reportWithdrawalError(OperationStatus status) const override {
+        if (status == OperationStatus::WithdrawalLimitReached) {
+            LOG_ERROR << "Error: Exceeded monthly withdrawal limit for " << Product::KIND << "!";
+        } else if (status == OperationStatus::ExceedsWithdrawalLimit) {
+            LOG_ERROR << "Error: Withdrawal amount exceeds limit of $"
+                 << withdrawalLimit;
+        } else {
+            Account::reportWithdrawalError(status);
+        }
+    }
+
+    // Apply monthly interest and return the amount credited
+    Money applyInterest() {
+        TRACE_SCOPE("ProductAccount::applyInterest");
+        if constexpr (!InterestSchedule::PAYS) {
+            return Money();
+        } else {
+            int64_t current = balance.load();
+            int64_t interest;
+            do {
+                interest = InterestSchedule::monthlyInterest(current, interestRate);
+            } while (!balance.compare_exchange_weak(current, current + interest));
+            postBalanceChange(interest);
+            transactionHistory.append(Transaction(Money::fromCents(interest), TransactionType::Interest));
+            LOG_INFO << "Applied monthly interest: $" << Money::fromCents(interest)
+                 << " to " << Product::KIND << " " << accountNumber;
+            return Money::fromCents(interest);
+        }
+    }
+
+    // Reset monthly withdrawal counter (would be called monthly)
+    void resetMonthlyWithdrawals() {
+        uint64_t counter = withdrawalsThisMonth.load();
+        while (!withdrawalsThisMonth.compare_exchange_weak(counter, (monthOf(counter) + 1) << 32)) {
+        }
+    }
+
+    // Override writeStatement (and so displayInfo) to add product-specific information
+    void writeStatement(TextWriter& out) const override {
+        Account::writeStatement(out); // Call base class method
+        out << "Account Type: " << Product::NAME << '\n';
+        if constexpr (InterestSchedule::PAYS) {
+            out << "Interest Rate: " << (interestRate * 100) << "% annually\n";
+        }
+        if constexpr (WithdrawalLimit::LIMITED) {
+            out << "Withdrawal Limit: $" << withdrawalLimit << '\n';
+        }
+        if constexpr (WithdrawalCap::CAPPED) {
+            out << "Withdrawals This Month: " << getWithdrawalsThisMonth()
+                << "/" << WithdrawalCap::MAX_PER_MONTH << '\n';
+        }
+    }
+
+    // Getters
+    double getInterestRate() const { return interestRate; }
+    Money getWithdrawalLimit() const { return withdrawalLimit; }
+    int getWithdrawalsThisMonth() const { return usedThisMonth(withdrawalsThisMonth.load()); }
+
+    // Restore the counter when loading a snapshot
+    void restoreWithdrawalsThisMonth(int used) {
+        withdrawalsThisMonth.store((monthOf(withdrawalsThisMonth.load()) << 32) | (uint32_t)used);
+    }
+};
+
+// Derived SavingsAccount class
+class SavingsAccount final : public ProductAccount<SavingsProduct> {
+public:
+    // Constructor
+    SavingsAccount(string_view owner, Money initialBalance = 0.0,
+                   double rate = 0.02, Money limit = 1000.0, int number = 0)
+        : ProductAccount<SavingsProduct>(owner, initialBalance, rate, limit, number) {}
+};
+
+// Customer class to manage multiple accounts
+class Customer {
+private:
+    NameId name; // Interned in NamePool
+    int customerID;
+    vector<Account*> accounts; // Using pointers to support polymorphism
+    atomic<int64_t> totalBalance; // Running total of the accounts' balances, in cents
+    static atomic<int> nextCustomerID;
+
+public:
+    // Constructor; a non-zero ID restores an existing customer
+    Customer(string_view customerName, int id = 0) : name(NamePool::instance().intern(customerName)), totalBalance(0) {
+        if (id > 0) {
+            int next = nextCustomerID.load();
+            while (next <= id && !nextCustomerID.compare_exchange_weak(next, id + 1)) {
+            }
+            customerID = id;
+        } else {
+            customerID = nextCustomerID.fetch_add(1);
+        }
+    }
+
+    // Destructor
+    ~Customer() {
+        // Clean up dynamically allocated accounts if any
+        // Note: In this implementation, we're not dynamically allocating
+    }
+
+    // Add account to customer. From here on the account posts its balance
+    // changes to this customer's running total. An account that belonged to
+    // another customer is moved: it leaves that customer's list and total.
+    // The balance must not change while the account is being added
+    // (Operations links accounts under its exclusive lock).
+    void addAccount(Account* account) {
+        Customer* previous = account->getCustomer();
+        if (previous == this) {
+            return;
+        }
+        if (previous) {
+            previous->removeAccount(account);
+        }
+        accounts.push_back(account);
+        account->setCustomer(this);
+        totalBalance.fetch_add(account->getBalance().getCents());
+        LOG_INFO << "Account " << account->getAccountNumber() 
+             << " added to customer " << getName();
+    }
+
+    // Take an account off this customer (it is moving to another one)
+    void removeAccount(Account* account) {
+        accounts.erase(remove(accounts.begin(), accounts.end(), account), accounts.end());
+        totalBalance.fetch_sub(account->getBalance().getCents());
+    }
+
+    // Apply a change in one of the accounts' balances to the running total
+    void adjustTotalBalance(int64_t deltaCents) {
+        totalBalance.fetch_add(deltaCents, memory_order_relaxed);
+    }
+
+    // Total balance across all accounts
+    Money getTotalBalance() const {
+        return Money::fromCents(totalBalance.load(memory_order_relaxed));
+    }
+
+    // Display customer information
+    void displayCustomerInfo() const {
+        LOG_INFO << "\n=== Customer Information ===";
+        LOG_INFO << "Customer ID: " << customerID;
+        LOG_INFO << "Name: " << getName();
+        LOG_INFO << "Total Accounts: " << accounts.size();
+        LOG_INFO << "Total Balance: $" << getTotalBalance();
+        
+        LOG_INFO << "\nAccount Details:";
+        for (const auto& account : accounts) {
+            LOG_INFO << *account; // Using overloaded << operator
+        }
+    }
+
+    // Find account by account number
+    Account* findAccount(int accountNum) {
+        for (auto& account : accounts) {
+            if (account->getAccountNumber() == accountNum) {
+                return account;
+            }
+        }
+        return nullptr;
+    }
+
+    // Getters
+    string_view getName() const { return NamePool::instance().view(name); }
+    NameId getNameId() const { return name; }
+    int getCustomerID() const { return customerID; }
+    const vector<Account*>& getAccounts() const { return accounts; }
+};
+
+void Account::postBalanceChange(int64_t deltaCents) {
+    if (ledger) {
+        ledger->addBalance(ledgerSlot, deltaCents);
+    }
+    if (customer) {
+        customer->adjustTotalBalance(deltaCents);
+    }
+}
+
+// Initialize static member
+atomic<int> Customer::nextCustomerID(5001);
+
+// Compact 32-bit reference to an object stored in a SlabPool
+typedef uint32_t Handle;
+const Handle INVALID_HANDLE = 0xFFFFFFFFu;
+
+// Slab allocator for objects of one type.
+// Objects are constructed in place inside large contiguous chunks (2 MB, so
+// the kernel can back them with huge pages) and are addressed by their index.
+// Chunks never move, so pointers handed out stay valid until the pool is
+// destroyed, which destroys every object and releases the chunks.
+template <typename T>
+class SlabPool {
+private:
+    static const size_t CHUNK_BYTES = 2 * 1024 * 1024;
+    static const size_t PER_CHUNK = CHUNK_BYTES / sizeof(T) > 0 ? CHUNK_BYTES / sizeof(T) : 1;
+    vector<T*> chunks;
+    uint32_t count;
+
+    static T* allocateChunk() {
+        void* memory = nullptr;
+        if (posix_memalign(&memory, CHUNK_BYTES, CHUNK_BYTES) != 0) {
+            throw bad_alloc();
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(memory, CHUNK_BYTES, MADV_HUGEPAGE);
+#endif
+        return static_cast<T*>(memory);
+    }
+
+public:
+    // Constructor
+    SlabPool() : count(0) {}
+
+    // Destructor: destroy objects in reverse order, then free the chunks
+    ~SlabPool() {
+        for (uint32_t i = count; i > 0; i--) {
+            get(i - 1)->~T();
+        }
+        for (T* chunk : chunks) {
+            free(chunk);
+        }
+    }
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    // Construct a new object in the pool and return its handle
+    template <typename... Args>
+    Handle create(Args&&... args) {
+        if (count / PER_CHUNK >= chunks.size()) {
+            chunks.push_back(allocateChunk());
+        }
+        T* slot = chunks[count / PER_CHUNK] + count % PER_CHUNK;
+        new (slot) T(std::forward<Args>(args)...);
+        return count++;
+    }
+
+    // Resolve a handle to the object
+    T* get(Handle handle) const {
+        return chunks[handle / PER_CHUNK] + handle % PER_CHUNK;
+    }
+
+    // Visit the objects with handles in [begin, end) in order, one chunk at a time
+    template <typename Visitor>
+    void forEachInRange(uint32_t begin, uint32_t end, Visitor visit) const {
+        while (begin < end) {
+            T* chunk = chunks[begin / PER_CHUNK];
+            uint32_t chunkEnd = (uint32_t)min<size_t>(end, (begin / PER_CHUNK + 1) * PER_CHUNK);
+            for (uint32_t i = begin; i < chunkEnd; i++) {
+                visit(chunk[i % PER_CHUNK]);
+            }
+            begin = chunkEnd;
+        }
+    }
+
+    // Visit every object in creation order
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        forEachInRange(0, count, visit);
+    }
+
+    uint32_t size() const { return count; }
+};
+
+// Index from IDs (account numbers, customer IDs) to object handles.
+// IDs handed out by nextAccountNumber / nextCustomerID are sequential, so they
+// are stored in a direct-addressed table; IDs outside that range fall back
+// to a hash map.
+class IdIndex {
+private:
+    static const int MAX_GAP = 1024; // Largest jump still kept in the direct table
+    int baseId;                      // ID stored at dense[0]
+    int minId;
+    int maxId;
+    vector<Handle> dense;
+    unordered_map<int, Handle> sparse;
+
+public:
+    // Constructor
+    IdIndex() : baseId(0), minId(0), maxId(-1) {}
+
+    // Add a handle under the given ID
+    void insert(int id, Handle handle) {
+        if (dense.empty() && sparse.empty()) {
+            baseId = id;
+            minId = id;
+            maxId = id;
+        }
+        if (id < minId) minId = id;
+        if (id > maxId) maxId = id;
+
+        long long offset = (long long)id - baseId;
+        if (offset >= 0 && offset < (long long)dense.size() + MAX_GAP) {
+            if (offset >= (long long)dense.size()) {
+                dense.resize(offset + 1, INVALID_HANDLE);
+            }
+            dense[offset] = handle;
+        } else {
+            sparse[id] = handle;
+        }
+    }
+
+    // Look up a handle, INVALID_HANDLE if the ID is unknown
+    Handle find(int id) const {
+        // Fast negative path for IDs that were never handed out
+        if (id < minId || id > maxId) {
+            return INVALID_HANDLE;
+        }
+        long long offset = (long long)id - baseId;
+        if (offset >= 0 && offset < (long long)dense.size()) {
+            return dense[offset];
+        }
+        if (sparse.empty()) {
+            return INVALID_HANDLE;
+        }
+        auto it = sparse.find(id);
+        return it != sparse.end() ? it->second : INVALID_HANDLE;
+    }
+
+    // Forget an ID; its handle stays valid but is no longer found
+    void erase(int id) {
+        long long offset = (long long)id - baseId;
+        if (offset >= 0 && offset < (long long)dense.size()) {
+            dense[offset] = INVALID_HANDLE;
+        } else {
+            sparse.erase(id);
+        }
+    }
+
+    int highestId() const { return maxId; }
+
+    size_t size() const { return dense.size() + sparse.size(); }
+};
+
+// Work-stealing thread pool for bulk jobs over large ranges.
+// parallelFor splits a range into fixed-size chunks and deals them out in
+// contiguous blocks, one deque per thread. Each thread pops from the back of
+// its own deque and steals from the front of the others once it runs dry.
+// The calling thread takes part too, so a pool with no workers simply runs
+// the job inline. Bodies receive a slot in [0, slotCount()) that is unique
+// among the threads running the job, for per-thread accumulators.
+class WorkStealingPool {
+private:
+    struct Job {
+        void (*run)(const void* body, size_t begin, size_t end, unsigned slot);
+        const void* body;
+        atomic<size_t> pending; // Chunks not finished yet
+    };
+
+    struct Task {
+        Job* job;
+        size_t begin;
+        size_t end;
+    };
+
+    struct alignas(64) WorkQueue {
+        mutex queueMutex;
+        deque<Task> tasks;
+    };
+
+    vector<unique_ptr<WorkQueue>> queues; // One per worker, plus one for the caller
+    vector<thread> workers;
+    mutex submitMutex;  // One job at a time, so the caller's slot is unique
+    mutex sleepMutex;
+    condition_variable wakeUp;
+    condition_variable jobDone;
+    size_t queuedTasks; // Guarded by sleepMutex
+    bool stopping;      // Guarded by sleepMutex
+
+    // Take a task from our own deque, or steal one from another
+    bool takeTask(unsigned slot, Task& task) {
+        size_t queueCount = queues.size();
+        for (size_t i = 0; i < queueCount; i++) {
+            WorkQueue& queue = *queues[(slot + i) % queueCount];
+            lock_guard<mutex> lock(queue.queueMutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            } else {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            lock_guard<mutex> sleepLock(sleepMutex);
+            queuedTasks--;
+            return true;
+        }
+        return false;
+    }
+
+    void runTask(const Task& task, unsigned slot) {
+        task.job->run(task.job->body, task.begin, task.end, slot);
+        if (task.job->pending.fetch_sub(1, memory_order_acq_rel) == 1) {
+            lock_guard<mutex> lock(sleepMutex);
+            jobDone.notify_all();
+        }
+    }
+
+    void workerLoop(unsigned slot) {
+        Task task;
+        while (true) {
+            if (takeTask(slot, task)) {
+                runTask(task, slot);
+                continue;
+            }
+            unique_lock<mutex> lock(sleepMutex);
+            wakeUp.wait(lock, [this] { return stopping || queuedTasks > 0; });
+            if (stopping && queuedTasks == 0) {
+                return;
+            }
+        }
+    }
+
+public:
+    // Constructor: workerCount threads besides the caller
+    explicit WorkStealingPool(unsigned workerCount) : queuedTasks(0), stopping(false) {
+        for (unsigned i = 0; i <= workerCount; i++) {
+            queues.push_back(unique_ptr<WorkQueue>(new WorkQueue()));
+        }
+        for (unsigned i = 0; i < workerCount; i++) {
+            workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+        }
+    }
+
+    // Destructor: let the workers drain and join them
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Process-wide pool with one thread per core (the caller is one of them)
+    static WorkStealingPool& shared() {
+        static WorkStealingPool pool(thread::hardware_concurrency() > 1 ? thread::hardware_concurrency() - 1 : 0);
+        return pool;
+    }
+
+    // Run body(begin, end, slot) over [0, count) in chunks of grain items.
+    // Chunk boundaries are multiples of grain. Returns once every chunk is done.
+    template <typename Body>
+    void parallelFor(size_t count, size_t grain, const Body& body) {
+        if (count == 0) {
+            return;
+        }
+        unsigned callerSlot = (unsigned)workers.size();
+        size_t chunkCount = (count + grain - 1) / grain;
+        if (workers.empty() || chunkCount == 1) {
+            body(0, count, callerSlot);
+            return;
+        }
+
+        lock_guard<mutex> submitLock(submitMutex);
+        Job job;
+        job.run = [](const void* jobBody, size_t begin, size_t end, unsigned slot) {
+            (*static_cast<const Body*>(jobBody))(begin, end, slot);
+        };
+        job.body = &body;
+        job.pending.store(chunkCount, memory_order_relaxed);
+
+        // Deal out contiguous blocks of chunks so each thread starts on its own range
+        size_t queueCount = queues.size();
+        for (size_t q = 0; q < queueCount; q++) {
+            size_t first = chunkCount * q / queueCount;
+            size_t last = chunkCount * (q + 1) / queueCount;
+            lock_guard<mutex> lock(queues[q]->queueMutex);
+            // Pushed in reverse so the owner pops its block front to back
+            for (size_t c = last; c > first; c--) {
+                size_t begin = (c - 1) * grain;
+                queues[q]->tasks.push_back(Task{&job, begin, min(begin + grain, count)});
+            }
+        }
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            queuedTasks += chunkCount;
+        }
+        wakeUp.notify_all();
+
+        // Help out until every chunk has finished
+        Task task;
+        while (job.pending.load(memory_order_acquire) > 0) {
+            if (takeTask(callerSlot, task)) {
+                runTask(task, callerSlot);
+                continue;
+            }
+            unique_lock<mutex> lock(sleepMutex);
+            jobDone.wait(lock, [&job] { return job.pending.load(memory_order_acquire) == 0; });
+        }
+    }
+
+    // Number of distinct slots handed to bodies
+    unsigned slotCount() const { return (unsigned)workers.size() + 1; }
+};
+
+// Index from names to handles for prefix searches.
+// Entries are kept in a few sorted runs of growing size (a small log-
+// structured merge). A new entry goes into the smallest run; a run that
+// outgrows its capacity is merged into the next one, so each insert moves
+// O(FANOUT) entries per run on average instead of shifting one big array.
+// Each entry carries the first eight bytes of its name packed into an
+// integer, so most comparisons never look at the name itself. A lookup is
+// a binary search in every run followed by a merged walk over the matches.
+class NamePrefixIndex {
+private:
+    struct Entry {
+        uint64_t key; // First eight bytes of the name, big-endian, zero padded
+        NameId name;
+        Handle handle;
+    };
+
+    static constexpr size_t FIRST_RUN_CAPACITY = 256;
+    static constexpr size_t FANOUT = 32; // Capacity ratio between neighbouring runs
+    vector<vector<Entry>> runs;          // runs[0] is the smallest
+    size_t count;
+
+    static uint64_t packPrefix(string_view text) {
+        uint64_t key = 0;
+        for (size_t i = 0; i < 8; i++) {
+            key = (key << 8) | (i < text.size() ? (uint8_t)text[i] : 0);
+        }
+        return key;
+    }
+
+    // Order by name, then handle
+    static bool entryLess(const Entry& a, const Entry& b) {
+        if (a.key != b.key) {
+            return a.key < b.key;
+        }
+        if (a.name != b.name) {
+            int order = NamePool::instance().view(a.name).compare(NamePool::instance().view(b.name));
+            if (order != 0) {
+                return order < 0;
+            }
+        }
+        return a.handle < b.handle;
+    }
+
+    // First entry whose name is not below 'text'
+    static size_t lowerBound(const vector<Entry>& entries, string_view text) {
+        uint64_t key = packPrefix(text);
+        return partition_point(entries.begin(), entries.end(), [&](const Entry& entry) {
+            if (entry.key != key) {
+                return entry.key < key;
+            }
+            return NamePool::instance().view(entry.name) < text;
+        }) - entries.begin();
+    }
+
+    static bool hasPrefix(const Entry& entry, string_view prefix) {
+        string_view name = NamePool::instance().view(entry.name);
+        return name.size() >= prefix.size() && name.compare(0, prefix.size(), prefix) == 0;
+    }
+
+public:
+    // Constructor
+    NamePrefixIndex() : runs(1), count(0) {}
+
+    // Add a name
+    void insert(NameId name, Handle handle) {
+        Entry entry = {packPrefix(NamePool::instance().view(name)), name, handle};
+        runs[0].insert(upper_bound(runs[0].begin(), runs[0].end(), entry, entryLess), entry);
+        count++;
+
+        // Push full runs down into the next larger one
+        size_t capacity = FIRST_RUN_CAPACITY;
+        for (size_t level = 0; runs[level].size() > capacity; level++, capacity *= FANOUT) {
+            if (level + 1 == runs.size()) {
+                runs.emplace_back();
+            }
+            vector<Entry> merged(runs[level].size() + runs[level + 1].size());
+            merge(runs[level].begin(), runs[level].end(), runs[level + 1].begin(), runs[level + 1].end(),
+                  merged.begin(), entryLess);
+            runs[level + 1].swap(merged);
+            runs[level].clear();
+        }
+    }
+
+    // Handles of up to 'limit' names starting with 'prefix', in name order
+    vector<Handle> findPrefix(string_view prefix, size_t limit) const {
+        vector<Handle> out;
+        vector<size_t> positions(runs.size());
+        for (size_t level = 0; level < runs.size(); level++) {
+            positions[level] = lowerBound(runs[level], prefix);
+        }
+        while (out.size() < limit) {
+            // Smallest matching entry at the head of any run
+            const Entry* next = nullptr;
+            size_t nextLevel = 0;
+            for (size_t level = 0; level < runs.size(); level++) {
+                size_t i = positions[level];
+                if (i < runs[level].size() && hasPrefix(runs[level][i], prefix) &&
+                    (!next || entryLess(runs[level][i], *next))) {
+                    next = &runs[level][i];
+                    nextLevel = level;
+                }
+            }
+            if (!next) {
+                break;
+            }
+            out.push_back(next->handle);
+            positions[nextLevel]++;
+        }
+        return out;
+    }
+
+    size_t size() const { return count; }
+};
+
+// Kinds of records in the write-ahead journal
+enum class JournalRecordType : uint8_t {
+    CreateCustomer,
+    CreateAccount,
+    AssignAccount,
+    Deposit,
+    Withdrawal,
+    Transfer,
+    Interest,
+    MonthlyReset,
+    MoveAccountIn, // Account moved here from another shard
+    MoveAccountOut, // Account moved to another shard: balance taken out, number retired
+    PrepareTransfer, // This shard's side of a cross-shard transfer is held
+    CommitTransfer,  // The coordinator committed a cross-shard transfer
+    AbortTransfer,   // The coordinator aborted a cross-shard transfer
+    TransferStarted,   // Router decision log: about to prepare on both shards
+    TransferCommitted, // Router decision log: both shards voted yes
+    TransferFinished,  // Router decision log: both shards have the decision
+    ReleaseWithdrawal, // An aborted transfer gave a savings withdrawal back
+    AccountUnplaced,   // Router decision log: a split took an account off a shard but could not place it
+    AccountPlaced      // Router decision log: that account has been placed after all
+};
+
+// One successful mutating operation as stored in the journal
+struct JournalRecord {
+    JournalRecordType type;
+    AccountType accountType; // CreateAccount
+    int32_t id;              // Account number, or customer ID for CreateCustomer
+    int32_t otherId;         // Transfer target, customer ID for AssignAccount,
+                             // savings withdrawals this month for MoveAccountIn,
+                             // or 1 for the paying side in PrepareTransfer
+    int64_t amount;          // Cents (initial balance for CreateAccount and MoveAccountIn)
+    int64_t limit;           // Savings withdrawal limit in cents
+    int64_t timestamp;       // Transaction time in microseconds
+    double rate;             // Savings interest rate
+    uint64_t transferId;     // Cross-shard transfer records
+    string name;             // Customer or owner name, or the MoveIn request
+                             // frame for AccountUnplaced
+
+    JournalRecord(JournalRecordType recordType = JournalRecordType::Deposit)
+        : type(recordType), accountType(AccountType::Regular), id(0), otherId(0),
+          amount(0), limit(0), timestamp(0), rate(0.0), transferId(0) {}
+};
+
+// When an operation returns relative to its journal record reaching disk
+enum class JournalSync : uint8_t {
+    None, // As soon as the record is queued
+    Group // Once the record is on disk (group commit)
+};
+
+// Append-only binary write-ahead journal with group commit.
+// Operations queue encoded records into a shared buffer. A flusher thread
+// writes everything that has accumulated and syncs it with one fdatasync,
+// at most once every GROUP_COMMIT_INTERVAL_US (or the interval given), so
+// under load one fsync covers many operations. Each record is [payload size][CRC-32][payload];
+// a torn record at the end of the file fails its checksum on recovery.
+class Journal {
+private:
+    static constexpr int GROUP_COMMIT_INTERVAL_US = 2000;
+    static const size_t HEADER_SIZE = 8;
+
+    int fd;
+    JournalSync syncMode;
+    int groupIntervalUs;        // Least time between two syncs
+
+    mutex journalMutex;         // Guards the fields below
+    condition_variable flushNeeded;
+    condition_variable durable;
+    string pending;             // Encoded records not written yet
+    uint64_t appendedBytes;     // Sequence number (file offset) of the end of the queued records
+    uint64_t durableBytes;      // Everything up to here is on disk
+    uint64_t syncCount;
+    bool failed;                // A write or sync failed; nothing more is written
+    bool stopping;
+    thread flusher;
+
+    template <typename T>
+    static void put(string& out, const T& value) {
+        out.append((const char*)&value, sizeof(T));
+    }
+
+    template <typename T>
+    static T get(const char*& in) {
+        T value;
+        memcpy(&value, in, sizeof(T));
+        in += sizeof(T);
+        return value;
+    }
+
+    // Bytes of the fields encode stores for a record type, after the type
+    // byte and without the name; -1 for unknown types
+    static int fieldSize(JournalRecordType type) {
+        switch (type) {
+            case JournalRecordType::CreateCustomer: return 4;
+            case JournalRecordType::CreateAccount: return 1 + 4 + 8 + 8 + 8;
+            case JournalRecordType::MoveAccountIn: return 1 + 4 + 8 + 8 + 8 + 4;
+            case JournalRecordType::AssignAccount: return 4 + 4;
+            case JournalRecordType::Transfer: return 4 + 4 + 8 + 8;
+            case JournalRecordType::Deposit:
+            case JournalRecordType::Withdrawal:
+            case JournalRecordType::Interest:
+            case JournalRecordType::MoveAccountOut: return 4 + 8 + 8;
+            case JournalRecordType::MonthlyReset: return 0;
+            case JournalRecordType::PrepareTransfer: return 8 + 4 + 4 + 8 + 8;
+            case JournalRecordType::CommitTransfer:
+            case JournalRecordType::AbortTransfer: return 8 + 8;
+            case JournalRecordType::TransferStarted: return 8 + 4 + 4 + 8;
+            case JournalRecordType::TransferCommitted:
+            case JournalRecordType::TransferFinished: return 8;
+            case JournalRecordType::ReleaseWithdrawal:
+            case JournalRecordType::AccountUnplaced:
+            case JournalRecordType::AccountPlaced: return 4;
+        }
+        return -1;
+    }
+
+    static bool hasName(JournalRecordType type) {
+        return type == JournalRecordType::CreateCustomer || type == JournalRecordType::CreateAccount ||
+               type == JournalRecordType::MoveAccountIn || type == JournalRecordType::AccountUnplaced;
+    }
+
+    // Background group-commit loop
+    void run() {
+        unique_lock<mutex> lock(journalMutex);
+        chrono::steady_clock::time_point lastSync = chrono::steady_clock::now();
+        while (true) {
+            flushNeeded.wait(lock, [&]() { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                return; // Stopping with nothing left to write
+            }
+            // Give other operations until the interval ends to join this group
+            flushNeeded.wait_until(lock, lastSync + chrono::microseconds(groupIntervalUs),
+                                   [&]() { return stopping; });
+
+            string group;
+            group.swap(pending);
+            uint64_t target = appendedBytes;
+            if (failed) {
+                continue; // Records after a torn group would be lost on recovery anyway
+            }
+            lock.unlock();
+
+            const char* error = nullptr;
+            size_t written = 0;
+            while (!error && written < group.size()) {
+                ssize_t result = ::write(fd, group.data() + written, group.size() - written);
+                if (result > 0) {
+                    written += (size_t)result;
+                } else if (result == 0 || errno != EINTR) {
+                    error = result == 0 ? "no progress" : strerror(errno);
+                }
+            }
+            if (!error && fdatasync(fd) != 0) {
+                error = strerror(errno);
+            }
+            lastSync = chrono::steady_clock::now();
+
+            lock.lock();
+            if (error) {
+                // Waiters for this group and every later one are failed
+                LOG_ERROR << "Error: Journal write failed (" << error << "); later operations are not durable";
+                failed = true;
+            } else {
+                durableBytes = target;
+                syncCount++;
+            }
+            durable.notify_all();
+        }
+    }
+
+public:
+    // Constructor: takes ownership of a descriptor opened for appending to
+    // a journal that is currently fileSize bytes long
+    Journal(int journalFd, JournalSync mode, uint64_t fileSize, int intervalUs = GROUP_COMMIT_INTERVAL_US)
+        : fd(journalFd), syncMode(mode), groupIntervalUs(intervalUs), appendedBytes(fileSize), durableBytes(fileSize),
+          syncCount(0), failed(false), stopping(false) {
+        flusher = thread([this]() { run(); });
+    }
+
+    // Destructor: write and sync everything still queued
+    ~Journal() {
+        {
+            lock_guard<mutex> lock(journalMutex);
+            stopping = true;
+        }
+        flushNeeded.notify_one();
+        flusher.join();
+        close(fd);
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Standard CRC-32 (IEEE polynomial)
+    static uint32_t crc32(const char* data, size_t size) {
+        static const vector<uint32_t> table = []() {
+            vector<uint32_t> entries(256);
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int bit = 0; bit < 8; bit++) {
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                entries[i] = c;
+            }
+            return entries;
+        }();
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; i++) {
+            crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    // Append the binary form of a record to out; only the fields the
+    // record type uses are stored
+    static void encode(const JournalRecord& record, string& out) {
+        size_t start = out.size();
+        out.append(HEADER_SIZE, '\0');
+        put(out, (uint8_t)record.type);
+        switch (record.type) {
+            case JournalRecordType::CreateCustomer:
+                put(out, record.id);
+                break;
+            case JournalRecordType::CreateAccount:
+            case JournalRecordType::MoveAccountIn:
+                put(out, (uint8_t)record.accountType);
+                put(out, record.id);
+                put(out, record.amount);
+                put(out, record.limit);
+                put(out, record.rate);
+                if (record.type == JournalRecordType::MoveAccountIn) {
+                    put(out, record.otherId);
+                }
+                break;
+            case JournalRecordType::AssignAccount:
+                put(out, record.id);
+                put(out, record.otherId);
+                break;
+            case JournalRecordType::Transfer:
+                put(out, record.id);
+                put(out, record.otherId);
+                put(out, record.amount);
+                put(out, record.timestamp);
+                break;
+            case JournalRecordType::Deposit:
+            case JournalRecordType::Withdrawal:
+            case JournalRecordType::Interest:
+            case JournalRecordType::MoveAccountOut:
+                put(out, record.id);
+                put(out, record.amount);
+                put(out, record.timestamp);
+                break;
+            case JournalRecordType::PrepareTransfer:
+                put(out, record.transferId);
+                put(out, record.id);
+                put(out, record.otherId);
+                put(out, record.amount);
+                put(out, record.timestamp);
+                break;
+            case JournalRecordType::CommitTransfer:
+            case JournalRecordType::AbortTransfer:
+                put(out, record.transferId);
+                put(out, record.timestamp);
+                break;
+            case JournalRecordType::TransferStarted:
+                put(out, record.transferId);
+                put(out, record.id);
+                put(out, record.otherId);
+                put(out, record.amount);
+                break;
+            case JournalRecordType::TransferCommitted:
+            case JournalRecordType::TransferFinished:
+                put(out, record.transferId);
+                break;
+            case JournalRecordType::ReleaseWithdrawal:
+            case JournalRecordType::AccountUnplaced:
+            case JournalRecordType::AccountPlaced:
+                put(out, record.id);
+                break;
+            case JournalRecordType::MonthlyReset:
+                break;
+        }
+        if (hasName(record.type)) {
+            put(out, (uint16_t)record.name.size());
+            out.append(record.name, 0, 0xFFFF);
+        }
+        uint32_t payloadSize = (uint32_t)(out.size() - start - HEADER_SIZE);
+        uint32_t checksum = crc32(out.data() + start + HEADER_SIZE, payloadSize);
+        memcpy(&out[start], &payloadSize, 4);
+        memcpy(&out[start + 4], &checksum, 4);
+    }
+
+    // Decode the record at data[offset]. Returns the number of bytes used,
+    // or 0 if the record is incomplete or corrupt. Besides the checksum, the
+    // payload must be exactly as long as its record type's fields and name,
+    // so nothing is read past it.
+    static size_t decode(const char* data, size_t size, size_t offset, JournalRecord& record) {
+        if (size - offset < HEADER_SIZE) {
+            return 0;
+        }
+        uint32_t payloadSize, checksum;
+        memcpy(&payloadSize, data + offset, 4);
+        memcpy(&checksum, data + offset + 4, 4);
+        if (payloadSize == 0 || size - offset - HEADER_SIZE < payloadSize ||
+            crc32(data + offset + HEADER_SIZE, payloadSize) != checksum) {
+            return 0;
+        }
+        const char* in = data + offset + HEADER_SIZE;
+        record = JournalRecord((JournalRecordType)get<uint8_t>(in));
+        int fields = fieldSize(record.type);
+        size_t expected = 1 + (size_t)fields + (hasName(record.type) ? 2 : 0);
+        if (fields < 0 || payloadSize < expected) {
+            return 0;
+        }
+        if (hasName(record.type)) {
+            uint16_t nameSize;
+            memcpy(&nameSize, in + fields, sizeof(nameSize));
+            expected += nameSize;
+        }
+        if (payloadSize != expected) {
+            return 0;
+        }
+        switch (record.type) {
+            case JournalRecordType::CreateCustomer:
+                record.id = get<int32_t>(in);
+                break;
+            case JournalRecordType::CreateAccount:
+            case JournalRecordType::MoveAccountIn:
+                record.accountType = (AccountType)get<uint8_t>(in);
+                record.id = get<int32_t>(in);
+                record.amount = get<int64_t>(in);
+                record.limit = get<int64_t>(in);
+                record.rate = get<double>(in);
+                if (record.type == JournalRecordType::MoveAccountIn) {
+                    record.otherId = get<int32_t>(in);
+                }
+                break;
+            case JournalRecordType::AssignAccount:
+                record.id = get<int32_t>(in);
+                record.otherId = get<int32_t>(in);
+                break;
+            case JournalRecordType::Transfer:
+                record.id = get<int32_t>(in);
+                record.otherId = get<int32_t>(in);
+                record.amount = get<int64_t>(in);
+                record.timestamp = get<int64_t>(in);
+                break;
+            case JournalRecordType::Deposit:
+            case JournalRecordType::Withdrawal:
+            case JournalRecordType::Interest:
+            case JournalRecordType::MoveAccountOut:
+                record.id = get<int32_t>(in);
+                record.amount = get<int64_t>(in);
+                record.timestamp = get<int64_t>(in);
+                break;
+            case JournalRecordType::PrepareTransfer:
+                record.transferId = get<uint64_t>(in);
+                record.id = get<int32_t>(in);
+                record.otherId = get<int32_t>(in);
+                record.amount = get<int64_t>(in);
+                record.timestamp = get<int64_t>(in);
+                break;
+            case JournalRecordType::CommitTransfer:
+            case JournalRecordType::AbortTransfer:
+                record.transferId = get<uint64_t>(in);
+                record.timestamp = get<int64_t>(in);
+                break;
+            case JournalRecordType::TransferStarted:
+                record.transferId = get<uint64_t>(in);
+                record.id = get<int32_t>(in);
+                record.otherId = get<int32_t>(in);
+                record.amount = get<int64_t>(in);
+                break;
+            case JournalRecordType::TransferCommitted:
+            case JournalRecordType::TransferFinished:
+                record.transferId = get<uint64_t>(in);
+                break;
+            case JournalRecordType::ReleaseWithdrawal:
+            case JournalRecordType::AccountUnplaced:
+            case JournalRecordType::AccountPlaced:
+                record.id = get<int32_t>(in);
+                break;
+            case JournalRecordType::MonthlyReset:
+                break;
+        }
+        if (hasName(record.type)) {
+            uint16_t nameSize = get<uint16_t>(in);
+            record.name.assign(in, nameSize);
+        }
+        return HEADER_SIZE + payloadSize;
+    }
+
+    // Queue encoded records; returns the sequence number to wait for
+    uint64_t appendEncoded(const string& records) {
+        if (records.empty()) {
+            return 0;
+        }
+        lock_guard<mutex> lock(journalMutex);
+        pending += records;
+        appendedBytes += records.size();
+        flushNeeded.notify_one();
+        return appendedBytes;
+    }
+
+    uint64_t append(const JournalRecord& record) {
+        string encoded;
+        encode(record, encoded);
+        return appendEncoded(encoded);
+    }
+
+    // Wait until everything up to sequenceNumber is on disk (Group mode
+    // only); false if the journal failed before getting there
+    bool waitDurable(uint64_t sequenceNumber) {
+        if (syncMode != JournalSync::Group || sequenceNumber == 0) {
+            return true;
+        }
+        unique_lock<mutex> lock(journalMutex);
+        durable.wait(lock, [&]() { return durableBytes >= sequenceNumber || failed; });
+        return durableBytes >= sequenceNumber;
+    }
+
+    // Wait until every queued record is on disk, whatever the sync mode,
+    // and set journalSize to the journal size at that point; false if the
+    // journal failed
+    bool sync(uint64_t& journalSize) {
+        unique_lock<mutex> lock(journalMutex);
+        uint64_t target = appendedBytes;
+        durable.wait(lock, [&]() { return durableBytes >= target || failed; });
+        journalSize = target;
+        return durableBytes >= target;
+    }
+
+    // Sequence number of the last record queued so far
+    uint64_t getAppendedBytes() {
+        lock_guard<mutex> lock(journalMutex);
+        return appendedBytes;
+    }
+
+    // Number of fsyncs issued so far
+    uint64_t getSyncCount() {
+        lock_guard<mutex> lock(journalMutex);
+        return syncCount;
+    }
+};
+
+// Snapshot file layout. All references are byte offsets or indexes within
+// the file, so a snapshot can be mapped at any address and used in place:
+//   header | transactions | accounts | customers | prepared | links | names
+// Each account's history is a contiguous run in the transaction section.
+const char SNAPSHOT_MAGIC[8] = {'B', 'A', 'N', 'K', 'S', 'N', 'A', 'P'};
+const uint32_t SNAPSHOT_VERSION = 2;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t transactionSize;  // sizeof(Transaction) when written
+    uint64_t journalOffset;    // Journal records before this offset are included
+    uint64_t transactionOffset;
+    uint64_t transactionCount;
+    uint64_t accountOffset;
+    uint64_t accountCount;
+    uint64_t customerOffset;
+    uint64_t customerCount;
+    uint64_t linkOffset;       // Account numbers, grouped by customer
+    uint64_t linkCount;
+    uint64_t nameOffset;
+    uint64_t nameSize;
+    uint64_t preparedOffset;   // Cross-shard transfers waiting for a decision
+    uint64_t preparedCount;
+};
+
+struct SnapshotAccount {
+    int32_t accountNumber;
+    uint8_t type;              // AccountType
+    uint8_t padding[3];
+    int32_t withdrawalsThisMonth;
+    uint32_t nameLength;
+    uint64_t nameStart;        // Offset into the name section
+    int64_t balance;           // Cents
+    int64_t limit;             // Cents
+    double rate;
+    uint64_t historyStart;     // Index into the transaction section
+    uint64_t historyCount;
+};
+
+struct SnapshotCustomer {
+    int32_t customerID;
+    uint32_t nameLength;
+    uint64_t nameStart;
+    uint64_t linkStart;        // Index into the link section
+    uint64_t linkCount;
+};
+
+struct SnapshotPrepared {
+    uint64_t transferId;
+    int32_t accountNumber;
+    uint8_t outgoing;          // 1 for the paying side
+    uint8_t padding[3];
+    int64_t amount;            // Cents
+};
+
+static_assert(is_trivially_copyable<SnapshotHeader>::value &&
+              is_trivially_copyable<SnapshotAccount>::value &&
+              is_trivially_copyable<SnapshotCustomer>::value &&
+              is_trivially_copyable<SnapshotPrepared>::value, "Snapshot records must stay plain");
+
+// Kinds of operations accepted by Operations::performBatch
+enum class BatchOperationType : uint8_t {
+    Deposit,
+    Withdrawal,
+    Transfer
+};
+
+// One operation in a batch
+struct BatchOperation {
+    BatchOperationType type;
+    int accountNumber;   // Account deposited to, withdrawn from or transferred from
+    int toAccountNumber; // Transfers only
+    Money amount;
+};
+
+// Result of Operations::performBatch
+struct BatchResult {
+    vector<OperationStatus> statuses; // One per operation, in input order
+    size_t succeeded;
+    size_t failed;
+};
+
+// Operations whose latency and outcome are recorded
+enum class OperationKind : uint8_t {
+    Deposit,
+    Withdrawal,
+    Transfer,
+    Lookup,
+    MonthEnd
+};
+
+const int OPERATION_KIND_COUNT = 5;
+const int OPERATION_STATUS_COUNT = 10;
+
+const char* operationKindName(OperationKind kind) {
+    switch (kind) {
+        case OperationKind::Deposit: return "Deposit";
+        case OperationKind::Withdrawal: return "Withdrawal";
+        case OperationKind::Transfer: return "Transfer";
+        case OperationKind::Lookup: return "Lookup";
+        case OperationKind::MonthEnd: return "MonthEnd";
+    }
+    return "Unknown";
+}
+
+// Result of Operations::importSettlementFile
+struct ImportResult {
+    uint64_t lines;     // Operation lines read (blank, '#' and header lines excluded)
+    uint64_t succeeded;
+    uint64_t failed;    // Well-formed lines that were refused
+    uint64_t malformed; // Lines that could not be parsed
+    uint64_t failures[OPERATION_STATUS_COUNT]; // 'failed' split by reason
+    uint64_t bytes;
+    double seconds;
+};
+
+// Result of Operations::exportStatements
+struct StatementExportResult {
+    bool ok;
+    uint64_t accounts;
+    uint64_t bytes;
+    unsigned files;
+    double seconds;
+};
+
+// Parse one settlement line: "deposit,<account>,<amount>",
+// "withdrawal,<account>,<amount>" or "transfer,<from>,<to>,<amount>",
+// amounts in dollars with up to two decimals. A trailing '\r' is allowed.
+bool parseSettlementLine(const char* begin, const char* end, BatchOperation& operation) {
+    if (end > begin && end[-1] == '\r') {
+        end--;
+    }
+    const char* comma = (const char*)memchr(begin, ',', end - begin);
+    if (!comma) {
+        return false;
+    }
+    string_view type(begin, comma - begin);
+    if (type == "deposit") {
+        operation.type = BatchOperationType::Deposit;
+    } else if (type == "withdrawal") {
+        operation.type = BatchOperationType::Withdrawal;
+    } else if (type == "transfer") {
+        operation.type = BatchOperationType::Transfer;
+    } else {
+        return false;
+    }
+    const char* cursor = comma + 1;
+    auto parseNumber = [&](int& number) {
+        from_chars_result result = from_chars(cursor, end, number);
+        if (result.ec != errc() || result.ptr == end || *result.ptr != ',') {
+            return false;
+        }
+        cursor = result.ptr + 1;
+        return true;
+    };
+    operation.toAccountNumber = 0;
+    if (!parseNumber(operation.accountNumber) ||
+        (operation.type == BatchOperationType::Transfer && !parseNumber(operation.toAccountNumber))) {
+        return false;
+    }
+
+    // Amount: whole dollars, then an optional '.' and one or two digits of cents
+    int64_t dollars;
+    from_chars_result result = from_chars(cursor, end, dollars);
+    if (result.ec != errc() || dollars < 0 || dollars > INT64_MAX / 100) {
+        return false;
+    }
+    int64_t cents = dollars * 100;
+    cursor = result.ptr;
+    if (cursor < end && *cursor == '.') {
+        cursor++;
+        int scale = 10;
+        while (cursor < end && scale > 0 && *cursor >= '0' && *cursor <= '9') {
+            cents += (*cursor++ - '0') * scale;
+            scale /= 10;
+        }
+    }
+    if (cursor != end) {
+        return false;
+    }
+    operation.amount = Money::fromCents(cents);
+    return true;
+}
+
+// HDR-style log-linear latency buckets. Values below 32 ticks get a bucket
+// each; above that every power of two is split into 32 buckets, so a
+// recorded value is known to within about 3%. Covers up to 2^41 ticks
+// (over ten minutes at 3 GHz); anything longer lands in the last bucket.
+struct LatencyBuckets {
+    static const int SUB_BUCKET_BITS = 5;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int MAX_EXPONENT = 40;
+    static const int COUNT = SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    static int bucketFor(uint64_t nanos) {
+        if (nanos < (uint64_t)SUB_BUCKETS) {
+            return (int)nanos;
+        }
+        int exponent = 63 - __builtin_clzll(nanos);
+        if (exponent > MAX_EXPONENT) {
+            return COUNT - 1;
+        }
+        int mantissa = (int)(nanos >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+        return SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS + mantissa;
+    }
+
+    // Highest value that falls into a bucket
+    static uint64_t highestValue(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return (uint64_t)bucket;
+        }
+        int shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+        uint64_t mantissa = (uint64_t)((bucket - SUB_BUCKETS) % SUB_BUCKETS);
+        return ((SUB_BUCKETS + mantissa + 1) << shift) - 1;
+    }
+};
+
+// Merged figures for one kind of operation
+struct OperationSummary {
+    uint64_t outcomes[OPERATION_STATUS_COUNT]; // Count per OperationStatus
+    uint64_t count;
+    uint64_t totalNanos;
+    uint64_t maxNanos;
+    double nanosPerTick;
+    vector<uint64_t> buckets; // Counts per LatencyBuckets bucket of ticks
+
+    // Latency at the given percentile (0-100), as the top of its bucket
+    uint64_t percentile(double percent) const {
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)ceil(percent / 100.0 * count);
+        if (rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < LatencyBuckets::COUNT; i++) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                return min((uint64_t)(LatencyBuckets::highestValue(i) * nanosPerTick), maxNanos);
+            }
+        }
+        return maxNanos;
+    }
+
+    uint64_t failures() const { return count - outcomes[(int)OperationStatus::Success]; }
+};
+
+// Latency histograms and outcome counters for Operations.
+// Every thread records into its own shard, so recording needs no lock and
+// no atomic read-modify-write: the owner thread is the only writer and
+// just stores the new values. Readers merge the shards at any time
+// without stopping the writers; a shard lives until the metrics do.
+class OperationMetrics {
+private:
+    struct Shard {
+        atomic<uint64_t> buckets[OPERATION_KIND_COUNT][LatencyBuckets::COUNT];
+        atomic<uint64_t> outcomes[OPERATION_KIND_COUNT][OPERATION_STATUS_COUNT];
+        atomic<uint64_t> totalTicks[OPERATION_KIND_COUNT];
+        atomic<uint64_t> maxTicks[OPERATION_KIND_COUNT];
+        thread::id owner;
+        Shard* next;
+    };
+
+    // Per-thread cache of the shard last used, keyed by metrics id so a
+    // new OperationMetrics at a reused address is never confused with an old one
+    struct ThreadShard {
+        uint64_t metricsId;
+        Shard* shard;
+    };
+
+    atomic<Shard*> shards; // Lock-free list, newest first
+    uint64_t id;
+    uint64_t startTicks; // Tick and clock readings at construction, to
+    chrono::steady_clock::time_point startTime; // calibrate ticks against
+
+    static uint64_t nextId() {
+        static atomic<uint64_t> counter(0);
+        return counter.fetch_add(1) + 1;
+    }
+
+    Shard& localShard() {
+        thread_local ThreadShard cached = {0, nullptr};
+        if (cached.metricsId == id) {
+            return *cached.shard;
+        }
+        thread::id self = this_thread::get_id();
+        Shard* shard = shards.load(memory_order_acquire);
+        while (shard && shard->owner != self) {
+            shard = shard->next;
+        }
+        if (!shard) {
+            shard = new Shard(); // Value-initialized: all counters zero
+            shard->owner = self;
+            shard->next = shards.load(memory_order_relaxed);
+            while (!shards.compare_exchange_weak(shard->next, shard, memory_order_release, memory_order_relaxed)) {
+            }
+        }
+        cached.metricsId = id;
+        cached.shard = shard;
+        return *shard;
+    }
+
+    // Single-writer increment: a plain load and store, no locked instruction
+    static void bump(atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+public:
+    // Constructor
+    OperationMetrics()
+        : shards(nullptr), id(nextId()), startTicks(readLatencyTicks()), startTime(chrono::steady_clock::now()) {}
+
+    // Destructor
+    ~OperationMetrics() {
+        Shard* shard = shards.load(memory_order_relaxed);
+        while (shard) {
+            Shard* next = shard->next;
+            delete shard;
+            shard = next;
+        }
+    }
+
+    OperationMetrics(const OperationMetrics&) = delete;
+    OperationMetrics& operator=(const OperationMetrics&) = delete;
+
+    void record(OperationKind kind, OperationStatus status, uint64_t ticks) {
+        Shard& shard = localShard();
+        int k = (int)kind;
+        bump(shard.buckets[k][LatencyBuckets::bucketFor(ticks)], 1);
+        bump(shard.outcomes[k][(int)status], 1);
+        bump(shard.totalTicks[k], ticks);
+        if (ticks > shard.maxTicks[k].load(memory_order_relaxed)) {
+            shard.maxTicks[k].store(ticks, memory_order_relaxed);
+        }
+    }
+
+    // Tick length measured over the metrics' lifetime so far
+    double nanosPerTick() const {
+#ifdef BANK_X86_SIMD
+        uint64_t ticks = readLatencyTicks() - startTicks;
+        double nanos = chrono::duration<double, nano>(chrono::steady_clock::now() - startTime).count();
+        return ticks ? nanos / ticks : 1.0;
+#else
+        return 1.0;
+#endif
+    }
+
+    // Merge every shard's figures for one kind of operation
+    OperationSummary summarize(OperationKind kind) const {
+        OperationSummary summary = {};
+        summary.buckets.assign(LatencyBuckets::COUNT, 0);
+        summary.nanosPerTick = nanosPerTick();
+        int k = (int)kind;
+        uint64_t totalTicks = 0;
+        uint64_t maxTicks = 0;
+        for (const Shard* shard = shards.load(memory_order_acquire); shard; shard = shard->next) {
+            for (int i = 0; i < LatencyBuckets::COUNT; i++) {
+                summary.buckets[i] += shard->buckets[k][i].load(memory_order_relaxed);
+            }
+            for (int s = 0; s < OPERATION_STATUS_COUNT; s++) {
+                summary.outcomes[s] += shard->outcomes[k][s].load(memory_order_relaxed);
+            }
+            totalTicks += shard->totalTicks[k].load(memory_order_relaxed);
+            maxTicks = max(maxTicks, shard->maxTicks[k].load(memory_order_relaxed));
+        }
+        summary.totalNanos = (uint64_t)(totalTicks * summary.nanosPerTick);
+        summary.maxNanos = (uint64_t)(maxTicks * summary.nanosPerTick);
+        // Count from the buckets so percentiles and the count agree even
+        // while other threads are recording
+        for (uint64_t bucketCount : summary.buckets) {
+            summary.count += bucketCount;
+        }
+        return summary;
+    }
+};
+
+// Times one operation and records it with its outcome when it goes out of scope
+class MetricsScope {
+private:
+    OperationMetrics& metrics;
+    OperationKind kind;
+    uint64_t startTicks;
+
+public:
+    OperationStatus status; // Outcome to record; Success unless set
+
+    // Constructor
+    MetricsScope(OperationMetrics& operationMetrics, OperationKind operationKind)
+        : metrics(operationMetrics), kind(operationKind), startTicks(readLatencyTicks()),
+          status(OperationStatus::Success) {}
+
+    // Destructor: record the elapsed time
+    ~MetricsScope() {
+        metrics.record(kind, status, readLatencyTicks() - startTicks);
+    }
+
+    MetricsScope(const MetricsScope&) = delete;
+    MetricsScope& operator=(const MetricsScope&) = delete;
+};
+
+// Operations class to manage all banking operations
+class Operations {
+private:
+    // Objects live in slab pools owned by Operations and are freed with it.
+    // Each account type has its own pool, so savings-only jobs walk just the
+    // savings pool and per-type counts are the pool sizes. Account handles
+    // carry SAVINGS_BIT to tell which pool they belong to.
+    static const Handle SAVINGS_BIT = 0x80000000u;
+    SlabPool<Customer> customerPool;
+    SlabPool<Account> accountPool;
+    SlabPool<SavingsAccount> savingsPool;
+
+    vector<Handle> customers;   // Customer handles in creation order
+    vector<Handle> allAccounts; // Account handles in creation order
+    IdIndex customerIndex;      // Customer ID -> handle
+    IdIndex accountIndex;       // Account number -> handle
+    NamePrefixIndex customerNames; // Customer name -> handle, for prefix search
+    BalanceLedger ledger;       // Columnar balances; slot i is allAccounts[i]
+    unique_ptr<Journal> journal; // Write-ahead journal, null until openJournal
+    void* snapshotData;         // Mapped snapshot that restored histories point into
+    size_t snapshotSize;
+    uint64_t journalStart;      // Journal offset the loaded snapshot already covers
+    WorkStealingPool* workPool; // Runs month-end over the savings pool
+    mutable OperationMetrics metrics; // Latency and outcome of each operation
+
+    // One side of a cross-shard transfer between prepare and commit/abort.
+    // Prepares and decisions are journaled, so these survive a restart.
+    struct PreparedTransfer {
+        int accountNumber;
+        Money amount;
+        uint64_t withdrawalMonth; // Paying side: month its withdrawal was counted in
+    };
+    mutex preparedMutex;
+    unordered_map<uint64_t, PreparedTransfer> preparedTransfers; // Key: transfer ID * 2 + outgoing
+    unordered_set<uint64_t> abortedUnprepared; // Aborted before this shard prepared them
+
+    // Creating and linking objects and the ledger-wide summaries take this
+    // exclusively; everything else shares it. Individual accounts are
+    // protected by their own mutex.
+    mutable shared_mutex registryMutex;
+
+    // Resolve handles to objects (caller holds registryMutex)
+    Customer* resolveCustomer(Handle handle) const {
+        return customerPool.get(handle);
+    }
+
+    Account* resolveAccount(Handle handle) const {
+        if (handle & SAVINGS_BIT) {
+            return savingsPool.get(handle & ~SAVINGS_BIT);
+        }
+        return accountPool.get(handle);
+    }
+
+    // Lookups (caller holds registryMutex)
+    Customer* lookupCustomer(int customerID) const {
+        Handle handle = customerIndex.find(customerID);
+        return handle != INVALID_HANDLE ? resolveCustomer(handle) : nullptr;
+    }
+
+    Account* lookupAccount(int accountNumber) const {
+        TRACE_SCOPE("Operations::lookup");
+        Handle handle = accountIndex.find(accountNumber);
+        return handle != INVALID_HANDLE ? resolveAccount(handle) : nullptr;
+    }
+
+    // Call 'action' with the account behind a handle as its concrete class,
+    // so its withdrawal rules are known at compile time and inline
+    template <typename Action>
+    auto withConcreteAccount(Handle handle, Action action) const {
+        if (handle & SAVINGS_BIT) {
+            return action(*savingsPool.get(handle & ~SAVINGS_BIT));
+        }
+        return action(*accountPool.get(handle));
+    }
+
+    // Map ledger slots to their accounts (caller holds registryMutex)
+    vector<Account*> resolveSlots(const vector<uint32_t>& slots) const {
+        vector<Account*> accounts;
+        accounts.reserve(slots.size());
+        for (uint32_t slot : slots) {
+            accounts.push_back(resolveAccount(allAccounts[slot]));
+        }
+        return accounts;
+    }
+
+    // Savings accounts per month-end chunk; smaller runs stay on the caller
+    static const size_t MONTH_END_GRAIN = 4096;
+
+    // Interest credited by one pool thread, padded to its own cache line
+    struct alignas(64) InterestTotal {
+        int64_t cents = 0;
+    };
+
+    // Apply interest to every savings account (caller holds registryMutex),
+    // resetting withdrawal counters in the same pass if asked. Chunks run on
+    // the work pool; each chunk encodes its journal records into its own
+    // buffer and the buffers are appended in chunk order, so the journal and
+    // every balance match a serial pass. Returns the journal sequence number
+    // to wait for.
+    uint64_t applyInterestLocked(bool resetWithdrawals) {
+        TRACE_SCOPE("Operations::applyInterest");
+        LOG_INFO << "\n--- Applying Interest to All Savings Accounts ---";
+        uint32_t count = savingsPool.size();
+        vector<string> chunkRecords(journal ? (count + MONTH_END_GRAIN - 1) / MONTH_END_GRAIN : 0);
+        vector<InterestTotal> totals(workPool->slotCount());
+
+        workPool->parallelFor(count, MONTH_END_GRAIN, [&](size_t begin, size_t end, unsigned slot) {
+            TRACE_SCOPE("Operations::interestChunk");
+            string* records = journal ? &chunkRecords[begin / MONTH_END_GRAIN] : nullptr;
+            JournalRecord record(JournalRecordType::Interest);
+            int64_t chunkInterest = 0;
+            savingsPool.forEachInRange((uint32_t)begin, (uint32_t)end, [&](SavingsAccount& savingsAcc) {
+                if (ledger.isRemoved(savingsAcc.getLedgerSlot())) {
+                    return; // Moved to another shard
+                }
+                if (resetWithdrawals) {
+                    savingsAcc.resetMonthlyWithdrawals();
+                }
+                Money interest = savingsAcc.applyInterest();
+                chunkInterest += interest.getCents();
+                if (records) {
+                    record.id = savingsAcc.getAccountNumber();
+                    record.amount = interest.getCents();
+                    record.timestamp = Transaction::currentTimestamp();
+                    Journal::encode(record, *records);
+                }
+            });
+            totals[slot].cents += chunkInterest;
+        });
+
+        // Reduce the per-thread totals
+        int64_t totalInterest = 0;
+        for (const InterestTotal& total : totals) {
+            totalInterest += total.cents;
+        }
+        LOG_INFO << "Interest applied to " << ledger.countType(AccountType::Savings) << " savings accounts.";
+        LOG_INFO << "Total interest credited: $" << Money::fromCents(totalInterest);
+
+        if (!journal) {
+            return 0;
+        }
+        string records;
+        for (string& chunk : chunkRecords) {
+            records += chunk;
+        }
+        return journal->appendEncoded(records);
+    }
+
+    // Queue a journal record (caller holds registryMutex). Returns the
+    // sequence number to pass to waitForJournal after the lock is released.
+    uint64_t journalRecord(const JournalRecord& record) {
+        return journal ? journal->append(record) : 0;
+    }
+
+    uint64_t journalTransaction(JournalRecordType type, int accountNumber, Money amount, int toAccountNumber = 0) {
+        if (!journal) {
+            return 0;
+        }
+        JournalRecord record(type);
+        record.id = accountNumber;
+        record.otherId = toAccountNumber;
+        record.amount = amount.getCents();
+        record.timestamp = Transaction::currentTimestamp();
+        return journal->append(record);
+    }
+
+    // Wait for a journaled operation to become durable; false if the
+    // journal failed first
+    bool waitForJournal(uint64_t sequenceNumber) {
+        return !sequenceNumber || journal->waitDurable(sequenceNumber);
+    }
+
+    // Wait for a journaled operation now, or hand its sequence number to a
+    // caller that waits for several at once (and then checks the outcome)
+    bool finishJournaled(uint64_t sequenceNumber, uint64_t* pendingSequence) {
+        if (pendingSequence) {
+            *pendingSequence = max(*pendingSequence, sequenceNumber);
+            return true;
+        }
+        return waitForJournal(sequenceNumber);
+    }
+
+    // Create objects without journaling or logging them; a non-zero ID or
+    // number restores an existing one (caller holds registryMutex exclusively)
+    Customer* addCustomerLocked(string_view name, int customerID) {
+        Handle handle = customerPool.create(name, customerID);
+        Customer* newCustomer = customerPool.get(handle);
+        customers.push_back(handle);
+        customerIndex.insert(newCustomer->getCustomerID(), handle);
+        customerNames.insert(newCustomer->getNameId(), handle);
+        return newCustomer;
+    }
+
+    // Returns nullptr once the account's pool is full: its next index would
+    // collide with SAVINGS_BIT and read as a handle into the other pool.
+    Account* addAccountLocked(AccountType type, string_view ownerName, Money initialBalance,
+                              double rate, Money limit, int accountNumber) {
+        if ((type == AccountType::Savings ? savingsPool.size() : accountPool.size()) >= SAVINGS_BIT) {
+            LOG_ERROR << "Error: Too many accounts, cannot open another!";
+            return nullptr;
+        }
+        Handle handle;
+        Account* newAccount;
+        if (type == AccountType::Savings) {
+            handle = savingsPool.create(ownerName, initialBalance, rate, limit, accountNumber) | SAVINGS_BIT;
+            newAccount = savingsPool.get(handle & ~SAVINGS_BIT);
+        } else {
+            handle = accountPool.create(ownerName, initialBalance, accountNumber);
+            newAccount = accountPool.get(handle);
+        }
+        allAccounts.push_back(handle);
+        accountIndex.insert(newAccount->getAccountNumber(), handle);
+        newAccount->attachLedger(&ledger, ledger.addAccount(initialBalance, type));
+        return newAccount;
+    }
+
+    void linkAccountLocked(Customer* customer, Account* account) {
+        customer->addAccount(account);
+        ledger.setOwner(account->getLedgerSlot(), (int32_t)customerIndex.find(customer->getCustomerID()));
+    }
+
+    // Forget an account that has moved to another shard: it is no longer
+    // found by its number, leaves its customer and drops out of the ledger.
+    // The emptied object stays in its pool (and allAccounts) until restart.
+    void retireAccountLocked(Account* account) {
+        accountIndex.erase(account->getAccountNumber());
+        if (Customer* customer = account->getCustomer()) {
+            customer->removeAccount(account);
+            account->setCustomer(nullptr);
+        }
+        ledger.removeAccount(account->getLedgerSlot());
+    }
+
+    // Whether a handle is still a live account (not moved to another shard)
+    bool isLiveAccount(Handle handle) const {
+        return !ledger.isRemoved(resolveAccount(handle)->getLedgerSlot());
+    }
+
+    // Settle what this shard prepared for a transfer once the coordinator
+    // has decided (caller holds registryMutex and preparedMutex). Also
+    // remembers an abort that arrived before the prepare it cancels. With
+    // releaseWithdrawal, an abort also gives back the monthly withdrawal
+    // the hold used, if that month is still running; returns the account
+    // number it did that for, or 0.
+    int finishPreparedLocked(uint64_t transferId, bool commit, int64_t timestamp, bool releaseWithdrawal) {
+        bool found = false;
+        int released = 0;
+        for (int outgoing = 0; outgoing < 2; outgoing++) {
+            auto it = preparedTransfers.find(transferId * 2 + outgoing);
+            if (it == preparedTransfers.end()) {
+                continue;
+            }
+            found = true;
+            // Receiving side on commit, paying side on abort
+            if (commit != (outgoing == 1)) {
+                Account* account = lookupAccount(it->second.accountNumber);
+                if (account) {
+                    account->replayTransaction(it->second.amount, TransactionType::Deposit, timestamp);
+                    if (!commit && releaseWithdrawal && account->releaseWithdrawal(it->second.withdrawalMonth)) {
+                        released = it->second.accountNumber;
+                    }
+                } else {
+                    LOG_ERROR << "Error: Transfer " << transferId << " cannot reach account "
+                         << it->second.accountNumber << "; $" << it->second.amount << " not settled";
+                }
+            }
+            preparedTransfers.erase(it);
+        }
+        if (!found && !commit) {
+            abortedUnprepared.insert(transferId);
+        }
+        return released;
+    }
+
+    // Apply one journal record during recovery (caller holds registryMutex exclusively)
+    void replayRecordLocked(const JournalRecord& record) {
+        Money amount = Money::fromCents(record.amount);
+        switch (record.type) {
+            case JournalRecordType::CreateCustomer:
+                addCustomerLocked(record.name, record.id);
+                break;
+            case JournalRecordType::CreateAccount:
+                addAccountLocked(record.accountType, record.name, amount, record.rate,
+                                 Money::fromCents(record.limit), record.id);
+                break;
+            case JournalRecordType::AssignAccount: {
+                Customer* customer = lookupCustomer(record.otherId);
+                Account* account = lookupAccount(record.id);
+                if (customer && account) {
+                    linkAccountLocked(customer, account);
+                }
+                break;
+            }
+            case JournalRecordType::Deposit:
+            case JournalRecordType::Withdrawal:
+            case JournalRecordType::Interest: {
+                Account* account = lookupAccount(record.id);
+                if (account) {
+                    TransactionType type = record.type == JournalRecordType::Deposit ? TransactionType::Deposit
+                        : record.type == JournalRecordType::Withdrawal ? TransactionType::Withdrawal
+                        : TransactionType::Interest;
+                    account->replayTransaction(amount, type, record.timestamp);
+                }
+                break;
+            }
+            case JournalRecordType::Transfer: {
+                Account* fromAccount = lookupAccount(record.id);
+                Account* toAccount = lookupAccount(record.otherId);
+                if (fromAccount && toAccount) {
+                    fromAccount->replayTransaction(amount, TransactionType::Withdrawal, record.timestamp);
+                    toAccount->replayTransaction(amount, TransactionType::Deposit, record.timestamp);
+                }
+                break;
+            }
+            case JournalRecordType::MonthlyReset:
+                savingsPool.forEach([](SavingsAccount& savingsAcc) {
+                    savingsAcc.resetMonthlyWithdrawals();
+                });
+                break;
+            case JournalRecordType::MoveAccountIn: {
+                Account* account = addAccountLocked(record.accountType, record.name, amount, record.rate,
+                                                    Money::fromCents(record.limit), record.id);
+                if (account && record.accountType == AccountType::Savings) {
+                    static_cast<SavingsAccount*>(account)->restoreWithdrawalsThisMonth(record.otherId);
+                }
+                break;
+            }
+            case JournalRecordType::MoveAccountOut: {
+                Account* account = lookupAccount(record.id);
+                if (account) {
+                    account->replayTransaction(amount, TransactionType::Withdrawal, record.timestamp);
+                    retireAccountLocked(account);
+                }
+                break;
+            }
+            case JournalRecordType::PrepareTransfer: {
+                Account* account = lookupAccount(record.id);
+                if (account) {
+                    if (record.otherId) {
+                        account->replayTransaction(amount, TransactionType::Withdrawal, record.timestamp);
+                    }
+                    lock_guard<mutex> preparedLock(preparedMutex);
+                    preparedTransfers[record.transferId * 2 + (record.otherId ? 1 : 0)] =
+                        PreparedTransfer{record.id, amount, account->getWithdrawalMonth()};
+                }
+                break;
+            }
+            case JournalRecordType::CommitTransfer:
+            case JournalRecordType::AbortTransfer: {
+                // A withdrawal given back has its own ReleaseWithdrawal record
+                lock_guard<mutex> preparedLock(preparedMutex);
+                finishPreparedLocked(record.transferId, record.type == JournalRecordType::CommitTransfer,
+                                     record.timestamp, false);
+                break;
+            }
+            case JournalRecordType::ReleaseWithdrawal: {
+                Account* account = lookupAccount(record.id);
+                if (account) {
+                    account->releaseWithdrawal(account->getWithdrawalMonth());
+                }
+                break;
+            }
+            case JournalRecordType::TransferStarted:
+            case JournalRecordType::TransferCommitted:
+            case JournalRecordType::TransferFinished:
+            case JournalRecordType::AccountUnplaced:
+            case JournalRecordType::AccountPlaced:
+                break; // Only in a router's decision log
+        }
+    }
+
+    // Apply part of a batch run whose accounts all live in one pool. The
+    // loop is compiled for the pool's account class, so withdrawals call
+    // its rules directly instead of through the virtual tryWithdraw.
+    template <typename AccountClass>
+    static void applyBatchRunAs(const SlabPool<AccountClass>& pool, const BatchOperation* operations,
+                                const vector<Handle>& handles, const uint32_t* run, size_t count,
+                                vector<OperationStatus>& statuses) {
+        for (size_t i = 0; i < count; i++) {
+            uint32_t index = run[i];
+            AccountClass& account = *pool.get(handles[index] & ~SAVINGS_BIT);
+            const BatchOperation& operation = operations[index];
+            if (operation.type == BatchOperationType::Deposit) {
+                statuses[index] = account.tryDeposit(operation.amount);
+            } else {
+                statuses[index] = account.tryWithdrawDirect(operation.amount);
+            }
+        }
+    }
+
+    // Apply a run of deposits and withdrawals from a batch, grouped by account
+    // (caller holds registryMutex)
+    void applyBatchRun(const BatchOperation* operations, const vector<Handle>& handles,
+                       vector<uint32_t>& run, vector<OperationStatus>& statuses) const {
+        // Stable, so each account's operations keep their input order. Regular
+        // accounts sort before savings accounts, and unknown ones last.
+        stable_sort(run.begin(), run.end(), [&](uint32_t a, uint32_t b) {
+            return handles[a] < handles[b];
+        });
+        size_t savingsStart = partition_point(run.begin(), run.end(), [&](uint32_t index) {
+            return !(handles[index] & SAVINGS_BIT);
+        }) - run.begin();
+        size_t unknownStart = partition_point(run.begin(), run.end(), [&](uint32_t index) {
+            return handles[index] != INVALID_HANDLE;
+        }) - run.begin();
+        applyBatchRunAs(accountPool, operations, handles, run.data(), savingsStart, statuses);
+        applyBatchRunAs(savingsPool, operations, handles, run.data() + savingsStart,
+                        unknownStart - savingsStart, statuses);
+        for (size_t i = unknownStart; i < run.size(); i++) {
+            statuses[run[i]] = OperationStatus::AccountNotFound;
+        }
+    }
+
+    // Statement text a shard buffers before writing it out
+    static constexpr size_t STATEMENT_BUFFER_BYTES = 1 << 20;
+
+    // Write a whole buffer to a file descriptor
+    static bool writeAll(int fd, const string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t result = ::write(fd, data.data() + written, data.size() - written);
+            if (result <= 0) {
+                return false;
+            }
+            written += (size_t)result;
+        }
+        return true;
+    }
+
+    // Settlement file bytes parsed and applied per round of the importer
+    static constexpr size_t IMPORT_WINDOW_BYTES = 64 << 20;
+
+    // One account's part of an imported operation. A transfer between
+    // accounts of different partitions becomes an outgoing leg (the
+    // withdrawal, which decides the transfer) and an incoming leg (the
+    // deposit, which waits for that decision).
+    enum class ImportLegKind : uint8_t {
+        Deposit,
+        Withdrawal,
+        Transfer,    // Both accounts in this partition
+        TransferOut,
+        TransferIn
+    };
+
+    struct ImportLeg {
+        ImportLegKind kind;
+        uint32_t transfer; // Chunk-local transfer number (TransferOut/TransferIn)
+        Handle account;     // Resolved to its concrete class when applied
+        Account* toAccount; // Transfer and TransferOut
+        int64_t cents;
+    };
+
+    // What one parser thread made of its chunk of a window
+    struct ImportChunk {
+        vector<vector<ImportLeg>> legs; // Per partition, in file order
+        uint32_t transfers = 0;         // Cross-partition transfers
+        uint64_t lines = 0;
+        uint64_t malformed = 0;
+        uint64_t notFound = 0;
+    };
+
+    // Per-partition outcome counts, padded to their own cache lines
+    struct alignas(64) ImportTally {
+        uint64_t outcomes[OPERATION_STATUS_COUNT] = {};
+        string records; // Encoded journal records
+    };
+
+    // Partitions own whole 64-slot runs of the ledger, so threads never
+    // write to the same cache line of the balance column
+    static unsigned importPartition(const Account* account, unsigned partitions) {
+        return (account->getLedgerSlot() / 64) % partitions;
+    }
+
+    // Parse the lines in [begin, end) into per-partition legs (caller holds
+    // registryMutex)
+    void parseImportChunk(const char* begin, const char* end, unsigned partitions, ImportChunk& chunk) const {
+        TRACE_SCOPE("Operations::importParse");
+        chunk.legs.assign(partitions, vector<ImportLeg>());
+        BatchOperation operation;
+        while (begin < end) {
+            const char* newline = (const char*)memchr(begin, '\n', end - begin);
+            const char* lineEnd = newline ? newline : end;
+            const char* line = begin;
+            begin = newline ? newline + 1 : end;
+            if (lineEnd == line || *line == '#' || (lineEnd - line == 1 && *line == '\r') ||
+                string_view(line, lineEnd - line).compare(0, 5, "type,") == 0) {
+                continue;
+            }
+            chunk.lines++;
+            if (!parseSettlementLine(line, lineEnd, operation)) {
+                chunk.malformed++;
+                continue;
+            }
+            Handle handle = accountIndex.find(operation.accountNumber);
+            Handle toHandle = operation.type == BatchOperationType::Transfer
+                ? accountIndex.find(operation.toAccountNumber) : INVALID_HANDLE;
+            if (handle == INVALID_HANDLE || (operation.type == BatchOperationType::Transfer && toHandle == INVALID_HANDLE)) {
+                chunk.notFound++;
+                continue;
+            }
+            unsigned partition = importPartition(resolveAccount(handle), partitions);
+            int64_t cents = operation.amount.getCents();
+            if (operation.type == BatchOperationType::Deposit) {
+                chunk.legs[partition].push_back(ImportLeg{ImportLegKind::Deposit, 0, handle, nullptr, cents});
+            } else if (operation.type == BatchOperationType::Withdrawal) {
+                chunk.legs[partition].push_back(ImportLeg{ImportLegKind::Withdrawal, 0, handle, nullptr, cents});
+            } else {
+                Account* toAccount = resolveAccount(toHandle);
+                unsigned toPartition = importPartition(toAccount, partitions);
+                if (toPartition == partition) {
+                    chunk.legs[partition].push_back(ImportLeg{ImportLegKind::Transfer, 0, handle, toAccount, cents});
+                } else {
+                    uint32_t transfer = chunk.transfers++;
+                    chunk.legs[partition].push_back(ImportLeg{ImportLegKind::TransferOut, transfer, handle, toAccount, cents});
+                    chunk.legs[toPartition].push_back(ImportLeg{ImportLegKind::TransferIn, transfer, toHandle, nullptr, cents});
+                }
+            }
+        }
+    }
+
+    // Apply one partition's legs of every chunk, in file order. Each account
+    // belongs to exactly one partition, so its operations apply in file
+    // order and no account lock is needed. An incoming transfer leg waits
+    // until the partition owning the source account has decided it; the
+    // oldest undecided transfer's source partition is never itself waiting
+    // on a later one, so the wait always ends, and every balance comes out
+    // as if the file had been applied line by line.
+    void applyImportPartition(const vector<ImportChunk>& chunks, unsigned partition,
+                              const vector<uint32_t>& transferBase, atomic<uint8_t>* decisions,
+                              ImportTally& tally) const {
+        TRACE_SCOPE("Operations::importApply");
+        JournalRecord record(JournalRecordType::Deposit);
+        int64_t timestamp = Transaction::currentTimestamp();
+        for (size_t c = 0; c < chunks.size(); c++) {
+            for (const ImportLeg& leg : chunks[c].legs[partition]) {
+                Money amount = Money::fromCents(leg.cents);
+                Account* account = resolveAccount(leg.account);
+                auto withdraw = [amount](auto& concrete) { return concrete.tryWithdrawDirect(amount); };
+                OperationStatus status = OperationStatus::Success;
+                switch (leg.kind) {
+                    case ImportLegKind::Deposit:
+                        status = account->tryDeposit(amount);
+                        record.type = JournalRecordType::Deposit;
+                        break;
+                    case ImportLegKind::Withdrawal:
+                        status = withConcreteAccount(leg.account, withdraw);
+                        record.type = JournalRecordType::Withdrawal;
+                        break;
+                    case ImportLegKind::Transfer:
+                        status = withConcreteAccount(leg.account, withdraw);
+                        if (status == OperationStatus::Success) {
+                            leg.toAccount->tryDeposit(amount);
+                        }
+                        record.type = JournalRecordType::Transfer;
+                        break;
+                    case ImportLegKind::TransferOut:
+                        status = withConcreteAccount(leg.account, withdraw);
+                        decisions[transferBase[c] + leg.transfer].store(
+                            status == OperationStatus::Success ? 1 : 2, memory_order_release);
+                        record.type = JournalRecordType::Transfer;
+                        break;
+                    case ImportLegKind::TransferIn: {
+                        // Counted on the outgoing side
+                        atomic<uint8_t>& decision = decisions[transferBase[c] + leg.transfer];
+                        uint8_t outcome;
+                        for (int spins = 0; (outcome = decision.load(memory_order_acquire)) == 0; spins++) {
+                            if (spins > 64) {
+                                this_thread::yield();
+                            }
+                        }
+                        if (outcome == 1) {
+                            account->tryDeposit(amount);
+                        }
+                        continue;
+                    }
+                }
+                tally.outcomes[(int)status]++;
+                if (journal && status == OperationStatus::Success) {
+                    record.id = account->getAccountNumber();
+                    record.otherId = leg.toAccount ? leg.toAccount->getAccountNumber() : 0;
+                    record.amount = leg.cents;
+                    record.timestamp = timestamp;
+                    Journal::encode(record, tally.records);
+                }
+            }
+        }
+    }
+
+public:
+    // Constructor
+    Operations()
+        : snapshotData(nullptr), snapshotSize(0), journalStart(0),
+          workPool(&WorkStealingPool::shared()) {}
+
+    // Destructor: the pools destroy every customer and account
+    ~Operations() {
+        if (snapshotData) {
+            munmap(snapshotData, snapshotSize);
+        }
+    }
+
+    Operations(const Operations&) = delete;
+    Operations& operator=(const Operations&) = delete;
+
+    // Run bulk jobs on a different pool (the shared one by default)
+    void setWorkPool(WorkStealingPool& pool) {
+        unique_lock<shared_mutex> lock(registryMutex);
+        workPool = &pool;
+    }
+
+    // Resolve handles to objects
+    Customer* getCustomer(Handle handle) const {
+        shared_lock<shared_mutex> lock(registryMutex);
+        return resolveCustomer(handle);
+    }
+
+    Account* getAccount(Handle handle) const {
+        shared_lock<shared_mutex> lock(registryMutex);
+        return resolveAccount(handle);
+    }
+
+    // Recover from a journal file and keep journaling to it. Existing records
+    // are replayed first, which rebuilds every customer, account and balance;
+    // an incomplete record left by a crash is cut off. Afterwards every
+    // successful change made through Operations is appended. Call before
+    // the system is used; returns false if the file cannot be opened.
+    bool openJournal(const string& path, JournalSync mode = JournalSync::Group) {
+        unique_lock<shared_mutex> lock(registryMutex);
+        if (journal) {
+            return false;
+        }
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            return false;
+        }
+
+        size_t size = (size_t)info.st_size;
+        size_t offset = 0;
+        if (size > 0) {
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+            const char* data = (const char*)mapped;
+
+            // Replay quietly; the records were reported when first applied
+            LogLevel savedLevel = Logger::getLevel();
+            Logger::setLevel(min(savedLevel, LogLevel::Error));
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            size_t records = 0;
+            JournalRecord record;
+            while (offset < size) {
+                size_t used = Journal::decode(data, size, offset, record);
+                if (used == 0) {
+                    break;
+                }
+                if (offset >= journalStart) { // Older records are in the loaded snapshot
+                    replayRecordLocked(record);
+                    records++;
+                }
+                offset += used;
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            Logger::setLevel(savedLevel);
+            munmap(mapped, size);
+
+            LOG_INFO << "Journal replayed: " << records << " records (" << offset << " bytes) in "
+                 << seconds * 1000 << " ms, " << (uint64_t)(seconds > 0 ? records / seconds : 0)
+                 << " records/s";
+            if (offset < size) {
+                LOG_ERROR << "Journal: discarding " << (size - offset) << " bytes of incomplete record at the end";
+                if (ftruncate(fd, (off_t)offset) != 0) {
+                    close(fd);
+                    return false;
+                }
+            }
+        }
+        if (offset < journalStart) {
+            LOG_ERROR << "Journal " << path << " ends before the loaded snapshot (" << offset
+                 << " of " << journalStart << " bytes); not using it";
+            close(fd);
+            return false;
+        }
+        journal.reset(new Journal(fd, mode, offset));
+        return true;
+    }
+
+    // Write a snapshot of every customer, account and transaction. The file
+    // is written next to path and renamed into place once it is complete.
+    // With a journal, the snapshot records how much of it is covered, so
+    // recovery can load the snapshot and replay only newer records.
+    bool writeSnapshot(const string& path) {
+        // Exclusive, so the snapshot is one consistent point in time
+        unique_lock<shared_mutex> lock(registryMutex);
+        const size_t FLUSH_BYTES = 1 << 20;
+
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.transactionSize = sizeof(Transaction);
+        header.journalOffset = journalStart;
+        if (journal && !journal->sync(header.journalOffset)) {
+            LOG_ERROR << "Error: Cannot write snapshot " << path << " while the journal is failing";
+            return false;
+        }
+
+        string temporaryPath = path + ".tmp";
+        int fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = true;
+        uint64_t written = 0;
+        string buffer(sizeof(SnapshotHeader), '\0'); // Header is filled in last
+        auto flushBuffer = [&]() {
+            size_t done = 0;
+            while (ok && done < buffer.size()) {
+                ssize_t result = ::write(fd, buffer.data() + done, buffer.size() - done);
+                if (result <= 0) {
+                    ok = false;
+                }
+                done += result > 0 ? (size_t)result : 0;
+            }
+            written += buffer.size();
+            buffer.clear();
+        };
+
+        // Transactions are streamed out; the other sections are small
+        header.transactionOffset = sizeof(SnapshotHeader);
+        vector<SnapshotAccount> accountRecords;
+        string names;
+        for (Handle handle : allAccounts) {
+            if (!isLiveAccount(handle)) {
+                continue;
+            }
+            const Account* account = resolveAccount(handle);
+            SnapshotAccount entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.accountNumber = account->getAccountNumber();
+            entry.type = (uint8_t)((handle & SAVINGS_BIT) ? AccountType::Savings : AccountType::Regular);
+            entry.balance = account->getBalance().getCents();
+            if (handle & SAVINGS_BIT) {
+                const SavingsAccount* savingsAcc = static_cast<const SavingsAccount*>(account);
+                entry.withdrawalsThisMonth = savingsAcc->getWithdrawalsThisMonth();
+                entry.limit = savingsAcc->getWithdrawalLimit().getCents();
+                entry.rate = savingsAcc->getInterestRate();
+            }
+            entry.nameStart = names.size();
+            entry.nameLength = (uint32_t)account->getOwnerName().size();
+            names += account->getOwnerName();
+            entry.historyStart = header.transactionCount;
+            account->getHistory().forEach([&](const Transaction& trans) {
+                buffer.append((const char*)&trans, sizeof(Transaction));
+                header.transactionCount++;
+                if (buffer.size() >= FLUSH_BYTES) {
+                    flushBuffer();
+                }
+            });
+            entry.historyCount = header.transactionCount - entry.historyStart;
+            accountRecords.push_back(entry);
+        }
+
+        vector<SnapshotCustomer> customerRecords;
+        vector<int32_t> links;
+        for (Handle handle : customers) {
+            const Customer* customer = resolveCustomer(handle);
+            SnapshotCustomer entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.customerID = customer->getCustomerID();
+            entry.nameStart = names.size();
+            entry.nameLength = (uint32_t)customer->getName().size();
+            names += customer->getName();
+            entry.linkStart = links.size();
+            for (const Account* account : customer->getAccounts()) {
+                if (lookupAccount(account->getAccountNumber()) == account) { // Skip moved-out accounts
+                    links.push_back(account->getAccountNumber());
+                }
+            }
+            entry.linkCount = links.size() - entry.linkStart;
+            customerRecords.push_back(entry);
+        }
+
+        header.accountOffset = written + buffer.size();
+        header.accountCount = accountRecords.size();
+        buffer.append((const char*)accountRecords.data(), accountRecords.size() * sizeof(SnapshotAccount));
+        header.customerOffset = written + buffer.size();
+        header.customerCount = customerRecords.size();
+        buffer.append((const char*)customerRecords.data(), customerRecords.size() * sizeof(SnapshotCustomer));
+        header.preparedOffset = written + buffer.size();
+        header.preparedCount = preparedTransfers.size();
+        for (const auto& entry : preparedTransfers) {
+            SnapshotPrepared prepared;
+            memset(&prepared, 0, sizeof(prepared));
+            prepared.transferId = entry.first / 2;
+            prepared.accountNumber = entry.second.accountNumber;
+            prepared.outgoing = (uint8_t)(entry.first % 2);
+            prepared.amount = entry.second.amount.getCents();
+            buffer.append((const char*)&prepared, sizeof(prepared));
+        }
+        header.linkOffset = written + buffer.size();
+        header.linkCount = links.size();
+        buffer.append((const char*)links.data(), links.size() * sizeof(int32_t));
+        header.nameOffset = written + buffer.size();
+        header.nameSize = names.size();
+        buffer += names;
+        flushBuffer();
+
+        ok = ok && pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+        ok = ok && fdatasync(fd) == 0;
+        close(fd);
+        ok = ok && rename(temporaryPath.c_str(), path.c_str()) == 0;
+        if (!ok) {
+            unlink(temporaryPath.c_str());
+            return false;
+        }
+        LOG_INFO << "Snapshot written: " << customers.size() << " customers, " << accountRecords.size()
+             << " accounts, " << header.transactionCount << " transactions";
+        return true;
+    }
+
+    // Load a snapshot into an empty Operations. The file is mapped and only
+    // the account and customer sections are read; each account's history
+    // points into the mapping and is paged in when it is first visited.
+    // Call before openJournal. Returns false if the file is not a valid
+    // snapshot of this version.
+    bool openSnapshot(const string& path) {
+        unique_lock<shared_mutex> lock(registryMutex);
+        if (journal || snapshotData || !customers.empty() || !allAccounts.empty()) {
+            return false;
+        }
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SnapshotHeader)) {
+            close(fd);
+            return false;
+        }
+        size_t size = (size_t)info.st_size;
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        const char* data = (const char*)mapped;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        SnapshotHeader header;
+        memcpy(&header, data, sizeof(header));
+        auto fits = [&](uint64_t offset, uint64_t count, uint64_t itemSize) {
+            return offset <= size && count <= (size - offset) / itemSize;
+        };
+        bool valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 &&
+                     header.version == SNAPSHOT_VERSION &&
+                     header.transactionSize == sizeof(Transaction) &&
+                     fits(header.transactionOffset, header.transactionCount, sizeof(Transaction)) &&
+                     fits(header.accountOffset, header.accountCount, sizeof(SnapshotAccount)) &&
+                     fits(header.customerOffset, header.customerCount, sizeof(SnapshotCustomer)) &&
+                     fits(header.preparedOffset, header.preparedCount, sizeof(SnapshotPrepared)) &&
+                     fits(header.linkOffset, header.linkCount, sizeof(int32_t)) &&
+                     fits(header.nameOffset, header.nameSize, 1) &&
+                     header.accountCount < SAVINGS_BIT;
+        const SnapshotAccount* accountRecords = (const SnapshotAccount*)(data + header.accountOffset);
+        const SnapshotCustomer* customerRecords = (const SnapshotCustomer*)(data + header.customerOffset);
+        for (uint64_t i = 0; valid && i < header.accountCount; i++) {
+            const SnapshotAccount& entry = accountRecords[i];
+            valid = entry.historyStart <= header.transactionCount &&
+                    entry.historyCount <= header.transactionCount - entry.historyStart &&
+                    entry.nameStart <= header.nameSize && entry.nameLength <= header.nameSize - entry.nameStart &&
+                    (entry.type == (uint8_t)AccountType::Regular || entry.type == (uint8_t)AccountType::Savings);
+        }
+        for (uint64_t i = 0; valid && i < header.customerCount; i++) {
+            const SnapshotCustomer& entry = customerRecords[i];
+            valid = entry.linkStart <= header.linkCount && entry.linkCount <= header.linkCount - entry.linkStart &&
+                    entry.nameStart <= header.nameSize && entry.nameLength <= header.nameSize - entry.nameStart;
+        }
+        if (!valid) {
+            munmap(mapped, size);
+            LOG_ERROR << "Snapshot " << path << " is damaged or from another version";
+            return false;
+        }
+
+        // Linking accounts logs a line per account; stay quiet
+        LogLevel savedLevel = Logger::getLevel();
+        Logger::setLevel(min(savedLevel, LogLevel::Error));
+        const Transaction* transactions = (const Transaction*)(data + header.transactionOffset);
+        const int32_t* links = (const int32_t*)(data + header.linkOffset);
+        const char* names = data + header.nameOffset;
+        for (uint64_t i = 0; i < header.accountCount; i++) {
+            const SnapshotAccount& entry = accountRecords[i];
+            Account* account = addAccountLocked((AccountType)entry.type, string_view(names + entry.nameStart, entry.nameLength),
+                                                Money::fromCents(entry.balance), entry.rate,
+                                                Money::fromCents(entry.limit), entry.accountNumber);
+            account->attachHistory(transactions + entry.historyStart, (uint32_t)entry.historyCount);
+            if (entry.type == (uint8_t)AccountType::Savings) {
+                static_cast<SavingsAccount*>(account)->restoreWithdrawalsThisMonth(entry.withdrawalsThisMonth);
+            }
+        }
+        for (uint64_t i = 0; i < header.customerCount; i++) {
+            const SnapshotCustomer& entry = customerRecords[i];
+            Customer* customer = addCustomerLocked(string_view(names + entry.nameStart, entry.nameLength), entry.customerID);
+            for (uint64_t j = 0; j < entry.linkCount; j++) {
+                Account* account = lookupAccount(links[entry.linkStart + j]);
+                if (account) {
+                    linkAccountLocked(customer, account);
+                }
+            }
+        }
+        const SnapshotPrepared* preparedRecords = (const SnapshotPrepared*)(data + header.preparedOffset);
+        for (uint64_t i = 0; i < header.preparedCount; i++) {
+            const SnapshotPrepared& entry = preparedRecords[i];
+            Account* account = lookupAccount(entry.accountNumber);
+            preparedTransfers[entry.transferId * 2 + (entry.outgoing ? 1 : 0)] =
+                PreparedTransfer{entry.accountNumber, Money::fromCents(entry.amount),
+                                 account ? account->getWithdrawalMonth() : 0};
+        }
+        Logger::setLevel(savedLevel);
+
+        snapshotData = mapped;
+        snapshotSize = size;
+        journalStart = header.journalOffset;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        LOG_INFO << "Snapshot loaded: " << header.customerCount << " customers, " << header.accountCount
+             << " accounts (" << header.transactionCount << " transactions left on disk) in "
+             << seconds * 1000 << " ms";
+        return true;
+    }
+
+    // Number of journal fsyncs so far (0 without a journal)
+    uint64_t getJournalSyncCount() const {
+        shared_lock<shared_mutex> lock(registryMutex);
+        return journal ? journal->getSyncCount() : 0;
+    }
+
+    // Create a new customer
+    Customer* createCustomer(const string& name) {
+        unique_lock<shared_mutex> lock(registryMutex);
+        Customer* newCustomer = addCustomerLocked(name, 0);
+        JournalRecord record(JournalRecordType::CreateCustomer);
+        record.id = newCustomer->getCustomerID();
+        record.name = name;
+        uint64_t sequenceNumber = journalRecord(record);
+        LOG_INFO << "Customer created: " << name << " (ID: " 
+             << newCustomer->getCustomerID() << ")";
+        lock.unlock();
+        waitForJournal(sequenceNumber);
+        return newCustomer;
+    }
+
+    // Create a regular account; a non-zero number opens it under that
+    // number (nullptr if the number is taken or no more accounts fit)
+    Account* createAccount(const string& ownerName, Money initialBalance = 0.0, int accountNumber = 0) {
+        unique_lock<shared_mutex> lock(registryMutex);
+        if (accountNumber && lookupAccount(accountNumber)) {
+            return nullptr;
+        }
+        Account* newAccount = addAccountLocked(AccountType::Regular, ownerName, initialBalance, 0.0, Money(),
+                                               accountNumber);
+        if (!newAccount) {
+            return nullptr;
+        }
+        JournalRecord record(JournalRecordType::CreateAccount);
+        record.id = newAccount->getAccountNumber();
+        record.amount = initialBalance.getCents();
+        record.name = ownerName;
+        uint64_t sequenceNumber = journalRecord(record);
+        LOG_INFO << "Regular account created for " << ownerName 
+             << " (Account #" << newAccount->getAccountNumber() << ")";
+        lock.unlock();
+        waitForJournal(sequenceNumber);
+        return newAccount;
+    }
+
+    // Create a savings account; a non-zero number opens it under that
+    // number (nullptr if the number is taken or no more accounts fit)
+    SavingsAccount* createSavingsAccount(const string& ownerName, 
+                                       Money initialBalance = 0.0, 
+                                       double rate = 0.02, 
+                                       Money limit = 1000.0,
+                                       int accountNumber = 0) {
+        unique_lock<shared_mutex> lock(registryMutex);
+        if (accountNumber && lookupAccount(accountNumber)) {
+            return nullptr;
+        }
+        SavingsAccount* newAccount = static_cast<SavingsAccount*>(
+            addAccountLocked(AccountType::Savings, ownerName, initialBalance, rate, limit, accountNumber));
+        if (!newAccount) {
+            return nullptr;
+        }
+        JournalRecord record(JournalRecordType::CreateAccount);
+        record.accountType = AccountType::Savings;
+        record.id = newAccount->getAccountNumber();
+        record.amount = initialBalance.getCents();
+        record.limit = limit.getCents();
+        record.rate = rate;
+        record.name = ownerName;
+        uint64_t sequenceNumber = journalRecord(record);
+        LOG_INFO << "Savings account created for " << ownerName 
+             << " (Account #" << newAccount->getAccountNumber() << ")";
+        lock.unlock();
+        waitForJournal(sequenceNumber);
+        return newAccount;
+    }
+
+    // Link account to customer
+    void assignAccountToCustomer(Customer* customer, Account* account) {
+        if (customer && account) {
+            unique_lock<shared_mutex> lock(registryMutex);
+            linkAccountLocked(customer, account);
+            JournalRecord record(JournalRecordType::AssignAccount);
+            record.id = account->getAccountNumber();
+            record.otherId = customer->getCustomerID();
+            uint64_t sequenceNumber = journalRecord(record);
+            LOG_INFO << "Account " << account->getAccountNumber() 
+                 << " assigned to customer " << customer->getName();
+            lock.unlock();
+            waitForJournal(sequenceNumber);
+        } else {
+            LOG_ERROR << "Error: Invalid customer or account!";
+        }
+    }
+
+    // Perform deposit operation
+    OperationStatus performDepositWithStatus(int accountNumber, Money amount, uint64_t* pendingSequence = nullptr) {
+        TRACE_SCOPE("Operations::performDeposit");
+        MetricsScope scope(metrics, OperationKind::Deposit);
+        shared_lock<shared_mutex> lock(registryMutex);
+        Account* account = lookupAccount(accountNumber);
+        if (account) {
+            scope.status = account->depositAndReport(amount);
+            if (scope.status == OperationStatus::Success) {
+                uint64_t sequenceNumber = journalTransaction(JournalRecordType::Deposit, accountNumber, amount);
+                lock.unlock();
+                if (!finishJournaled(sequenceNumber, pendingSequence)) {
+                    scope.status = OperationStatus::NotDurable;
+                }
+            }
+        } else {
+            scope.status = OperationStatus::AccountNotFound;
+            LOG_ERROR << "Error: Account " << accountNumber << " not found!";
+        }
+        return scope.status;
+    }
+
+    // Perform withdrawal operation
+    OperationStatus performWithdrawalWithStatus(int accountNumber, Money amount, uint64_t* pendingSequence = nullptr) {
+        TRACE_SCOPE("Operations::performWithdrawal");
+        MetricsScope scope(metrics, OperationKind::Withdrawal);
+        shared_lock<shared_mutex> lock(registryMutex);
+        Account* account = lookupAccount(accountNumber);
+        if (account) {
+            scope.status = account->withdrawAndReport(amount);
+            if (scope.status == OperationStatus::Success) {
+                uint64_t sequenceNumber = journalTransaction(JournalRecordType::Withdrawal, accountNumber, amount);
+                lock.unlock();
+                if (!finishJournaled(sequenceNumber, pendingSequence)) {
+                    scope.status = OperationStatus::NotDurable;
+                }
+            }
+        } else {
+            scope.status = OperationStatus::AccountNotFound;
+            LOG_ERROR << "Error: Account " << accountNumber << " not found!";
+        }
+        return scope.status;
+    }
+
+    // Perform transfer operation
+    OperationStatus performTransferWithStatus(int fromAccountNumber, int toAccountNumber, Money amount,
+                                              uint64_t* pendingSequence = nullptr) {
+        TRACE_SCOPE("Operations::performTransfer");
+        MetricsScope scope(metrics, OperationKind::Transfer);
+        shared_lock<shared_mutex> lock(registryMutex);
+        Account* fromAccount = lookupAccount(fromAccountNumber);
+        Account* toAccount = lookupAccount(toAccountNumber);
+        
+        if (fromAccount && toAccount) {
+            scope.status = fromAccount->transferAndReport(*toAccount, amount);
+            if (scope.status == OperationStatus::Success) {
+                uint64_t sequenceNumber = journalTransaction(JournalRecordType::Transfer, fromAccountNumber,
+                                                             amount, toAccountNumber);
+                lock.unlock();
+                if (!finishJournaled(sequenceNumber, pendingSequence)) {
+                    scope.status = OperationStatus::NotDurable;
+                }
+            }
+        } else {
+            scope.status = OperationStatus::AccountNotFound;
+            LOG_ERROR << "Error: One or both accounts not found!";
+        }
+        return scope.status;
+    }
+
+    // The same operations returning whether they succeeded (a deposit
+    // counts as done whenever the account exists and the journal works)
+    bool performDeposit(int accountNumber, Money amount) {
+        OperationStatus status = performDepositWithStatus(accountNumber, amount);
+        return status != OperationStatus::AccountNotFound && status != OperationStatus::NotDurable;
+    }
+
+    bool performWithdrawal(int accountNumber, Money amount) {
+        return performWithdrawalWithStatus(accountNumber, amount) == OperationStatus::Success;
+    }
+
+    bool performTransfer(int fromAccountNumber, int toAccountNumber, Money amount) {
+        return performTransferWithStatus(fromAccountNumber, toAccountNumber, amount) == OperationStatus::Success;
+    }
+
+    // Wait until a sequence number handed out through pendingSequence is
+    // durable; false if the journal failed first
+    bool waitUntilDurable(uint64_t sequenceNumber) {
+        return waitForJournal(sequenceNumber);
+    }
+
+    // This shard's side of a cross-shard transfer (two-phase commit).
+    // Preparing the paying side withdraws the amount under the account's
+    // usual rules and holds it; preparing the receiving side only checks the
+    // account. Both are journaled, so a prepared transfer survives a restart
+    // until the coordinator decides. A side that is already prepared, or a
+    // transfer this shard already aborted (the coordinator gave up waiting
+    // for the vote), is refused with TransferDecided.
+    OperationStatus prepareTransfer(uint64_t transferId, int accountNumber, Money amount, bool outgoing,
+                                    uint64_t* pendingSequence = nullptr) {
+        TRACE_SCOPE("Operations::prepareTransfer");
+        shared_lock<shared_mutex> lock(registryMutex);
+        Account* account = lookupAccount(accountNumber);
+        if (!account) {
+            return OperationStatus::AccountNotFound;
+        }
+        if (amount <= 0) {
+            return OperationStatus::InvalidAmount;
+        }
+        uint64_t sequenceNumber;
+        {
+            // Held until the record is queued, so a decision is always
+            // journaled after the prepare it settles
+            lock_guard<mutex> preparedLock(preparedMutex);
+            if (abortedUnprepared.count(transferId) || preparedTransfers.count(transferId * 2 + outgoing)) {
+                return OperationStatus::TransferDecided;
+            }
+            // Read first: a month-end reset in between only means an abort
+            // can't give the withdrawal back
+            uint64_t month = account->getWithdrawalMonth();
+            if (outgoing) {
+                OperationStatus status = account->tryWithdraw(amount);
+                if (status != OperationStatus::Success) {
+                    return status;
+                }
+            }
+            preparedTransfers[transferId * 2 + outgoing] = PreparedTransfer{accountNumber, amount, month};
+            JournalRecord record(JournalRecordType::PrepareTransfer);
+            record.transferId = transferId;
+            record.id = accountNumber;
+            record.otherId = outgoing ? 1 : 0;
+            record.amount = amount.getCents();
+            record.timestamp = Transaction::currentTimestamp();
+            sequenceNumber = journalRecord(record);
+        }
+        LOG_DEBUG << "Transfer " << transferId << " prepared: $" << amount << (outgoing ? " from" : " to")
+             << " account " << accountNumber;
+        lock.unlock();
+        if (!finishJournaled(sequenceNumber, pendingSequence)) {
+            return OperationStatus::NotDurable;
+        }
+        return OperationStatus::Success;
+    }
+
+    // Commit or abort whatever this shard prepared for a transfer: a commit
+    // deposits on the receiving side, an abort gives the held amount back on
+    // the paying side, along with the monthly withdrawal it used. The
+    // decision is journaled. Repeating it is harmless, so the coordinator
+    // can resend until it hears Success: once nothing is held for the
+    // transfer it just waits for the journal and succeeds.
+    OperationStatus finishTransfer(uint64_t transferId, bool commit, uint64_t* pendingSequence = nullptr) {
+        TRACE_SCOPE("Operations::finishTransfer");
+        shared_lock<shared_mutex> lock(registryMutex);
+        uint64_t sequenceNumber = 0;
+        {
+            lock_guard<mutex> preparedLock(preparedMutex);
+            bool prepared = preparedTransfers.count(transferId * 2) || preparedTransfers.count(transferId * 2 + 1);
+            if (prepared || (!commit && !abortedUnprepared.count(transferId))) {
+                JournalRecord record(commit ? JournalRecordType::CommitTransfer : JournalRecordType::AbortTransfer);
+                record.transferId = transferId;
+                record.timestamp = Transaction::currentTimestamp();
+                int released = finishPreparedLocked(transferId, commit, record.timestamp, true);
+                sequenceNumber = journalRecord(record);
+                if (released) {
+                    JournalRecord release(JournalRecordType::ReleaseWithdrawal);
+                    release.id = released;
+                    sequenceNumber = journalRecord(release);
+                }
+                LOG_DEBUG << "Transfer " << transferId << (commit ? " committed" : " aborted");
+            } else if (journal) {
+                // Already settled; its record may still be on its way to disk
+                sequenceNumber = journal->getAppendedBytes();
+            }
+        }
+        lock.unlock();
+        if (!finishJournaled(sequenceNumber, pendingSequence)) {
+            return OperationStatus::NotDurable;
+        }
+        return OperationStatus::Success;
+    }
+
+    // Take the lowest-numbered account in [firstNumber, endNumber) out of
+    // this shard for moving to another: its balance is withdrawn and its
+    // number stops resolving here. AccountNotFound if there is none, and
+    // TransferPending if that account has a prepared cross-shard transfer
+    // (its commit or abort must find the account here).
+    OperationStatus moveAccountOut(int firstNumber, int endNumber, AccountMove& move,
+                                   uint64_t* pendingSequence = nullptr) {
+        TRACE_SCOPE("Operations::moveAccountOut");
+        unique_lock<shared_mutex> lock(registryMutex);
+        long long last = min((long long)endNumber - 1, (long long)accountIndex.highestId());
+        Handle handle = INVALID_HANDLE;
+        for (long long number = firstNumber; number <= last && handle == INVALID_HANDLE; number++) {
+            handle = accountIndex.find((int)number);
+        }
+        if (handle == INVALID_HANDLE) {
+            return OperationStatus::AccountNotFound;
+        }
+        Account* account = resolveAccount(handle);
+        {
+            lock_guard<mutex> preparedLock(preparedMutex);
+            for (const auto& entry : preparedTransfers) {
+                if (entry.second.accountNumber == account->getAccountNumber()) {
+                    return OperationStatus::TransferPending;
+                }
+            }
+        }
+        move.accountNumber = account->getAccountNumber();
+        move.type = (handle & SAVINGS_BIT) ? AccountType::Savings : AccountType::Regular;
+        move.balance = account->getBalance();
+        move.ownerName = string(account->getOwnerName());
+        if (account->getCustomer()) {
+            move.customerID = account->getCustomer()->getCustomerID();
+            move.customerName = string(account->getCustomer()->getName());
+        }
+        if (handle & SAVINGS_BIT) {
+            const SavingsAccount* savingsAcc = static_cast<const SavingsAccount*>(account);
+            move.limit = savingsAcc->getWithdrawalLimit();
+            move.rate = savingsAcc->getInterestRate();
+            move.withdrawalsThisMonth = savingsAcc->getWithdrawalsThisMonth();
+        }
+
+        JournalRecord record(JournalRecordType::MoveAccountOut);
+        record.id = move.accountNumber;
+        record.amount = move.balance.getCents();
+        record.timestamp = Transaction::currentTimestamp();
+        account->replayTransaction(move.balance, TransactionType::Withdrawal, record.timestamp);
+        retireAccountLocked(account);
+        uint64_t sequenceNumber = journalRecord(record);
+        LOG_INFO << "Account " << move.accountNumber << " moved out with balance $" << move.balance;
+        lock.unlock();
+        if (!finishJournaled(sequenceNumber, pendingSequence)) {
+            return OperationStatus::NotDurable;
+        }
+        return OperationStatus::Success;
+    }
+
+    // Open an account moved here from another shard; AccountExists if its
+    // number is taken or no more accounts fit. It goes to the customer with the same ID here if the name
+    // matches too, otherwise to a new customer with that name (under the
+    // same ID if it is free). Its history does not come along.
+    OperationStatus moveAccountIn(const AccountMove& move, uint64_t* pendingSequence = nullptr) {
+        TRACE_SCOPE("Operations::moveAccountIn");
+        unique_lock<shared_mutex> lock(registryMutex);
+        if (move.accountNumber <= 0) {
+            return OperationStatus::AccountNotFound;
+        }
+        if (lookupAccount(move.accountNumber)) {
+            return OperationStatus::AccountExists;
+        }
+        Account* account = addAccountLocked(move.type, move.ownerName, move.balance, move.rate, move.limit,
+                                            move.accountNumber);
+        if (!account) {
+            return OperationStatus::AccountExists;
+        }
+        if (move.type == AccountType::Savings) {
+            static_cast<SavingsAccount*>(account)->restoreWithdrawalsThisMonth(move.withdrawalsThisMonth);
+        }
+        JournalRecord record(JournalRecordType::MoveAccountIn);
+        record.accountType = move.type;
+        record.id = move.accountNumber;
+        record.otherId = move.withdrawalsThisMonth;
+        record.amount = move.balance.getCents();
+        record.limit = move.limit.getCents();
+        record.rate = move.rate;
+        record.name = move.ownerName;
+        uint64_t sequenceNumber = journalRecord(record);
+        if (move.customerID) {
+            Customer* customer = lookupCustomer(move.customerID);
+            if (!customer || customer->getName() != move.customerName) {
+                customer = addCustomerLocked(move.customerName, customer ? 0 : move.customerID);
+                JournalRecord created(JournalRecordType::CreateCustomer);
+                created.id = customer->getCustomerID();
+                created.name = move.customerName;
+                journalRecord(created);
+            }
+            linkAccountLocked(customer, account);
+            JournalRecord assigned(JournalRecordType::AssignAccount);
+            assigned.id = move.accountNumber;
+            assigned.otherId = customer->getCustomerID();
+            sequenceNumber = max(sequenceNumber, journalRecord(assigned));
+        }
+        LOG_INFO << "Account " << move.accountNumber << " moved in with balance $" << move.balance;
+        lock.unlock();
+        if (!finishJournaled(sequenceNumber, pendingSequence)) {
+            return OperationStatus::NotDurable;
+        }
+        return OperationStatus::Success;
+    }
+
+    // Perform a batch of operations (e.g. one settlement file) with a single
+    // summary line instead of per-operation messages.
+    // All account numbers are resolved up front under one registry lock.
+    // Between transfers, deposits and withdrawals are grouped by account so
+    // each account is worked on once; each of them touches a single account,
+    // so the outcome is the same as applying the batch in input order.
+    BatchResult performBatch(const BatchOperation* operations, size_t count) {
+        BatchResult result;
+        result.statuses.assign(count, OperationStatus::Success);
+        result.succeeded = 0;
+        result.failed = 0;
+
+        shared_lock<shared_mutex> lock(registryMutex);
+        vector<Handle> fromHandles(count);
+        vector<Account*> toAccounts(count, nullptr);
+        for (size_t i = 0; i < count; i++) {
+            fromHandles[i] = accountIndex.find(operations[i].accountNumber);
+            if (operations[i].type == BatchOperationType::Transfer) {
+                toAccounts[i] = lookupAccount(operations[i].toAccountNumber);
+            }
+        }
+
+        vector<uint32_t> run;
+        size_t i = 0;
+        while (i < count) {
+            run.clear();
+            while (i < count && operations[i].type != BatchOperationType::Transfer) {
+                run.push_back((uint32_t)i++);
+            }
+            applyBatchRun(operations, fromHandles, run, result.statuses);
+
+            if (i < count) {
+                if (fromHandles[i] != INVALID_HANDLE && toAccounts[i]) {
+                    result.statuses[i] = resolveAccount(fromHandles[i])->tryTransfer(*toAccounts[i], operations[i].amount);
+                } else {
+                    result.statuses[i] = OperationStatus::AccountNotFound;
+                }
+                i++;
+            }
+        }
+
+        // Journal the successful operations together
+        string records;
+        int64_t timestamp = Transaction::currentTimestamp();
+        for (size_t j = 0; j < count; j++) {
+            if (result.statuses[j] == OperationStatus::Success) {
+                result.succeeded++;
+                if (journal) {
+                    JournalRecord record(operations[j].type == BatchOperationType::Deposit ? JournalRecordType::Deposit
+                        : operations[j].type == BatchOperationType::Withdrawal ? JournalRecordType::Withdrawal
+                        : JournalRecordType::Transfer);
+                    record.id = operations[j].accountNumber;
+                    record.otherId = operations[j].toAccountNumber;
+                    record.amount = operations[j].amount.getCents();
+                    record.timestamp = timestamp;
+                    Journal::encode(record, records);
+                }
+            } else {
+                result.failed++;
+            }
+        }
+        uint64_t sequenceNumber = journal ? journal->appendEncoded(records) : 0;
+        LOG_INFO << "Batch processed: " << count << " operations, " << result.succeeded 
+             << " succeeded, " << result.failed << " failed";
+        lock.unlock();
+        if (!waitForJournal(sequenceNumber)) {
+            for (OperationStatus& status : result.statuses) {
+                if (status == OperationStatus::Success) {
+                    status = OperationStatus::NotDurable;
+                }
+            }
+            result.failed += result.succeeded;
+            result.succeeded = 0;
+        }
+        return result;
+    }
+
+    BatchResult performBatch(const vector<BatchOperation>& operations) {
+        return performBatch(operations.data(), operations.size());
+    }
+
+    // Import a settlement file (see parseSettlementLine for the format).
+    // The file is mapped and handled in windows of IMPORT_WINDOW_BYTES:
+    // threads parse equal slices of a window in parallel, then the same
+    // number of threads apply it, each owning the accounts whose ledger
+    // slots fall in its partition (see applyImportPartition). The ledger's
+    // min/max and order index are refreshed once per window rather than
+    // per change. Balances end up as if every line had been applied in file
+    // order; the journal gets one record per successful line.
+    // threadCount 0 uses every hardware thread.
+    ImportResult importSettlementFile(const string& path, unsigned threadCount = 0) {
+        TRACE_SCOPE("Operations::importSettlementFile");
+        ImportResult result = {};
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            LOG_ERROR << "Cannot open settlement file " << path;
+            return result;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            LOG_ERROR << "Cannot read settlement file " << path;
+            return result;
+        }
+        size_t size = (size_t)info.st_size;
+        void* mapped = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            LOG_ERROR << "Cannot map settlement file " << path;
+            return result;
+        }
+        if (size) {
+            madvise(mapped, size, MADV_SEQUENTIAL);
+        }
+        const char* data = (const char*)mapped;
+        unsigned partitions = threadCount ? threadCount : max(1u, thread::hardware_concurrency());
+
+        // Start of the first line at or after 'limit', so no line is split
+        auto lineBoundary = [&](const char* limit, const char* end) {
+            if (limit >= end) {
+                return end;
+            }
+            if (limit == data || limit[-1] == '\n') {
+                return limit;
+            }
+            const char* newline = (const char*)memchr(limit, '\n', end - limit);
+            return newline ? newline + 1 : end;
+        };
+
+        shared_lock<shared_mutex> lock(registryMutex);
+        vector<ImportChunk> chunks(partitions);
+        vector<ImportTally> tallies(partitions);
+        vector<uint32_t> transferBase(partitions);
+        uint64_t sequenceNumber = 0;
+        const char* window = data;
+        while (window < data + size) {
+            const char* windowEnd = lineBoundary(window + min(IMPORT_WINDOW_BYTES, (size_t)(data + size - window)),
+                                                 data + size);
+
+            // Parse equal slices of the window in parallel
+            vector<thread> workers;
+            size_t slice = (windowEnd - window + partitions - 1) / partitions;
+            const char* sliceStart = window;
+            for (unsigned t = 0; t < partitions; t++) {
+                const char* sliceEnd = t + 1 == partitions ? windowEnd
+                    : lineBoundary(max(sliceStart, min(window + slice * (t + 1), windowEnd)), windowEnd);
+                workers.push_back(thread([this, sliceStart, sliceEnd, partitions, &chunks, t]() {
+                    chunks[t] = ImportChunk();
+                    parseImportChunk(sliceStart, sliceEnd, partitions, chunks[t]);
+                }));
+                sliceStart = sliceEnd;
+            }
+            for (thread& worker : workers) {
+                worker.join();
+            }
+
+            // Number the cross-partition transfers across the chunks, then apply
+            uint32_t transfers = 0;
+            for (unsigned c = 0; c < partitions; c++) {
+                transferBase[c] = transfers;
+                transfers += chunks[c].transfers;
+                result.lines += chunks[c].lines;
+                result.malformed += chunks[c].malformed;
+                result.failures[(int)OperationStatus::AccountNotFound] += chunks[c].notFound;
+            }
+            unique_ptr<atomic<uint8_t>[]> decisions(new atomic<uint8_t>[transfers]());
+            workers.clear();
+            for (unsigned p = 0; p < partitions; p++) {
+                tallies[p].records.clear();
+                workers.push_back(thread([&, p]() {
+                    applyImportPartition(chunks, p, transferBase, decisions.get(), tallies[p]);
+                }));
+            }
+            for (thread& worker : workers) {
+                worker.join();
+            }
+            ledger.refresh();
+            if (journal) {
+                string records;
+                for (const ImportTally& tally : tallies) {
+                    records += tally.records;
+                }
+                sequenceNumber = journal->appendEncoded(records);
+            }
+            window = windowEnd;
+        }
+        lock.unlock();
+        if (mapped) {
+            munmap(mapped, size);
+        }
+        bool durable = waitForJournal(sequenceNumber);
+
+        for (const ImportTally& tally : tallies) {
+            for (int s = 0; s < OPERATION_STATUS_COUNT; s++) {
+                result.failures[s] += tally.outcomes[s];
+            }
+        }
+        if (!durable) {
+            result.failures[(int)OperationStatus::NotDurable] += result.failures[(int)OperationStatus::Success];
+            result.failures[(int)OperationStatus::Success] = 0;
+        }
+        result.succeeded = result.failures[(int)OperationStatus::Success];
+        result.failures[(int)OperationStatus::Success] = 0;
+        result.failed = result.lines - result.malformed - result.succeeded;
+        result.bytes = size;
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        LOG_INFO << "Imported " << path << ": " << result.lines << " lines, " << result.succeeded << " succeeded, "
+             << result.failed << " failed, " << result.malformed << " malformed";
+        return result;
+    }
+
+    // Apply interest to all savings accounts
+    void applyInterestToAllSavings() {
+        shared_lock<shared_mutex> lock(registryMutex);
+        uint64_t sequenceNumber = applyInterestLocked(false);
+        lock.unlock();
+        waitForJournal(sequenceNumber);
+    }
+
+    // Display all customers
+    void displayAllCustomers() const {
+        shared_lock<shared_mutex> lock(registryMutex);
+        LOG_INFO << "\n=== ALL CUSTOMERS ===";
+        if (customers.empty()) {
+            LOG_INFO << "No customers in the system.";
+            return;
+        }
+        
+        for (Handle handle : customers) {
+            const Customer* customer = resolveCustomer(handle);
+            customer->displayCustomerInfo();
+            LOG_INFO << string(50, '-');
+        }
+    }
+
+    // Display all accounts
+    void displayAllAccounts() const {
+        shared_lock<shared_mutex> lock(registryMutex);
+        LOG_INFO << "\n=== ALL ACCOUNTS ===";
+        if (ledger.accountCount() == 0) {
+            LOG_INFO << "No accounts in the system.";
+            return;
+        }
+        
+        for (Handle handle : allAccounts) {
+            if (!isLiveAccount(handle)) {
+                continue;
+            }
+            const Account* account = resolveAccount(handle);
+            account->displayInfo();
+            LOG_INFO << string(40, '-');
+        }
+    }
+
+    // Write every account's statement (the displayAllAccounts text without
+    // the heading) to shardCount files named <pathPrefix>-<shard>.txt, each
+    // holding a contiguous run of accounts in account order. Shards are
+    // rendered in parallel on the work pool into a per-shard buffer that is
+    // written out whenever it passes STATEMENT_BUFFER_BYTES, so memory
+    // stays bounded however many accounts there are. shardCount 0 makes
+    // one shard per pool thread.
+    StatementExportResult exportStatements(const string& pathPrefix, unsigned shardCount = 0) const {
+        TRACE_SCOPE("Operations::exportStatements");
+        StatementExportResult result = {true, 0, 0, 0, 0.0};
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        shared_lock<shared_mutex> lock(registryMutex);
+        unsigned shards = shardCount ? shardCount : workPool->slotCount();
+        size_t count = allAccounts.size();
+        vector<uint64_t> shardBytes(shards, 0);
+        vector<uint8_t> shardOk(shards, 1);
+        workPool->parallelFor(shards, 1, [&](size_t begin, size_t end, unsigned) {
+            for (size_t shard = begin; shard < end; shard++) {
+                TRACE_SCOPE("Operations::statementShard");
+                string path = pathPrefix + "-" + to_string(shard) + ".txt";
+                int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) {
+                    shardOk[shard] = 0;
+                    continue;
+                }
+                string buffer;
+                buffer.reserve(STATEMENT_BUFFER_BYTES + 64 * 1024);
+                TextWriter out(buffer);
+                bool ok = true;
+                for (size_t i = count * shard / shards; ok && i < count * (shard + 1) / shards; i++) {
+                    if (!isLiveAccount(allAccounts[i])) {
+                        continue;
+                    }
+                    resolveAccount(allAccounts[i])->writeStatement(out);
+                    out << "----------------------------------------\n";
+                    if (buffer.size() >= STATEMENT_BUFFER_BYTES) {
+                        ok = writeAll(fd, buffer);
+                        shardBytes[shard] += buffer.size();
+                        buffer.clear();
+                    }
+                }
+                ok = ok && writeAll(fd, buffer);
+                shardBytes[shard] += buffer.size();
+                shardOk[shard] = close(fd) == 0 && ok;
+            }
+        });
+        lock.unlock();
+
+        for (unsigned shard = 0; shard < shards; shard++) {
+            result.ok = result.ok && shardOk[shard];
+            result.bytes += shardBytes[shard];
+        }
+        result.accounts = ledger.accountCount();
+        result.files = shards;
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (!result.ok) {
+            LOG_ERROR << "Cannot write statements to " << pathPrefix << "-*.txt";
+        } else {
+            LOG_INFO << "Exported " << result.accounts << " statements to " << result.files << " files ("
+                 << result.bytes << " bytes)";
+        }
+        return result;
+    }
+
+    // Display system summary
+    void displaySystemSummary() const {
+        TRACE_SCOPE("Operations::displaySystemSummary");
+        // Exclusive, so no transfer is half-applied while the totals are read
+        unique_lock<shared_mutex> lock(registryMutex);
+        LOG_INFO << "\n=== BANKING SYSTEM SUMMARY ===";
+        LOG_INFO << "Total Customers: " << customers.size();
+        LOG_INFO << "Total Accounts: " << ledger.accountCount();
+        
+        Money totalSystemBalance = ledger.stats().total;
+        size_t regularAccounts = ledger.countType(AccountType::Regular);
+        size_t savingsAccounts = ledger.countType(AccountType::Savings);
+        
+        LOG_INFO << "Regular Accounts: " << regularAccounts;
+        LOG_INFO << "Savings Accounts: " << savingsAccounts;
+        LOG_INFO << "Total System Balance: $" << totalSystemBalance;
+    }
+
+    // Totals of the system summary without the report
+    SystemTotals getSystemTotals() const {
+        unique_lock<shared_mutex> lock(registryMutex);
+        return SystemTotals{customers.size(), ledger.accountCount(), ledger.stats().total};
+    }
+
+    // Find customer by ID
+    Customer* findCustomerById(int customerID) {
+        shared_lock<shared_mutex> lock(registryMutex);
+        return lookupCustomer(customerID);
+    }
+
+    // Find up to 'limit' customers whose names start with 'prefix', in name order
+    vector<Customer*> findCustomersByNamePrefix(string_view prefix, size_t limit = 100) const {
+        shared_lock<shared_mutex> lock(registryMutex);
+        vector<Customer*> found;
+        for (Handle handle : customerNames.findPrefix(prefix, limit)) {
+            found.push_back(resolveCustomer(handle));
+        }
+        return found;
+    }
+
+    // Find account by account number
+    Account* findAccountByNumber(int accountNumber) {
+        MetricsScope scope(metrics, OperationKind::Lookup);
+        shared_lock<shared_mutex> lock(registryMutex);
+        Account* account = lookupAccount(accountNumber);
+        if (!account) {
+            scope.status = OperationStatus::AccountNotFound;
+        }
+        return account;
+    }
+
+    // Monthly operations (reset withdrawal counters, apply interest)
+    void performMonthlyOperations() {
+        TRACE_SCOPE("Operations::performMonthlyOperations");
+        MetricsScope scope(metrics, OperationKind::MonthEnd);
+        shared_lock<shared_mutex> lock(registryMutex);
+        LOG_INFO << "\n--- Performing Monthly Operations ---";
+        
+        // Reset withdrawal counters and apply interest in one pass over the
+        // savings accounts. The reset record goes first so replay sees the
+        // same order as before.
+        journalRecord(JournalRecord(JournalRecordType::MonthlyReset));
+        uint64_t sequenceNumber = applyInterestLocked(true);
+        
+        LOG_INFO << "Monthly operations completed.";
+        lock.unlock();
+        waitForJournal(sequenceNumber);
+    }
+
+    // Compare the running aggregates (ledger and customer totals) with a
+    // full rescan
+    bool checkAggregates() const {
+        TRACE_SCOPE("Operations::checkAggregates");
+        unique_lock<shared_mutex> lock(registryMutex);
+        BalanceStats running = ledger.stats();
+        BalanceStats scanned = ledger.computeStats();
+        size_t liveSavings = 0, liveAccounts = 0;
+        for (Handle handle : allAccounts) {
+            if (isLiveAccount(handle)) {
+                liveAccounts++;
+                liveSavings += (handle & SAVINGS_BIT) ? 1 : 0;
+            }
+        }
+        bool matches = running.total == scanned.total && running.minBalance == scanned.minBalance &&
+                       running.maxBalance == scanned.maxBalance && running.maxSlot == scanned.maxSlot &&
+                       ledger.countType(AccountType::Regular) == liveAccounts - liveSavings &&
+                       ledger.countType(AccountType::Savings) == liveSavings;
+        for (Handle handle : customers) {
+            const Customer* customer = resolveCustomer(handle);
+            Money total;
+            for (const Account* account : customer->getAccounts()) {
+                total += account->getBalance();
+            }
+            matches = matches && total == customer->getTotalBalance();
+        }
+        return matches;
+    }
+
+    // Get system statistics
+    void getSystemStatistics() const {
+        TRACE_SCOPE("Operations::getSystemStatistics");
+        unique_lock<shared_mutex> lock(registryMutex);
+        LOG_INFO << "\n=== SYSTEM STATISTICS ===";
+        
+        if (ledger.accountCount() == 0) {
+            LOG_INFO << "No accounts in the system for statistics.";
+            return;
+        }
+        
+        // Running aggregates kept by the ledger
+        BalanceStats stats = ledger.stats();
+        Money maxBalance = stats.maxBalance;
+        Money minBalance = stats.minBalance;
+        const Account* richestAccount = resolveAccount(allAccounts[stats.maxSlot]);
+        
+        double averageBalance = stats.total.toDouble() / ledger.accountCount();
+        
+        LOG_INFO << "Average Account Balance: $" << averageBalance;
+        LOG_INFO << "Highest Balance: $" << maxBalance 
+             << " (Account #" << richestAccount->getAccountNumber() << ")";
+        LOG_INFO << "Lowest Balance: $" << minBalance;
+        LOG_INFO << "Median Balance: $" << ledger.percentile(50);
+        LOG_INFO << "99th Percentile Balance: $" << ledger.percentile(99);
+    }
+
+    // Accounts with the k highest balances, highest first
+    vector<Account*> getTopAccounts(size_t k) const {
+        shared_lock<shared_mutex> lock(registryMutex);
+        return resolveSlots(ledger.topSlots(k));
+    }
+
+    // Account with the k-th lowest balance (k from 0), nullptr if out of range
+    Account* getAccountAtBalanceRank(size_t k) const {
+        shared_lock<shared_mutex> lock(registryMutex);
+        return k < ledger.accountCount() ? resolveAccount(allAccounts[ledger.slotAtRank(k)]) : nullptr;
+    }
+
+    // Nearest-rank percentile of all balances (0-100), zero with no accounts
+    Money getBalancePercentile(double percent) const {
+        shared_lock<shared_mutex> lock(registryMutex);
+        return ledger.accountCount() == 0 ? Money() : ledger.percentile(percent);
+    }
+
+    // Accounts with balances in [lo, hi], lowest balance first
+    vector<Account*> getAccountsInBalanceRange(Money lo, Money hi) const {
+        shared_lock<shared_mutex> lock(registryMutex);
+        return resolveSlots(ledger.slotsInRange(lo, hi));
+    }
+
+    // Accounts below a minimum balance (for fee sweeps), lowest first
+    vector<Account*> getAccountsBelow(Money minimum) const {
+        shared_lock<shared_mutex> lock(registryMutex);
+        return resolveSlots(ledger.slotsInRange(Money::fromCents(INT64_MIN), Money::fromCents(minimum.getCents() - 1)));
+    }
+
+    // Display the accounts with the k highest balances
+    void displayTopAccounts(size_t k) const {
+        LOG_INFO << "\n=== TOP " << k << " ACCOUNTS BY BALANCE ===";
+        vector<Account*> top = getTopAccounts(k);
+        for (size_t i = 0; i < top.size(); i++) {
+            LOG_INFO << (i + 1) << ". " << *top[i];
+        }
+    }
+
+    // Merged latency and outcome figures for one kind of operation. Safe to
+    // call while other threads keep operating.
+    OperationSummary getOperationMetrics(OperationKind kind) const {
+        return metrics.summarize(kind);
+    }
+
+    // Display count, outcomes and latency percentiles for every operation kind
+    void displayMetrics() const {
+        LOG_INFO << "\n=== OPERATION METRICS ===";
+        for (int k = 0; k < OPERATION_KIND_COUNT; k++) {
+            OperationKind kind = (OperationKind)k;
+            OperationSummary summary = metrics.summarize(kind);
+            if (summary.count == 0) {
+                continue;
+            }
+            ostringstream line;
+            line << fixed << setprecision(2) << operationKindName(kind) << ": " << summary.count << " ("
+                 << summary.outcomes[(int)OperationStatus::Success] << " ok";
+            for (int s = 1; s < OPERATION_STATUS_COUNT; s++) {
+                if (summary.outcomes[s]) {
+                    line << ", " << summary.outcomes[s] << " " << operationStatusName((OperationStatus)s);
+                }
+            }
+            line << ") mean " << summary.totalNanos / 1000.0 / summary.count << " us"
+                 << ", p50 " << summary.percentile(50) / 1000.0 << " us"
+                 << ", p99 " << summary.percentile(99) / 1000.0 << " us"
+                 << ", p999 " << summary.percentile(99.9) / 1000.0 << " us"
+                 << ", max " << summary.maxNanos / 1000.0 << " us";
+            LOG_INFO << line.str();
+        }
+    }
+
+    // Write the same figures as JSON (latencies in nanoseconds)
+    void writeMetricsJson(ostream& out) const {
+        out << "{\n  \"operations\": [";
+        for (int k = 0; k < OPERATION_KIND_COUNT; k++) {
+            OperationKind kind = (OperationKind)k;
+            OperationSummary summary = metrics.summarize(kind);
+            out << (k ? "," : "") << "\n    {\"name\": \"" << operationKindName(kind) << "\", \"count\": " << summary.count
+                << ", \"outcomes\": {";
+            for (int s = 0; s < OPERATION_STATUS_COUNT; s++) {
+                out << (s ? ", " : "") << "\"" << operationStatusName((OperationStatus)s) << "\": " << summary.outcomes[s];
+            }
+            out << "}, \"total_ns\": " << summary.totalNanos << ", \"p50_ns\": " << summary.percentile(50)
+                << ", \"p99_ns\": " << summary.percentile(99) << ", \"p999_ns\": " << summary.percentile(99.9)
+                << ", \"max_ns\": " << summary.maxNanos << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+};
+
+// Binary protocol of the network service. Every frame is a little-endian
+// uint32 body length followed by the body.
+// Request body: uint8 RequestType, uint32 request id, then
+//   Deposit, Withdrawal: int32 account, int64 cents
+//   Transfer: int32 from account, int32 to account, int64 cents
+//   Lookup: int32 account
+//   Summary: nothing
+//   PrepareDebit, PrepareCredit: int32 account, int64 cents, uint64 transfer id
+//   Commit, Abort: uint64 transfer id
+//   MoveOut: int32 first account, int32 end account (exclusive)
+//   MoveIn: an account move
+//   Split: int32 first account of the new shard
+// Response body: uint32 request id, uint8 status (an OperationStatus,
+// BAD_REQUEST or SHARD_UNAVAILABLE), then
+//   Summary: uint64 customers, uint64 accounts, int64 total balance in cents
+//   MoveOut: an account move, if the status is Success
+//   anything else: int64 balance of the (source) account in cents, 0 if it
+//   does not exist; for Split, the number of accounts moved
+// An account move is int32 number, uint8 AccountType, int64 balance,
+// int64 limit, double rate, int32 withdrawals this month, int32 customer ID
+// (0 for none), uint16 owner name length, uint16 customer name length, then
+// the owner name and the customer name.
+// Responses come back in request order, so clients can pipeline requests.
+// Malformed requests are answered in the balance format.
+enum class RequestType : uint8_t {
+    Deposit = 1,
+    Withdrawal,
+    Transfer,
+    Lookup,
+    Summary,
+    // From the shard router to shards
+    PrepareDebit,  // Two-phase commit of a cross-shard transfer
+    PrepareCredit,
+    Commit,
+    Abort,
+    MoveOut,       // Moving accounts when a shard is split
+    MoveIn,
+    // To the shard router
+    Split
+};
+
+struct WireRequest {
+    RequestType type;
+    uint32_t id;
+    int32_t account;
+    int32_t toAccount;   // Transfer; end account for MoveOut
+    int64_t cents;       // Deposit, Withdrawal, Transfer and the prepares
+    uint64_t transferId; // Prepares, Commit and Abort
+    AccountMove move;    // MoveIn
+};
+
+struct WireResponse {
+    uint32_t id;
+    uint8_t status;
+    int64_t balance;     // Account requests
+    uint64_t customers;  // Summary only
+    uint64_t accounts;
+    int64_t totalCents;
+    AccountMove move;    // MoveOut only
+};
+
+class WireProtocol {
+public:
+    static const uint8_t BAD_REQUEST = 0xFF;
+    static const uint8_t SHARD_UNAVAILABLE = 0xFE; // The router could not reach the shard
+    static constexpr uint32_t MAX_BODY = 512; // Larger frames close the connection
+    static constexpr size_t LENGTH_SIZE = sizeof(uint32_t);
+    static constexpr size_t MOVE_SIZE = 4 + 1 + 8 + 8 + 8 + 4 + 4 + 2 + 2; // Account move without the names
+    static constexpr size_t MAX_NAME = 255; // Longer owner and customer names are cut short when moved
+
+    template <typename T>
+    static void put(string& out, const T& value) {
+        out.append((const char*)&value, sizeof(T));
+    }
+
+    template <typename T>
+    static T get(const char*& in) {
+        T value;
+        memcpy(&value, in, sizeof(T));
+        in += sizeof(T);
+        return value;
+    }
+
+    // Body size of a well-formed request of each type (for MoveIn, without
+    // the owner name), 0 for unknown types
+    static uint32_t requestBodySize(uint8_t type) {
+        switch ((RequestType)type) {
+            case RequestType::Deposit:
+            case RequestType::Withdrawal: return 1 + 4 + 4 + 8;
+            case RequestType::Transfer: return 1 + 4 + 4 + 4 + 8;
+            case RequestType::Lookup:
+            case RequestType::Split: return 1 + 4 + 4;
+            case RequestType::Summary: return 1 + 4;
+            case RequestType::PrepareDebit:
+            case RequestType::PrepareCredit: return 1 + 4 + 4 + 8 + 8;
+            case RequestType::Commit:
+            case RequestType::Abort: return 1 + 4 + 8;
+            case RequestType::MoveOut: return 1 + 4 + 4 + 4;
+            case RequestType::MoveIn: return 1 + 4 + MOVE_SIZE;
+        }
+        return 0;
+    }
+
+    static void putMove(string& out, const AccountMove& move) {
+        put(out, (int32_t)move.accountNumber);
+        put(out, (uint8_t)move.type);
+        put(out, move.balance.getCents());
+        put(out, move.limit.getCents());
+        put(out, move.rate);
+        put(out, (int32_t)move.withdrawalsThisMonth);
+        put(out, (int32_t)move.customerID);
+        uint16_t nameSize = (uint16_t)min(move.ownerName.size(), MAX_NAME);
+        uint16_t customerNameSize = (uint16_t)min(move.customerName.size(), MAX_NAME);
+        put(out, nameSize);
+        put(out, customerNameSize);
+        out.append(move.ownerName, 0, nameSize);
+        out.append(move.customerName, 0, customerNameSize);
+    }
+
+    // Decode an account move taking up exactly 'size' bytes
+    static bool getMove(const char* in, size_t size, AccountMove& move) {
+        if (size < MOVE_SIZE) {
+            return false;
+        }
+        move.accountNumber = get<int32_t>(in);
+        move.type = (AccountType)get<uint8_t>(in);
+        move.balance = Money::fromCents(get<int64_t>(in));
+        move.limit = Money::fromCents(get<int64_t>(in));
+        move.rate = get<double>(in);
+        move.withdrawalsThisMonth = get<int32_t>(in);
+        move.customerID = get<int32_t>(in);
+        uint16_t nameSize = get<uint16_t>(in);
+        uint16_t customerNameSize = get<uint16_t>(in);
+        if ((size_t)nameSize + customerNameSize != size - MOVE_SIZE ||
+            (move.type != AccountType::Regular && move.type != AccountType::Savings)) {
+            return false;
+        }
+        move.ownerName.assign(in, nameSize);
+        move.customerName.assign(in + nameSize, customerNameSize);
+        return true;
+    }
+
+    static void encodeRequest(const WireRequest& request, string& out) {
+        size_t start = out.size();
+        put(out, (uint32_t)0); // Length, filled in below
+        put(out, (uint8_t)request.type);
+        put(out, request.id);
+        switch (request.type) {
+            case RequestType::Deposit:
+            case RequestType::Withdrawal:
+                put(out, request.account);
+                put(out, request.cents);
+                break;
+            case RequestType::Transfer:
+                put(out, request.account);
+                put(out, request.toAccount);
+                put(out, request.cents);
+                break;
+            case RequestType::Lookup:
+            case RequestType::Split:
+                put(out, request.account);
+                break;
+            case RequestType::Summary:
+                break;
+            case RequestType::PrepareDebit:
+            case RequestType::PrepareCredit:
+                put(out, request.account);
+                put(out, request.cents);
+                put(out, request.transferId);
+                break;
+            case RequestType::Commit:
+            case RequestType::Abort:
+                put(out, request.transferId);
+                break;
+            case RequestType::MoveOut:
+                put(out, request.account);
+                put(out, request.toAccount);
+                break;
+            case RequestType::MoveIn:
+                putMove(out, request.move);
+                break;
+        }
+        uint32_t size = (uint32_t)(out.size() - start - LENGTH_SIZE);
+        memcpy(&out[start], &size, sizeof(size));
+    }
+
+    // Decode one request body; false if it is malformed (the id is still
+    // filled in when there is one, for the error response)
+    static bool decodeRequest(const char* body, uint32_t size, WireRequest& request) {
+        request.id = 0;
+        if (size >= 5) {
+            memcpy(&request.id, body + 1, sizeof(request.id));
+        }
+        uint32_t expected = size ? requestBodySize((uint8_t)body[0]) : 0;
+        if (expected == 0 || (body[0] == (char)RequestType::MoveIn ? size < expected : size != expected)) {
+            return false;
+        }
+        request.type = (RequestType)get<uint8_t>(body);
+        body += 4;
+        request.account = request.toAccount = 0;
+        request.cents = 0;
+        request.transferId = 0;
+        switch (request.type) {
+            case RequestType::Deposit:
+            case RequestType::Withdrawal:
+                request.account = get<int32_t>(body);
+                request.cents = get<int64_t>(body);
+                break;
+            case RequestType::Transfer:
+                request.account = get<int32_t>(body);
+                request.toAccount = get<int32_t>(body);
+                request.cents = get<int64_t>(body);
+                break;
+            case RequestType::Lookup:
+            case RequestType::Split:
+                request.account = get<int32_t>(body);
+                break;
+            case RequestType::Summary:
+                break;
+            case RequestType::PrepareDebit:
+            case RequestType::PrepareCredit:
+                request.account = get<int32_t>(body);
+                request.cents = get<int64_t>(body);
+                request.transferId = get<uint64_t>(body);
+                break;
+            case RequestType::Commit:
+            case RequestType::Abort:
+                request.transferId = get<uint64_t>(body);
+                break;
+            case RequestType::MoveOut:
+                request.account = get<int32_t>(body);
+                request.toAccount = get<int32_t>(body);
+                break;
+            case RequestType::MoveIn:
+                return getMove(body, size - 5, request.move);
+        }
+        return true;
+    }
+
+    // Append the response to a request of the given type
+    static void encodeResponse(const WireResponse& response, RequestType type, string& out) {
+        size_t start = out.size();
+        put(out, (uint32_t)0); // Length, filled in below
+        put(out, response.id);
+        put(out, response.status);
+        if (type == RequestType::Summary) {
+            put(out, response.customers);
+            put(out, response.accounts);
+            put(out, response.totalCents);
+        } else if (type == RequestType::MoveOut) {
+            if (response.status == (uint8_t)OperationStatus::Success) {
+                putMove(out, response.move);
+            }
+        } else {
+            put(out, response.balance);
+        }
+        uint32_t size = (uint32_t)(out.size() - start - LENGTH_SIZE);
+        memcpy(&out[start], &size, sizeof(size));
+    }
+
+    // Answer a request with just a status
+    static void encodeStatus(const WireRequest& request, uint8_t status, string& out) {
+        WireResponse response = WireResponse();
+        response.id = request.id;
+        response.status = status;
+        encodeResponse(response, request.type, out);
+    }
+
+    // Decode the response to a request of the given type; false if it is
+    // malformed
+    static bool decodeResponse(const char* body, uint32_t size, RequestType type, WireResponse& response) {
+        if (size < 4 + 1) {
+            return false;
+        }
+        response = WireResponse();
+        response.id = get<uint32_t>(body);
+        response.status = get<uint8_t>(body);
+        if (type == RequestType::Summary) {
+            if (size != 4 + 1 + 8 + 8 + 8) {
+                return false;
+            }
+            response.customers = get<uint64_t>(body);
+            response.accounts = get<uint64_t>(body);
+            response.totalCents = get<int64_t>(body);
+            return true;
+        }
+        if (type == RequestType::MoveOut && response.status == (uint8_t)OperationStatus::Success) {
+            return getMove(body, size - 5, response.move);
+        }
+        if (type == RequestType::MoveOut && size == 4 + 1) {
+            return true;
+        }
+        if (size != 4 + 1 + 8) {
+            return false;
+        }
+        response.balance = get<int64_t>(body);
+        return true;
+    }
+};
+
+// Open a socket for "unix:<path>" or "<host>:<port>" (an empty host means
+// 127.0.0.1): listening when 'listening' is set, otherwise connected.
+// Returns a non-blocking descriptor, or -1.
+int openServiceSocket(const string& address, bool listening) {
+    int fd;
+    if (address.compare(0, 5, "unix:") == 0) {
+        sockaddr_un unixAddress = {};
+        unixAddress.sun_family = AF_UNIX;
+        string path = address.substr(5);
+        if (path.empty() || path.size() >= sizeof(unixAddress.sun_path)) {
+            return -1;
+        }
+        memcpy(unixAddress.sun_path, path.data(), path.size());
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (listening) {
+            unlink(path.c_str());
+        }
+        int result = listening ? ::bind(fd, (const sockaddr*)&unixAddress, sizeof(unixAddress))
+                               : connect(fd, (const sockaddr*)&unixAddress, sizeof(unixAddress));
+        if (result != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        size_t colon = address.rfind(':');
+        if (colon == string::npos) {
+            return -1;
+        }
+        string host = colon ? address.substr(0, colon) : "127.0.0.1";
+        sockaddr_in inetAddress = {};
+        inetAddress.sin_family = AF_INET;
+        inetAddress.sin_port = htons((uint16_t)atoi(address.c_str() + colon + 1));
+        if (inet_pton(AF_INET, host.c_str(), &inetAddress.sin_addr) != 1) {
+            return -1;
+        }
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        int one = 1;
+        setsockopt(fd, listening ? SOL_SOCKET : IPPROTO_TCP, listening ? SO_REUSEADDR : TCP_NODELAY, &one, sizeof(one));
+        int result = listening ? ::bind(fd, (const sockaddr*)&inetAddress, sizeof(inetAddress))
+                               : connect(fd, (const sockaddr*)&inetAddress, sizeof(inetAddress));
+        if (result != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (listening && ::listen(fd, 1024) != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Answers the requests a BankServer reads. Each call gets the well-formed
+// requests from one readiness event, in order, and appends one response
+// per request to 'output'. Different event loops may call it at once.
+class ServiceHandler {
+public:
+    virtual ~ServiceHandler() {}
+
+    // False if the responses must not be sent (the journal failed); the
+    // connection is then dropped
+    virtual bool handle(const vector<WireRequest>& requests, string& output) = 0;
+};
+
+// Serves an Operations: a single server, or one shard behind a ShardRouter.
+// Journaled operations in a call are waited for once, at the end.
+class OperationsService : public ServiceHandler {
+private:
+    Operations& bank;
+
+    // Answer one request, appending the response
+    void serve(const WireRequest& request, string& output, uint64_t& pendingSequence) {
+        WireResponse response = WireResponse();
+        response.id = request.id;
+        Money amount = Money::fromCents(request.cents);
+        OperationStatus status = OperationStatus::Success;
+        switch (request.type) {
+            case RequestType::Deposit:
+                status = bank.performDepositWithStatus(request.account, amount, &pendingSequence);
+                break;
+            case RequestType::Withdrawal:
+                status = bank.performWithdrawalWithStatus(request.account, amount, &pendingSequence);
+                break;
+            case RequestType::Transfer:
+                status = bank.performTransferWithStatus(request.account, request.toAccount, amount, &pendingSequence);
+                break;
+            case RequestType::Lookup:
+                break;
+            case RequestType::Summary: {
+                SystemTotals totals = bank.getSystemTotals();
+                response.customers = totals.customers;
+                response.accounts = totals.accounts;
+                response.totalCents = totals.total.getCents();
+                break;
+            }
+            case RequestType::PrepareDebit:
+            case RequestType::PrepareCredit:
+                status = bank.prepareTransfer(request.transferId, request.account, amount,
+                                              request.type == RequestType::PrepareDebit, &pendingSequence);
+                break;
+            case RequestType::Commit:
+            case RequestType::Abort:
+                status = bank.finishTransfer(request.transferId, request.type == RequestType::Commit, &pendingSequence);
+                break;
+            case RequestType::MoveOut:
+                status = bank.moveAccountOut(request.account, request.toAccount, response.move, &pendingSequence);
+                break;
+            case RequestType::MoveIn:
+                WireProtocol::encodeStatus(request, (uint8_t)bank.moveAccountIn(request.move, &pendingSequence), output);
+                return;
+            case RequestType::Split:
+                WireProtocol::encodeStatus(request, WireProtocol::BAD_REQUEST, output);
+                return;
+        }
+        if (request.type <= RequestType::Lookup || request.type == RequestType::PrepareDebit ||
+            request.type == RequestType::PrepareCredit) {
+            Account* account = bank.findAccountByNumber(request.account);
+            response.balance = account ? account->getBalance().getCents() : 0;
+            if (!account) {
+                status = OperationStatus::AccountNotFound;
+            }
+        }
+        response.status = (uint8_t)status;
+        WireProtocol::encodeResponse(response, request.type, output);
+    }
+
+public:
+    // Constructor
+    explicit OperationsService(Operations& operations) : bank(operations) {}
+
+    bool handle(const vector<WireRequest>& requests, string& output) override {
+        size_t start = output.size();
+        uint64_t pendingSequence = 0;
+        for (const WireRequest& request : requests) {
+            serve(request, output, pendingSequence);
+        }
+        // Responses go out only once the operations behind them are durable
+        if (!bank.waitUntilDurable(pendingSequence)) {
+            output.resize(start);
+            return false;
+        }
+        return true;
+    }
+};
+
+// Connect to a service for blocking use; reads give up after 'timeoutSeconds'.
+// Returns the descriptor, or -1.
+int connectToService(const string& address, int timeoutSeconds = 10) {
+    int fd = openServiceSocket(address, false);
+    if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        timeval timeout = {timeoutSeconds, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    return fd;
+}
+
+// Send one request and wait for its response; false if the service cannot
+// be reached or the answer does not match
+bool exchangeRequest(const string& address, const WireRequest& request, WireResponse& response) {
+    int fd = connectToService(address);
+    if (fd < 0) {
+        return false;
+    }
+    string frame;
+    WireProtocol::encodeRequest(request, frame);
+    bool ok = ::write(fd, frame.data(), frame.size()) == (ssize_t)frame.size();
+    string input;
+    uint32_t size = 0;
+    while (ok && input.size() < WireProtocol::LENGTH_SIZE + size) {
+        char buffer[4096];
+        ssize_t result = ::read(fd, buffer, sizeof(buffer));
+        ok = result > 0;
+        input.append(buffer, result > 0 ? (size_t)result : 0);
+        if (input.size() >= WireProtocol::LENGTH_SIZE) {
+            memcpy(&size, input.data(), sizeof(size));
+            ok = ok && size <= WireProtocol::MAX_BODY;
+        }
+    }
+    close(fd);
+    return ok && WireProtocol::decodeResponse(input.data() + WireProtocol::LENGTH_SIZE, size, request.type, response) &&
+           response.id == request.id;
+}
+
+// Routes the protocol over shard processes that each own a range of
+// account numbers; each shard is a BankServer with an OperationsService.
+// Requests that stay inside one shard, transfers included, are forwarded
+// to it as they are, pipelined per shard. A transfer between shards runs
+// two-phase commit: both shards prepare (the paying one holds the amount),
+// and the transfer commits only if both agree, otherwise both abort.
+// With a decision log the router records each transfer before preparing
+// and each commit before telling the shards, so after a router crash the
+// log says how to settle every held amount (no commit record: abort).
+// A decision a shard does not acknowledge is resent on fresh connections
+// until it is. Splitting moves the top part of a shard's range to a spare
+// shard while the router holds requests back.
+class ShardRouter : public ServiceHandler {
+private:
+    // A blocking connection to one shard
+    struct ShardLink {
+        int fd = -1;
+        string input;
+        size_t consumed = 0; // Bytes of input already handled
+        string output;       // Requests not sent yet
+    };
+
+    // Connections to every shard by address; a call borrows one set
+    typedef unordered_map<string, ShardLink> ShardLinks;
+
+    struct Shard {
+        int firstAccount; // Owns accounts up to the next shard's first
+        string address;
+    };
+
+    mutable shared_mutex tableMutex; // Calls share it; a split takes it exclusively
+    vector<Shard> shards;            // By first account
+    deque<string> spares;            // Empty shards for splits
+    mutex linksMutex;
+    vector<unique_ptr<ShardLinks>> idleLinks;
+    atomic<uint64_t> nextTransferId;
+    atomic<uint64_t> crossShardTransfers;
+
+    // A commit or abort a shard has not acknowledged yet, or a MoveIn for
+    // an account a split could not place; it goes to whichever shard owns
+    // request.account when it is sent
+    struct Undelivered {
+        WireRequest request;
+        chrono::steady_clock::time_point due;
+        int delayMs;
+    };
+    static constexpr int FIRST_RETRY_MS = 10;
+    static constexpr int LAST_RETRY_MS = 1000;
+    // Calls already gather their decisions into one wait, so the decision
+    // log syncs as soon as it has something instead of holding a group open
+    static constexpr int DECISION_SYNC_INTERVAL_US = 0;
+
+    unique_ptr<Journal> decisionLog;     // Optional; see openDecisionLog
+    mutex resolverMutex;
+    condition_variable resolverWake;
+    vector<Undelivered> undelivered;
+    unordered_map<uint64_t, int> unacknowledged; // Sides still to acknowledge, by transfer ID
+    unordered_set<int> unplaced;         // Accounts whose MoveIn is undelivered
+    bool stopping;
+    thread resolver;                     // Resends undelivered decisions and moves
+
+    // Append to the decision log; returns the sequence number to pass to
+    // decisionDurable (0 without a log)
+    uint64_t logDecision(const JournalRecord& record) {
+        return decisionLog ? decisionLog->append(record) : 0;
+    }
+
+    // Wait until the decision log is on disk up to a sequence number;
+    // false if it could not be made durable. True without a log.
+    bool decisionDurable(uint64_t sequenceNumber) {
+        return !decisionLog || decisionLog->waitDurable(sequenceNumber);
+    }
+
+    // One side has the decision; the transfer is finished once both do
+    // (caller holds resolverMutex)
+    void acknowledgedLocked(uint64_t transferId) {
+        auto it = unacknowledged.find(transferId);
+        if (it != unacknowledged.end() && --it->second == 0) {
+            unacknowledged.erase(it);
+            JournalRecord record(JournalRecordType::TransferFinished);
+            record.transferId = transferId;
+            logDecision(record);
+        }
+    }
+
+    // Whether a shard's response settles an undelivered request. A MoveIn
+    // refused with AccountExists was placed by an earlier attempt whose
+    // response was lost.
+    static bool settles(const WireRequest& request, const WireResponse& response) {
+        return response.status == (uint8_t)OperationStatus::Success ||
+               (request.type == RequestType::MoveIn && response.status == (uint8_t)OperationStatus::AccountExists);
+    }
+
+    // An undelivered request reached its shard (caller holds resolverMutex)
+    void deliveredLocked(const WireRequest& request) {
+        if (request.type != RequestType::MoveIn) {
+            acknowledgedLocked(request.transferId);
+            return;
+        }
+        unplaced.erase(request.account);
+        JournalRecord record(JournalRecordType::AccountPlaced);
+        record.id = request.account;
+        logDecision(record);
+    }
+
+    // Hand a decision to the resolver (caller holds resolverMutex)
+    void resendLocked(const WireRequest& request) {
+        undelivered.push_back(Undelivered{request, chrono::steady_clock::now() + chrono::milliseconds(FIRST_RETRY_MS),
+                                          FIRST_RETRY_MS});
+        resolverWake.notify_one();
+    }
+
+    // Deliver the decisions still owed to a shard now, before accounts move
+    // off it (caller holds tableMutex exclusively). Shards refuse to move an
+    // account with a prepared transfer, so this keeps a split from stopping
+    // early; whatever is not delivered stays with the resolver.
+    void deliverOwed(const string& address) {
+        vector<Undelivered> owed;
+        {
+            lock_guard<mutex> lock(resolverMutex);
+            for (size_t i = 0; i < undelivered.size();) {
+                if (shards[shardFor(undelivered[i].request.account)].address == address) {
+                    owed.push_back(move(undelivered[i]));
+                    undelivered[i] = move(undelivered.back());
+                    undelivered.pop_back();
+                } else {
+                    i++;
+                }
+            }
+        }
+        for (Undelivered& item : owed) {
+            WireResponse response;
+            bool delivered = exchangeRequest(address, item.request, response) && settles(item.request, response);
+            lock_guard<mutex> lock(resolverMutex);
+            if (delivered) {
+                deliveredLocked(item.request);
+            } else {
+                undelivered.push_back(move(item));
+                resolverWake.notify_one();
+            }
+        }
+    }
+
+    // Resolver thread: resend each undelivered decision or move on a new
+    // connection, backing off from FIRST_RETRY_MS to LAST_RETRY_MS, until
+    // the shard settles it (shards settle a repeated decision once)
+    void resolve() {
+        unique_lock<mutex> lock(resolverMutex);
+        while (!stopping) {
+            if (undelivered.empty()) {
+                resolverWake.wait(lock);
+                continue;
+            }
+            auto next = min_element(undelivered.begin(), undelivered.end(),
+                                    [](const Undelivered& a, const Undelivered& b) { return a.due < b.due; });
+            if (next->due > chrono::steady_clock::now()) {
+                resolverWake.wait_until(lock, next->due);
+                continue;
+            }
+            Undelivered item = move(*next);
+            *next = move(undelivered.back());
+            undelivered.pop_back();
+            lock.unlock();
+            string address;
+            {
+                shared_lock<shared_mutex> table(tableMutex);
+                if (!shards.empty()) {
+                    address = shards[shardFor(item.request.account)].address;
+                }
+            }
+            WireResponse response;
+            bool delivered = !address.empty() && exchangeRequest(address, item.request, response) &&
+                             settles(item.request, response);
+            lock.lock();
+            if (delivered && item.request.type == RequestType::MoveIn) {
+                LOG_INFO << "Account " << item.request.account << " placed on " << address;
+            } else if (delivered) {
+                LOG_INFO << "Transfer " << item.request.transferId << ": " << address << " acknowledged the "
+                     << (item.request.type == RequestType::Commit ? "commit" : "abort");
+            }
+            if (delivered) {
+                deliveredLocked(item.request);
+            } else {
+                item.delayMs = min(item.delayMs * 2, LAST_RETRY_MS);
+                item.due = chrono::steady_clock::now() + chrono::milliseconds(item.delayMs);
+                undelivered.push_back(move(item));
+            }
+        }
+    }
+
+    // Index of the shard owning an account number (caller holds tableMutex)
+    size_t shardFor(int accountNumber) const {
+        size_t index = upper_bound(shards.begin(), shards.end(), accountNumber,
+                                   [](int number, const Shard& shard) { return number < shard.firstAccount; }) -
+                       shards.begin();
+        return index ? index - 1 : 0;
+    }
+
+    unique_ptr<ShardLinks> takeLinks() {
+        lock_guard<mutex> lock(linksMutex);
+        if (idleLinks.empty()) {
+            return unique_ptr<ShardLinks>(new ShardLinks());
+        }
+        unique_ptr<ShardLinks> links = move(idleLinks.back());
+        idleLinks.pop_back();
+        return links;
+    }
+
+    void returnLinks(unique_ptr<ShardLinks> links) {
+        lock_guard<mutex> lock(linksMutex);
+        idleLinks.push_back(move(links));
+    }
+
+    // The link to a shard, connecting it if needed (fd stays -1 if that fails)
+    static ShardLink& linkTo(ShardLinks& links, const string& address) {
+        ShardLink& link = links[address];
+        if (link.fd < 0) {
+            link.fd = connectToService(address);
+        }
+        return link;
+    }
+
+    static void dropLink(ShardLink& link) {
+        if (link.fd >= 0) {
+            close(link.fd);
+        }
+        link.fd = -1;
+        link.input.clear();
+        link.consumed = 0;
+        link.output.clear();
+    }
+
+    // Send the queued requests; false (and the link dropped) on failure
+    static bool sendQueued(ShardLink& link) {
+        size_t done = 0;
+        while (link.fd >= 0 && done < link.output.size()) {
+            ssize_t result = ::write(link.fd, link.output.data() + done, link.output.size() - done);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                dropLink(link);
+                return false;
+            }
+            done += (size_t)result;
+        }
+        link.output.clear();
+        return link.fd >= 0;
+    }
+
+    // Read the next response frame (length included); 'frame' stays valid
+    // until the next read from the link. False (and the link dropped) on
+    // failure or timeout.
+    static bool receiveFrame(ShardLink& link, const char*& frame, uint32_t& size) {
+        while (link.fd >= 0) {
+            size_t available = link.input.size() - link.consumed;
+            if (available >= WireProtocol::LENGTH_SIZE) {
+                memcpy(&size, link.input.data() + link.consumed, sizeof(size));
+                if (size > WireProtocol::MAX_BODY) {
+                    break;
+                }
+                if (available >= WireProtocol::LENGTH_SIZE + size) {
+                    frame = link.input.data() + link.consumed;
+                    link.consumed += WireProtocol::LENGTH_SIZE + size;
+                    return true;
+                }
+            }
+            link.input.erase(0, link.consumed);
+            link.consumed = 0;
+            size_t used = link.input.size();
+            link.input.resize(used + 65536);
+            ssize_t result = ::read(link.fd, &link.input[used], 65536);
+            link.input.resize(used + (result > 0 ? (size_t)result : 0));
+            if (result == 0 || (result < 0 && errno != EINTR)) {
+                break;
+            }
+        }
+        dropLink(link);
+        return false;
+    }
+
+    // Read and decode the response to 'request'
+    static bool receiveResponse(ShardLink& link, const WireRequest& request, WireResponse& response) {
+        const char* frame;
+        uint32_t size;
+        return receiveFrame(link, frame, size) &&
+               WireProtocol::decodeResponse(frame + WireProtocol::LENGTH_SIZE, size, request.type, response) &&
+               response.id == request.id;
+    }
+
+    // Send one request on a link and wait for its response
+    static bool exchange(ShardLink& link, const WireRequest& request, WireResponse& response) {
+        if (link.fd < 0) {
+            return false;
+        }
+        WireProtocol::encodeRequest(request, link.output);
+        return sendQueued(link) && receiveResponse(link, request, response);
+    }
+
+    // Forward requests[begin, end), which each stay inside one shard:
+    // queue them per shard, send every queue, then copy the responses back
+    // in request order (caller holds tableMutex)
+    void forward(const vector<WireRequest>& requests, size_t begin, size_t end, ShardLinks& links, string& output) {
+        if (begin == end) {
+            return;
+        }
+        vector<ShardLink*> route(end - begin);
+        for (size_t i = begin; i < end; i++) {
+            route[i - begin] = &linkTo(links, shards[shardFor(requests[i].account)].address);
+            if (route[i - begin]->fd >= 0) {
+                WireProtocol::encodeRequest(requests[i], route[i - begin]->output);
+            }
+        }
+        for (auto& entry : links) {
+            if (!entry.second.output.empty()) {
+                sendQueued(entry.second);
+            }
+        }
+        for (size_t i = begin; i < end; i++) {
+            ShardLink& link = *route[i - begin];
+            const char* frame;
+            uint32_t size;
+            uint32_t id = 0;
+            if (link.fd >= 0 && receiveFrame(link, frame, size) && size >= sizeof(id)) {
+                memcpy(&id, frame + WireProtocol::LENGTH_SIZE, sizeof(id));
+            }
+            if (link.fd >= 0 && id == requests[i].id) {
+                output.append(frame, WireProtocol::LENGTH_SIZE + size);
+            } else {
+                dropLink(link);
+                WireProtocol::encodeStatus(requests[i], WireProtocol::SHARD_UNAVAILABLE, output);
+            }
+        }
+    }
+
+    // A cross-shard transfer in progress: the link to each side, the
+    // request of the current phase for each side and the votes
+    struct CrossTransfer {
+        string addresses[2];
+        ShardLink* sides[2];
+        WireRequest phase[2];
+        WireResponse votes[2];
+        bool commit;
+    };
+
+    // Queue the current phase request of every transfer on its sides'
+    // links and send them all
+    static void sendPhase(vector<CrossTransfer>& transfers, ShardLinks& links) {
+        for (CrossTransfer& transfer : transfers) {
+            for (int side = 0; side < 2; side++) {
+                if (transfer.sides[side]->fd >= 0) {
+                    WireProtocol::encodeRequest(transfer.phase[side], transfer.sides[side]->output);
+                }
+            }
+        }
+        for (auto& entry : links) {
+            if (!entry.second.output.empty()) {
+                sendQueued(entry.second);
+            }
+        }
+    }
+
+    // Run transfers between two shards as two-phase commits, all in step:
+    // every start is logged before one wait for the decision log, both
+    // sides of every transfer prepare at once, and the commits share one
+    // wait too. The transfers must not share accounts. Responses go to
+    // 'output' in order (caller holds tableMutex).
+    void transferAcrossShards(const vector<const WireRequest*>& requests, ShardLinks& links, string& output) {
+        TRACE_SCOPE("ShardRouter::transferAcrossShards");
+        crossShardTransfers.fetch_add(requests.size(), memory_order_relaxed);
+        vector<CrossTransfer> transfers(requests.size());
+        uint64_t sequenceNumber = 0;
+        for (size_t i = 0; i < requests.size(); i++) {
+            const WireRequest& request = *requests[i];
+            CrossTransfer& transfer = transfers[i];
+            transfer.addresses[0] = shards[shardFor(request.account)].address;
+            transfer.addresses[1] = shards[shardFor(request.toAccount)].address;
+            for (int side = 0; side < 2; side++) {
+                transfer.sides[side] = &linkTo(links, transfer.addresses[side]);
+                transfer.phase[side] = request;
+            }
+            transfer.phase[0].type = RequestType::PrepareDebit;
+            transfer.phase[1].type = RequestType::PrepareCredit;
+            transfer.phase[1].account = request.toAccount;
+            transfer.phase[0].transferId = transfer.phase[1].transferId = nextTransferId.fetch_add(1);
+
+            JournalRecord record(JournalRecordType::TransferStarted);
+            record.transferId = transfer.phase[0].transferId;
+            record.id = request.account;
+            record.otherId = request.toAccount;
+            record.amount = request.cents;
+            sequenceNumber = logDecision(record);
+        }
+        if (!decisionDurable(sequenceNumber)) {
+            for (const WireRequest* request : requests) {
+                WireProtocol::encodeStatus(*request, (uint8_t)OperationStatus::NotDurable, output);
+            }
+            return;
+        }
+
+        // Phase one: every side prepares at once. Each link answers in the
+        // order it was sent to, so the votes are read back in that order.
+        sendPhase(transfers, links);
+        size_t committing = 0;
+        for (CrossTransfer& transfer : transfers) {
+            for (int side = 0; side < 2; side++) {
+                if (transfer.sides[side]->fd < 0 ||
+                    !receiveResponse(*transfer.sides[side], transfer.phase[side], transfer.votes[side])) {
+                    transfer.votes[side] = WireResponse();
+                    transfer.votes[side].status = WireProtocol::SHARD_UNAVAILABLE;
+                }
+            }
+            transfer.commit = transfer.votes[0].status == (uint8_t)OperationStatus::Success &&
+                              transfer.votes[1].status == (uint8_t)OperationStatus::Success;
+            if (transfer.commit) {
+                JournalRecord record(JournalRecordType::TransferCommitted);
+                record.transferId = transfer.phase[0].transferId;
+                sequenceNumber = logDecision(record);
+                committing++;
+            }
+        }
+        bool durable = committing == 0 || decisionDurable(sequenceNumber);
+
+        // Phase two: tell both sides the outcome, including a side whose
+        // vote was lost (it may still have prepared). Sides that do not
+        // acknowledge it here get it from the resolver.
+        {
+            lock_guard<mutex> lock(resolverMutex);
+            for (CrossTransfer& transfer : transfers) {
+                transfer.commit = transfer.commit && durable;
+                for (int side = 0; side < 2; side++) {
+                    transfer.phase[side].type = transfer.commit ? RequestType::Commit : RequestType::Abort;
+                }
+                unacknowledged[transfer.phase[0].transferId] = 2;
+            }
+        }
+        sendPhase(transfers, links);
+        for (CrossTransfer& transfer : transfers) {
+            for (int side = 0; side < 2; side++) {
+                WireResponse acknowledgement;
+                bool delivered = transfer.sides[side]->fd >= 0 &&
+                                 receiveResponse(*transfer.sides[side], transfer.phase[side], acknowledgement) &&
+                                 acknowledgement.status == (uint8_t)OperationStatus::Success;
+                lock_guard<mutex> lock(resolverMutex);
+                if (delivered) {
+                    acknowledgedLocked(transfer.phase[side].transferId);
+                } else {
+                    LOG_ERROR << "Transfer " << transfer.phase[side].transferId
+                         << (transfer.commit ? " committed" : " aborted") << " but " << transfer.addresses[side]
+                         << " did not confirm it; resending";
+                    resendLocked(transfer.phase[side]);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < requests.size(); i++) {
+            const CrossTransfer& transfer = transfers[i];
+            WireResponse response = transfer.votes[0];
+            response.id = requests[i]->id;
+            response.status = transfer.votes[0].status != (uint8_t)OperationStatus::Success ? transfer.votes[0].status
+                                                                                            : transfer.votes[1].status;
+            if (!durable && response.status == (uint8_t)OperationStatus::Success) {
+                response.status = (uint8_t)OperationStatus::NotDurable;
+            }
+            if (!transfer.commit && transfer.votes[0].status == (uint8_t)OperationStatus::Success) {
+                response.balance += requests[i]->cents; // The abort gives the held amount back
+            }
+            WireProtocol::encodeResponse(response, RequestType::Transfer, output);
+        }
+    }
+
+    // Whether a request is a transfer between accounts on two shards
+    // (caller holds tableMutex)
+    bool crossesShards(const WireRequest& request) const {
+        return request.type == RequestType::Transfer && shardFor(request.account) != shardFor(request.toAccount);
+    }
+
+    // Run requests[begin, end), whose cross-shard transfers are 'crossing':
+    // the others go to their shards first (none of them touches an account
+    // of those transfers, so the order between the two does not show),
+    // then the transfers run together. The responses are put back in
+    // request order (caller holds tableMutex).
+    void runSegment(const vector<WireRequest>& requests, size_t begin, size_t end,
+                    const vector<const WireRequest*>& crossing, ShardLinks& links, string& output) {
+        vector<WireRequest> local;
+        for (size_t i = begin; i < end; i++) {
+            if (!crossesShards(requests[i])) {
+                local.push_back(requests[i]);
+            }
+        }
+        string localOutput;
+        string transferOutput;
+        forward(local, 0, local.size(), links, localOutput);
+        transferAcrossShards(crossing, links, transferOutput);
+        size_t localAt = 0;
+        size_t transferAt = 0;
+        for (size_t i = begin; i < end; i++) {
+            bool transfer = crossesShards(requests[i]);
+            const string& from = transfer ? transferOutput : localOutput;
+            size_t& at = transfer ? transferAt : localAt;
+            uint32_t size;
+            memcpy(&size, from.data() + at, sizeof(size));
+            output.append(from, at, WireProtocol::LENGTH_SIZE + size);
+            at += WireProtocol::LENGTH_SIZE + size;
+        }
+    }
+
+    // Add up every shard's summary (caller holds tableMutex)
+    void summarize(const WireRequest& request, ShardLinks& links, string& output) {
+        WireResponse total = WireResponse();
+        total.id = request.id;
+        for (const Shard& shard : shards) {
+            ShardLink& link = linkTo(links, shard.address);
+            if (link.fd >= 0) {
+                WireProtocol::encodeRequest(request, link.output);
+                sendQueued(link);
+            }
+        }
+        for (const Shard& shard : shards) {
+            WireResponse part;
+            ShardLink& link = links[shard.address];
+            if (link.fd >= 0 && receiveResponse(link, request, part)) {
+                total.customers += part.customers;
+                total.accounts += part.accounts;
+                total.totalCents += part.totalCents;
+            } else {
+                total.status = WireProtocol::SHARD_UNAVAILABLE;
+            }
+        }
+        WireProtocol::encodeResponse(total, RequestType::Summary, output);
+    }
+
+    // Keep an account a split took off its shard but could place neither
+    // on the spare nor back: it goes to the decision log, so a restarted
+    // router places it too, and to the resolver, which places it on the
+    // shard owning its number (caller holds tableMutex exclusively)
+    void keepUnplaced(const WireRequest& moveIn) {
+        JournalRecord record(JournalRecordType::AccountUnplaced);
+        record.id = moveIn.account;
+        WireProtocol::encodeRequest(moveIn, record.name);
+        bool logged = decisionLog && record.name.size() <= 0xFFFF && decisionDurable(logDecision(record));
+        LOG_ERROR << "Account " << moveIn.account << " with balance $" << moveIn.move.balance
+             << " could not be placed; retrying"
+             << (logged ? "" : " (not in the decision log, so it is lost if the router stops first)");
+        lock_guard<mutex> lock(resolverMutex);
+        unplaced.insert(moveIn.account);
+        resendLocked(moveIn);
+    }
+
+    // Split the shard holding request.account: the accounts from there up
+    // to the end of its range move to a spare shard, which takes over that
+    // range. Requests wait while the accounts move. If a move fails part
+    // way, the spare keeps the accounts it got and the rest stay put; an
+    // account that fits on neither is kept until it is placed.
+    void split(const WireRequest& request, ShardLinks& links, string& output) {
+        TRACE_SCOPE("ShardRouter::split");
+        unique_lock<shared_mutex> lock(tableMutex);
+        size_t source = shardFor(request.account);
+        if (spares.empty() || request.account <= shards[source].firstAccount) {
+            LOG_ERROR << "Cannot split at account " << request.account
+                 << (spares.empty() ? ": no spare shard" : ": not inside a shard's range");
+            WireProtocol::encodeStatus(request, WireProtocol::BAD_REQUEST, output);
+            return;
+        }
+        int endAccount = source + 1 < shards.size() ? shards[source + 1].firstAccount : INT32_MAX;
+        string sourceAddress = shards[source].address;
+        string spareAddress = spares.front();
+        deliverOwed(sourceAddress);
+        ShardLink& from = linkTo(links, sourceAddress);
+        ShardLink& to = linkTo(links, spareAddress);
+
+        WireRequest moveOut = WireRequest();
+        moveOut.type = RequestType::MoveOut;
+        moveOut.account = request.account;
+        moveOut.toAccount = endAccount;
+        WireRequest moveIn = WireRequest();
+        moveIn.type = RequestType::MoveIn;
+        int64_t moved = 0;
+        uint8_t status = (uint8_t)OperationStatus::Success;
+        while (true) {
+            WireResponse taken;
+            if (!exchange(from, moveOut, taken)) {
+                status = WireProtocol::SHARD_UNAVAILABLE;
+                break;
+            }
+            if (taken.status == (uint8_t)OperationStatus::AccountNotFound) {
+                break; // No accounts left in the range
+            }
+            if (taken.status != (uint8_t)OperationStatus::Success) {
+                // Stop here (e.g. TransferPending); the rest stays put
+                status = taken.status;
+                break;
+            }
+            moveIn.move = taken.move;
+            moveIn.account = taken.move.accountNumber;
+            WireResponse placed;
+            if (!exchange(to, moveIn, placed) || placed.status != (uint8_t)OperationStatus::Success) {
+                // Put it back where it was
+                WireResponse restored;
+                if (!exchange(linkTo(links, sourceAddress), moveIn, restored) ||
+                    restored.status != (uint8_t)OperationStatus::Success) {
+                    keepUnplaced(moveIn);
+                }
+                status = WireProtocol::SHARD_UNAVAILABLE;
+                break;
+            }
+            moved++;
+            moveOut.account = taken.move.accountNumber + 1;
+        }
+
+        if (moved > 0 || status == (uint8_t)OperationStatus::Success) {
+            spares.pop_front();
+            shards.insert(shards.begin() + source + 1, Shard{request.account, spareAddress});
+            if (status != (uint8_t)OperationStatus::Success) {
+                // The source keeps the accounts that did not move
+                shards.insert(shards.begin() + source + 2, Shard{moveOut.account, sourceAddress});
+            }
+            LOG_INFO << "Split " << sourceAddress << " at account " << request.account << ": " << moved
+                 << " accounts moved to " << spareAddress;
+        }
+        WireResponse response = WireResponse();
+        response.id = request.id;
+        response.status = status;
+        response.balance = moved;
+        WireProtocol::encodeResponse(response, RequestType::Split, output);
+    }
+
+public:
+    // Event loops to serve a router with: each blocks on shard round trips
+    // and decision-log syncs, so several let those overlap
+    static constexpr unsigned LOOP_THREADS = 4;
+
+    // Constructor
+    ShardRouter()
+        : nextTransferId((uint64_t)Transaction::currentTimestamp() << 12), crossShardTransfers(0), stopping(false) {
+        resolver = thread([this]() { resolve(); });
+    }
+
+    // Destructor: decisions still undelivered are resent from the decision
+    // log when it is next opened
+    ~ShardRouter() {
+        {
+            lock_guard<mutex> lock(resolverMutex);
+            stopping = true;
+            if (!undelivered.empty()) {
+                LOG_ERROR << undelivered.size() << " transfer decision(s) or account move(s) not delivered"
+                     << (decisionLog ? "; they are resent when the decision log is reopened" : "");
+            }
+        }
+        resolverWake.notify_one();
+        resolver.join();
+        for (unique_ptr<ShardLinks>& links : idleLinks) {
+            for (auto& entry : *links) {
+                dropLink(entry.second);
+            }
+        }
+    }
+
+    ShardRouter(const ShardRouter&) = delete;
+    ShardRouter& operator=(const ShardRouter&) = delete;
+
+    // Add a shard owning accounts from 'firstAccount' up to the next shard's
+    // first account. The lowest shard also takes any account below its range.
+    void addShard(int firstAccount, const string& address) {
+        unique_lock<shared_mutex> lock(tableMutex);
+        auto position = upper_bound(shards.begin(), shards.end(), firstAccount,
+                                    [](int number, const Shard& shard) { return number < shard.firstAccount; });
+        shards.insert(position, Shard{firstAccount, address});
+    }
+
+    // Add an empty shard to split onto later
+    void addSpare(const string& address) {
+        unique_lock<shared_mutex> lock(tableMutex);
+        spares.push_back(address);
+    }
+
+    // Record cross-shard transfers in a decision log and settle the ones a
+    // previous run left unfinished: committed ones are committed again and
+    // the rest aborted on both shards, in the background until each shard
+    // acknowledges. Accounts a split left unplaced are placed the same way.
+    // Decisions and accounts go to the shard that owns each account number,
+    // so the shards must match the layout the log was written under. An
+    // incomplete record left by a crash is cut off. Call after adding the
+    // shards and before serving; false if the file cannot be opened.
+    bool openDecisionLog(const string& path) {
+        if (decisionLog) {
+            return false;
+        }
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return false;
+        }
+        size_t size = (size_t)info.st_size;
+        size_t offset = 0;
+        map<uint64_t, JournalRecord> started; // Unfinished transfers by ID
+        unordered_set<uint64_t> committed;
+        map<int, JournalRecord> unplacedMoves; // By account number
+        if (size > 0) {
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+            JournalRecord record;
+            while (size_t used = Journal::decode((const char*)mapped, size, offset, record)) {
+                if (record.type == JournalRecordType::TransferStarted) {
+                    started[record.transferId] = record;
+                } else if (record.type == JournalRecordType::TransferCommitted) {
+                    committed.insert(record.transferId);
+                } else if (record.type == JournalRecordType::TransferFinished) {
+                    started.erase(record.transferId);
+                    committed.erase(record.transferId);
+                } else if (record.type == JournalRecordType::AccountUnplaced) {
+                    unplacedMoves[record.id] = record;
+                } else if (record.type == JournalRecordType::AccountPlaced) {
+                    unplacedMoves.erase(record.id);
+                }
+                offset += used;
+            }
+            munmap(mapped, size);
+            if (offset < size) {
+                LOG_ERROR << "Decision log: discarding " << (size - offset) << " bytes of incomplete record at the end";
+                if (ftruncate(fd, (off_t)offset) != 0) {
+                    close(fd);
+                    return false;
+                }
+            }
+        }
+        decisionLog.reset(new Journal(fd, JournalSync::Group, offset, DECISION_SYNC_INTERVAL_US));
+
+        lock_guard<mutex> lock(resolverMutex);
+        for (const auto& entry : started) {
+            const JournalRecord& record = entry.second;
+            bool commit = committed.count(record.transferId) > 0;
+            WireRequest request = WireRequest();
+            request.type = commit ? RequestType::Commit : RequestType::Abort;
+            request.transferId = record.transferId;
+            request.cents = record.amount;
+            request.account = record.id;
+            resendLocked(request);
+            request.account = record.otherId;
+            resendLocked(request);
+            unacknowledged[record.transferId] = 2;
+            nextTransferId.store(max(nextTransferId.load(), record.transferId + 1));
+        }
+        if (!started.empty()) {
+            LOG_INFO << "Decision log: settling " << started.size() << " unfinished cross-shard transfer(s)";
+        }
+        for (const auto& entry : unplacedMoves) {
+            const string& frame = entry.second.name;
+            WireRequest request;
+            if (frame.size() < WireProtocol::LENGTH_SIZE ||
+                !WireProtocol::decodeRequest(frame.data() + WireProtocol::LENGTH_SIZE,
+                                             (uint32_t)(frame.size() - WireProtocol::LENGTH_SIZE), request) ||
+                request.type != RequestType::MoveIn) {
+                LOG_ERROR << "Decision log: cannot read the move of account " << entry.first;
+                continue;
+            }
+            request.account = request.move.accountNumber;
+            unplaced.insert(request.account);
+            resendLocked(request);
+        }
+        if (!unplaced.empty()) {
+            LOG_INFO << "Decision log: placing " << unplaced.size() << " account(s) a split left unplaced";
+        }
+        return true;
+    }
+
+    size_t getShardCount() const {
+        shared_lock<shared_mutex> lock(tableMutex);
+        return shards.size();
+    }
+
+    uint64_t getCrossShardTransfers() const { return crossShardTransfers.load(); }
+
+    // Cross-shard transfers a shard has not acknowledged the decision for
+    size_t getUnsettledTransfers() {
+        lock_guard<mutex> lock(resolverMutex);
+        return unacknowledged.size();
+    }
+
+    // Accounts a split took off a shard that are not placed again yet
+    size_t getUnplacedAccounts() {
+        lock_guard<mutex> lock(resolverMutex);
+        return unplaced.size();
+    }
+
+    // Requests are taken in segments that end before the first request
+    // touching an account of a cross-shard transfer already in the
+    // segment, so the transfers of a segment can run together
+    bool handle(const vector<WireRequest>& requests, string& output) override {
+        unique_ptr<ShardLinks> links = takeLinks();
+        shared_lock<shared_mutex> table(tableMutex);
+        vector<const WireRequest*> crossing; // Cross-shard transfers of the segment
+        unordered_set<int> touched;          // Their accounts
+        size_t begin = 0;
+        while (begin < requests.size()) {
+            const WireRequest& request = requests[begin];
+            if (request.type > RequestType::Lookup) {
+                if (request.type == RequestType::Summary) {
+                    summarize(request, *links, output);
+                } else if (request.type == RequestType::Split) {
+                    table.unlock();
+                    split(request, *links, output);
+                    table.lock();
+                } else {
+                    WireProtocol::encodeStatus(request, WireProtocol::BAD_REQUEST, output); // Shard-only requests
+                }
+                begin++;
+                continue;
+            }
+            crossing.clear();
+            touched.clear();
+            size_t end = begin;
+            for (; end < requests.size() && requests[end].type <= RequestType::Lookup; end++) {
+                const WireRequest& next = requests[end];
+                if (!touched.empty() && (touched.count(next.account) ||
+                                         (next.type == RequestType::Transfer && touched.count(next.toAccount)))) {
+                    break;
+                }
+                if (crossesShards(next)) {
+                    crossing.push_back(&next);
+                    touched.insert(next.account);
+                    touched.insert(next.toAccount);
+                }
+            }
+            if (crossing.empty()) {
+                forward(requests, begin, end, *links, output);
+            } else {
+                runSegment(requests, begin, end, crossing, *links, output);
+            }
+            begin = end;
+        }
+        table.unlock();
+        returnLinks(move(links));
+        return true;
+    }
+};
+
+// Network service: speaks the WireProtocol for a ServiceHandler.
+// Each loop thread runs its own epoll loop and owns the connections it
+// accepts; all of them wait on the one listening socket (EPOLLEXCLUSIVE
+// wakes just one). A readiness event reads everything available, hands
+// the complete requests in it to the handler together, and sends all the
+// responses with a single write.
+class BankServer {
+private:
+    static const size_t READ_CHUNK = 64 * 1024;
+    static const size_t MAX_BACKLOG = 4 << 20; // Stop reading while this much output is unsent
+    static const size_t MAX_BATCH = 4096;      // Requests handed to the handler at once
+
+    struct Connection {
+        string input;
+        size_t consumed = 0; // Bytes of input already handled
+        string output;
+        size_t written = 0;  // Bytes of output already sent
+        uint32_t events = 0; // Currently registered with epoll
+    };
+
+    ServiceHandler& handler;
+    int listenFd;
+    string unixPath; // Removed when the server goes away
+    atomic<uint64_t> requestsServed;
+
+    // Handle every complete frame in the input; false to drop the connection.
+    // 'requests' is scratch space kept by the loop.
+    bool handleInput(Connection& connection, vector<WireRequest>& requests) {
+        const string& input = connection.input;
+        bool open = true;
+        bool more = true;
+        while (open && more && connection.output.size() - connection.written < MAX_BACKLOG) {
+            requests.clear();
+            while (requests.size() < MAX_BATCH) {
+                more = input.size() - connection.consumed >= WireProtocol::LENGTH_SIZE;
+                uint32_t size = 0;
+                if (more) {
+                    memcpy(&size, input.data() + connection.consumed, sizeof(size));
+                    open = size <= WireProtocol::MAX_BODY;
+                    more = open && input.size() - connection.consumed >= WireProtocol::LENGTH_SIZE + size;
+                }
+                if (!more) {
+                    break;
+                }
+                WireRequest request;
+                const char* body = input.data() + connection.consumed + WireProtocol::LENGTH_SIZE;
+                connection.consumed += WireProtocol::LENGTH_SIZE + size;
+                if (WireProtocol::decodeRequest(body, size, request)) {
+                    requests.push_back(move(request));
+                    continue;
+                }
+                // Answer what came before, then the malformed request
+                if (!handler.handle(requests, connection.output)) {
+                    return false;
+                }
+                requestsServed.fetch_add(requests.size() + 1, memory_order_relaxed);
+                requests.clear();
+                request.type = RequestType::Lookup;
+                WireProtocol::encodeStatus(request, WireProtocol::BAD_REQUEST, connection.output);
+            }
+            if (!requests.empty()) {
+                if (!handler.handle(requests, connection.output)) {
+                    return false;
+                }
+                requestsServed.fetch_add(requests.size(), memory_order_relaxed);
+            }
+        }
+        if (connection.consumed > input.size() / 2) {
+            connection.input.erase(0, connection.consumed);
+            connection.consumed = 0;
+        }
+        return open;
+    }
+
+    // Send as much pending output as the socket takes; false on error
+    static bool flush(int fd, Connection& connection) {
+        while (connection.written < connection.output.size()) {
+            ssize_t result = ::write(fd, connection.output.data() + connection.written,
+                                     connection.output.size() - connection.written);
+            if (result < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            connection.written += (size_t)result;
+        }
+        connection.output.clear();
+        connection.written = 0;
+        return true;
+    }
+
+    // Read everything available; false when the peer is gone
+    static bool readInput(int fd, Connection& connection) {
+        while (true) {
+            size_t size = connection.input.size();
+            connection.input.resize(size + READ_CHUNK);
+            ssize_t result = ::read(fd, &connection.input[size], READ_CHUNK);
+            connection.input.resize(size + (result > 0 ? (size_t)result : 0));
+            if (result == 0) {
+                return false;
+            }
+            if (result < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            if ((size_t)result < READ_CHUNK) {
+                return true;
+            }
+        }
+    }
+
+    // One event loop; returns when 'stop' is set
+    void runLoop(const atomic<bool>& stop) {
+        int epollFd = epoll_create1(0);
+        epoll_event listenEvent = {};
+        listenEvent.events = EPOLLIN | EPOLLEXCLUSIVE;
+        listenEvent.data.fd = listenFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent);
+        unordered_map<int, unique_ptr<Connection>> connections;
+        epoll_event events[256];
+        vector<WireRequest> requests;
+
+        auto closeConnection = [&](int fd) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            close(fd);
+            connections.erase(fd);
+        };
+        // Register for the events a connection needs now
+        auto updateEvents = [&](int fd, Connection& connection) {
+            uint32_t wanted = (connection.output.size() - connection.written < MAX_BACKLOG ? (uint32_t)EPOLLIN : 0u) |
+                              (connection.written < connection.output.size() ? (uint32_t)EPOLLOUT : 0u);
+            if (wanted != connection.events) {
+                epoll_event event = {};
+                event.events = wanted;
+                event.data.fd = fd;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+                connection.events = wanted;
+            }
+        };
+
+        while (!stop.load(memory_order_relaxed)) {
+            int ready = epoll_wait(epollFd, events, 256, 100);
+            for (int i = 0; i < ready; i++) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) {
+                    // One connection per wakeup: the listening socket stays
+                    // readable while more wait, so they go to other loops
+                    int client = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK);
+                    if (client >= 0) {
+                        int one = 1;
+                        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Fails harmlessly on Unix sockets
+                        unique_ptr<Connection> connection(new Connection());
+                        connection->events = EPOLLIN;
+                        epoll_event event = {};
+                        event.events = EPOLLIN;
+                        event.data.fd = client;
+                        epoll_ctl(epollFd, EPOLL_CTL_ADD, client, &event);
+                        connections[client] = move(connection);
+                    }
+                    continue;
+                }
+                auto found = connections.find(fd);
+                if (found == connections.end()) {
+                    continue;
+                }
+                Connection& connection = *found->second;
+                bool open = !(events[i].events & (EPOLLERR | EPOLLHUP)) || (events[i].events & EPOLLIN);
+                if (open && (events[i].events & EPOLLIN)) {
+                    open = readInput(fd, connection);
+                }
+                // Answer what was read even if the peer has finished sending
+                if (!handleInput(connection, requests) || !flush(fd, connection) || !open) {
+                    closeConnection(fd);
+                    continue;
+                }
+                updateEvents(fd, connection);
+            }
+        }
+        for (auto& entry : connections) {
+            close(entry.first);
+        }
+        close(epollFd);
+    }
+
+public:
+    // Constructor
+    explicit BankServer(ServiceHandler& serviceHandler) : handler(serviceHandler), listenFd(-1), requestsServed(0) {}
+
+    // Destructor
+    ~BankServer() {
+        if (listenFd >= 0) {
+            close(listenFd);
+        }
+        if (!unixPath.empty()) {
+            unlink(unixPath.c_str());
+        }
     }
 
-    // Virtual destructor for proper inheritance
-    virtual ~Account() {}
+    BankServer(const BankServer&) = delete;
+    BankServer& operator=(const BankServer&) = delete;
 
-    // Virtual methods for polymorphism
-    virtual void deposit(double amount) {
-        if (amount > 0) {
-            balance += amount;
-            transactionHistory.push_back(Transaction(amount, "Deposit"));
-            cout << "Deposited $" << fixed << setprecision(2) << amount 
-                 << " to account " << accountNumber << endl;
-        } else {
-            cout << "Error: Deposit amount must be positive!" << endl;
+    bool listen(const string& address) {
+        listenFd = openServiceSocket(address, true);
+        if (listenFd >= 0 && address.compare(0, 5, "unix:") == 0) {
+            unixPath = address.substr(5);
         }
+        return listenFd >= 0;
     }
 
-    virtual bool withdraw(double amount) {
-        if (amount <= 0) {
-            cout << "Error: Withdrawal amount must be positive!" << endl;
-            return false;
+    // Serve on 'threadCount' event loops until 'stop' is set
+    void run(const atomic<bool>& stop, unsigned threadCount = 1) {
+        vector<thread> loops;
+        for (unsigned i = 1; i < threadCount; i++) {
+            loops.push_back(thread([this, &stop]() { runLoop(stop); }));
         }
-        if (amount > balance) {
-            cout << "Error: Insufficient funds! Balance: $" << fixed << setprecision(2) 
-                 << balance << endl;
-            return false;
+        runLoop(stop);
+        for (thread& loop : loops) {
+            loop.join();
         }
-        balance -= amount;
-        transactionHistory.push_back(Transaction(amount, "Withdrawal"));
-        cout << "Withdrew $" << fixed << setprecision(2) << amount 
-             << " from account " << accountNumber << endl;
-        return true;
     }
 
-    // Transfer money to another account
-    bool transfer(Account& toAccount, double amount) {
-        if (this->withdraw(amount)) {
-            toAccount.deposit(amount);
-            cout << "Transfer successful: $" << fixed << setprecision(2) 
-                 << amount << " from account " << accountNumber 
-                 << " to account " << toAccount.getAccountNumber() << endl;
-            return true;
+    uint64_t getRequestsServed() const { return requestsServed.load(); }
+};
+
+// Load generator for the network service. Opens 'connections' connections
+// and keeps 'depth' pipelined requests in flight on each until every
+// connection has had 'requestsPerConnection' answered. Requests are 40%
+// lookups, 25% deposits, 25% withdrawals and 10% transfers on accounts
+// firstAccount .. firstAccount + accountCount - 1. 'netDeposited', if
+// given, receives the cents deposited minus the cents withdrawn by the
+// requests that succeeded. Returns false if a connection fails or a
+// response does not match its request.
+bool runLoadClient(const string& address, int connections, uint64_t requestsPerConnection, int depth,
+                   int accountCount, int firstAccount = 1001, int64_t* netDeposited = nullptr) {
+    struct ClientConnection {
+        int fd;
+        uint64_t sent = 0;
+        uint64_t received = 0;
+        string input;
+        size_t consumed = 0;
+        string output;
+        size_t written = 0;
+        uint32_t events = 0;          // Currently registered with epoll
+        vector<WireRequest> inFlight; // Request with id i is at i % depth
+        mt19937 rng;
+    };
+
+    int epollFd = epoll_create1(0);
+    vector<ClientConnection> clients(connections);
+    for (int c = 0; c < connections; c++) {
+        clients[c].fd = openServiceSocket(address, false);
+        if (clients[c].fd < 0) {
+            LOG_ERROR << "Cannot connect to " << address;
+            for (int k = 0; k < c; k++) {
+                close(clients[k].fd);
+            }
+            close(epollFd);
+            return false;
         }
-        return false;
+        clients[c].rng.seed(1000 + c);
+        clients[c].inFlight.resize(depth);
+        // Writable at once, which sends the first requests
+        epoll_event event = {};
+        event.events = clients[c].events = EPOLLIN | EPOLLOUT;
+        event.data.u32 = (uint32_t)c;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, clients[c].fd, &event);
     }
 
-    // Display account information
-    virtual void displayInfo() const {
-        cout << "\n--- Account Information ---" << endl;
-        cout << "Account Number: " << accountNumber << endl;
-        cout << "Owner: " << ownerName << endl;
-        cout << "Balance: $" << fixed << setprecision(2) << balance << endl;
-        cout << "Transaction History:" << endl;
-        if (transactionHistory.empty()) {
-            cout << "  No transactions" << endl;
-        } else {
-            for (const auto& trans : transactionHistory) {
-                cout << "  ";
-                trans.displayTransaction();
+    uint64_t statusCounts[OPERATION_STATUS_COUNT + 1] = {}; // Last slot: rejected or shard unavailable
+    uint64_t requestCount = 0;
+    int64_t net = 0;
+    bool ok = true;
+    int finished = 0;
+    epoll_event events[256];
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    while (ok && finished < connections) {
+        int ready = epoll_wait(epollFd, events, 256, 1000);
+        if (ready <= 0) {
+            LOG_ERROR << "Load client: no progress from " << address;
+            ok = false;
+            break;
+        }
+        for (int i = 0; ok && i < ready; i++) {
+            ClientConnection& client = clients[events[i].data.u32];
+            if (events[i].events & EPOLLIN) {
+                while (true) {
+                    size_t size = client.input.size();
+                    client.input.resize(size + 65536);
+                    ssize_t result = ::read(client.fd, &client.input[size], 65536);
+                    client.input.resize(size + (result > 0 ? (size_t)result : 0));
+                    if (result <= 0) {
+                        ok = result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+                        break;
+                    }
+                }
+                while (ok && client.input.size() - client.consumed >= WireProtocol::LENGTH_SIZE) {
+                    uint32_t size;
+                    memcpy(&size, client.input.data() + client.consumed, sizeof(size));
+                    if (client.input.size() - client.consumed < WireProtocol::LENGTH_SIZE + size) {
+                        break;
+                    }
+                    const WireRequest& request = client.inFlight[client.received % depth];
+                    WireResponse response = WireResponse();
+                    ok = WireProtocol::decodeResponse(client.input.data() + client.consumed + WireProtocol::LENGTH_SIZE,
+                                                      size, request.type, response) &&
+                         response.id == request.id;
+                    statusCounts[response.status < OPERATION_STATUS_COUNT ? response.status : OPERATION_STATUS_COUNT]++;
+                    if (response.status == (uint8_t)OperationStatus::Success) {
+                        net += request.type == RequestType::Deposit ? request.cents
+                             : request.type == RequestType::Withdrawal ? -request.cents : 0;
+                    }
+                    client.consumed += WireProtocol::LENGTH_SIZE + size;
+                    client.received++;
+                    requestCount++;
+                }
+                client.input.erase(0, client.consumed);
+                client.consumed = 0;
+                if (client.received == requestsPerConnection) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, client.fd, nullptr);
+                    finished++;
+                    continue;
+                }
+            }
+            // Top the pipeline up and send it in one write
+            while (client.sent < requestsPerConnection && client.sent - client.received < (uint64_t)depth) {
+                WireRequest& request = client.inFlight[client.sent % depth];
+                request = WireRequest();
+                request.id = (uint32_t)client.sent++;
+                request.account = firstAccount + (int)(client.rng() % accountCount);
+                request.toAccount = firstAccount + (int)(client.rng() % accountCount);
+                request.cents = 1 + client.rng() % 10000;
+                uint32_t pick = client.rng() % 100;
+                request.type = pick < 40 ? RequestType::Lookup : pick < 65 ? RequestType::Deposit
+                             : pick < 90 ? RequestType::Withdrawal : RequestType::Transfer;
+                WireProtocol::encodeRequest(request, client.output);
+            }
+            while (ok && client.written < client.output.size()) {
+                ssize_t result = ::write(client.fd, client.output.data() + client.written,
+                                         client.output.size() - client.written);
+                if (result < 0) {
+                    ok = errno == EAGAIN || errno == EWOULDBLOCK;
+                    break;
+                }
+                client.written += (size_t)result;
+            }
+            if (client.written == client.output.size()) {
+                client.output.clear();
+                client.written = 0;
+            }
+            // Wait for writability only while output is left over
+            uint32_t wanted = EPOLLIN | (client.written < client.output.size() ? (uint32_t)EPOLLOUT : 0u);
+            if (wanted != client.events) {
+                epoll_event event = {};
+                event.events = client.events = wanted;
+                event.data.u32 = events[i].data.u32;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, client.fd, &event);
             }
         }
     }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (ClientConnection& client : clients) {
+        close(client.fd);
+    }
+    close(epollFd);
 
-    // Getters
-    int getAccountNumber() const { return accountNumber; }
-    double getBalance() const { return balance; }
-    string getOwnerName() const { return ownerName; }
-
-    // Operator overloading
-    // += operator for adding transactions
-    Account& operator+=(const Transaction& trans) {
-        if (trans.getType() == "Deposit") {
-            deposit(trans.getAmount());
+    LOG_INFO << "Load client: " << requestCount << " requests on " << connections << " connections (pipeline depth "
+         << depth << ") in " << seconds << " s, " << (seconds > 0 ? requestCount / seconds : 0.0) << " requests/s";
+    for (int s = 0; s < OPERATION_STATUS_COUNT; s++) {
+        if (statusCounts[s]) {
+            LOG_INFO << "  " << operationStatusName((OperationStatus)s) << ": " << statusCounts[s];
         }
-        return *this;
     }
+    if (statusCounts[OPERATION_STATUS_COUNT]) {
+        LOG_INFO << "  Rejected or shard unavailable: " << statusCounts[OPERATION_STATUS_COUNT];
+    }
+    if (netDeposited) {
+        *netDeposited = net;
+    }
+    if (!ok) {
+        LOG_ERROR << "Load client: connection failed or response out of order";
+    }
+    return ok;
+}
 
-    // == operator for comparing accounts (by balance)
-    bool operator==(const Account& other) const {
-        return balance == other.balance;
+// Concurrency stress test: worker threads run random deposits, withdrawals
+// and transfers against a shared set of accounts. Afterwards the total system
+// balance must equal the starting total plus deposits minus withdrawals.
+// With a journal path the operations are also journaled, and the journal is
+// replayed into a fresh Operations that must end up with the same balances.
+bool runConcurrencyStressTest(int threadCount, int operationsPerThread, const string& journalPath = "") {
+    const int ACCOUNT_COUNT = 64;
+    const Money INITIAL_BALANCE = 1000.0;
+
+    unique_ptr<Operations> system(new Operations());
+    if (!journalPath.empty() && !system->openJournal(journalPath)) {
+        LOG_ERROR << "Cannot open journal " << journalPath;
+        return false;
     }
+    Operations& bankSystem = *system;
 
-    // > operator for comparing balances
-    bool operator>(const Account& other) const {
-        return balance > other.balance;
+    // Silence per-operation messages while the workers run
+    LogLevel savedLevel = Logger::getLevel();
+    Logger::setLevel(LogLevel::Silent);
+
+    // Accounts are spread over a few customers so their running totals
+    // are exercised too
+    const int CUSTOMER_COUNT = 8;
+    vector<Customer*> customers;
+    for (int i = 0; i < CUSTOMER_COUNT; i++) {
+        customers.push_back(bankSystem.createCustomer("Stress Customer " + to_string(i)));
+    }
+    vector<int> accountNumbers;
+    for (int i = 0; i < ACCOUNT_COUNT; i++) {
+        string owner = "Stress Owner " + to_string(i);
+        Account* account = (i % 4 == 0)
+            ? bankSystem.createSavingsAccount(owner, INITIAL_BALANCE, 0.02, 1000.0)
+            : bankSystem.createAccount(owner, INITIAL_BALANCE);
+        bankSystem.assignAccountToCustomer(customers[i % CUSTOMER_COUNT], account);
+        accountNumbers.push_back(account->getAccountNumber());
     }
 
-    // Friend function for << operator
-    friend ostream& operator<<(ostream& os, const Account& account) {
-        os << "Account " << account.accountNumber << " (" << account.ownerName 
-           << "): $" << fixed << setprecision(2) << account.balance;
-        return os;
+    // Net money moved in or out of the system by each worker
+    vector<Money> deposited(threadCount);
+    vector<Money> withdrawn(threadCount);
+    vector<thread> workers;
+    for (int t = 0; t < threadCount; t++) {
+        workers.push_back(thread([&, t]() {
+            mt19937 rng(12345 + t);
+            for (int i = 0; i < operationsPerThread; i++) {
+                int from = accountNumbers[rng() % ACCOUNT_COUNT];
+                int to = accountNumbers[rng() % ACCOUNT_COUNT];
+                Money amount = Money::fromCents(1 + rng() % 10000);
+                switch (rng() % 3) {
+                    case 0:
+                        if (bankSystem.performDeposit(from, amount)) deposited[t] += amount;
+                        break;
+                    case 1:
+                        if (bankSystem.performWithdrawal(from, amount)) withdrawn[t] += amount;
+                        break;
+                    default:
+                        bankSystem.performTransfer(from, to, amount);
+                        break;
+                }
+            }
+        }));
     }
-};
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-// Initialize static member
-int Account::nextAccountNumber = 1001;
+    Logger::setLevel(savedLevel);
 
-// Derived SavingsAccount class
-class SavingsAccount : public Account {
-private:
-    double interestRate;
-    double withdrawalLimit;
-    int withdrawalsThisMonth;
-    static const int MAX_WITHDRAWALS = 6; // Federal savings account limit
+    Money expected = Money::fromCents(INITIAL_BALANCE.getCents() * ACCOUNT_COUNT);
+    for (int t = 0; t < threadCount; t++) {
+        expected += deposited[t] - withdrawn[t];
+    }
+    Money actual;
+    for (int accountNumber : accountNumbers) {
+        actual += bankSystem.findAccountByNumber(accountNumber)->getBalance();
+    }
 
-public:
-    // Constructor
-    SavingsAccount(const string& owner, double initialBalance = 0.0, 
-                   double rate = 0.02, double limit = 1000.0) 
-        : Account(owner, initialBalance), interestRate(rate), 
-          withdrawalLimit(limit), withdrawalsThisMonth(0) {}
+    bool passed = actual == expected;
+    LOG_INFO << "Stress test: " << threadCount << " threads x " << operationsPerThread 
+         << " operations on " << ACCOUNT_COUNT << " accounts";
+    LOG_INFO << "Expected total: $" << expected 
+         << ", actual total: $" << actual;
+    LOG_INFO << (passed ? "PASSED: total system balance conserved" : "FAILED: total system balance changed");
 
-    // Override withdraw method with savings account restrictions
-    bool withdraw(double amount) override {
-        if (withdrawalsThisMonth >= MAX_WITHDRAWALS) {
-            cout << "Error: Exceeded monthly withdrawal limit for savings account!" << endl;
-            return false;
-        }
-        if (amount > withdrawalLimit) {
-            cout << "Error: Withdrawal amount exceeds limit of $" 
-                 << fixed << setprecision(2) << withdrawalLimit << endl;
-            return false;
+    bool aggregatesMatch = bankSystem.checkAggregates();
+    LOG_INFO << (aggregatesMatch ? "PASSED: running aggregates match a full scan"
+                                 : "FAILED: running aggregates drifted from the balances");
+    passed = passed && aggregatesMatch;
+
+    // Every worker operation must have been recorded exactly once
+    uint64_t recorded = bankSystem.getOperationMetrics(OperationKind::Deposit).count +
+                        bankSystem.getOperationMetrics(OperationKind::Withdrawal).count +
+                        bankSystem.getOperationMetrics(OperationKind::Transfer).count;
+    bool metricsMatch = recorded == (uint64_t)threadCount * operationsPerThread;
+    LOG_INFO << (metricsMatch ? "PASSED: metrics recorded every operation"
+                              : "FAILED: metrics operation count does not match");
+    passed = passed && metricsMatch;
+    bankSystem.displayMetrics();
+
+    if (!journalPath.empty()) {
+        LOG_INFO << "Journal: " << bankSystem.getJournalSyncCount() << " fsyncs for "
+             << (uint64_t)threadCount * operationsPerThread << " operations in " << seconds << " s";
+        vector<Money> balances;
+        for (int accountNumber : accountNumbers) {
+            balances.push_back(bankSystem.findAccountByNumber(accountNumber)->getBalance());
         }
-        
-        if (Account::withdraw(amount)) { // Call base class method
-            withdrawalsThisMonth++;
-            return true;
+        system.reset(); // Flushes and closes the journal
+
+        Operations recovered;
+        bool matches = recovered.openJournal(journalPath);
+        for (size_t i = 0; matches && i < accountNumbers.size(); i++) {
+            Account* account = recovered.findAccountByNumber(accountNumbers[i]);
+            matches = account && account->getBalance() == balances[i];
         }
-        return false;
+        LOG_INFO << (matches ? "PASSED: journal replay restored every balance"
+                             : "FAILED: journal replay does not match");
+        passed = passed && matches;
     }
+    return passed;
+}
 
-    // Apply monthly interest
-    void applyInterest() {
-        double interest = balance * (interestRate / 12); // Monthly interest
-        balance += interest;
-        transactionHistory.push_back(Transaction(interest, "Interest"));
-        cout << "Applied monthly interest: $" << fixed << setprecision(2) 
-             << interest << " to savings account " << accountNumber << endl;
-    }
+// Allocation counter for the benchmarks: operator new calls made by this
+// thread. Counting means replacing the global allocator, so it is compiled
+// in only with -DBANK_COUNT_ALLOCATIONS (a benchmark build); otherwise the
+// benchmarks report allocations as unknown.
+#ifdef BANK_COUNT_ALLOCATIONS
+const bool ALLOCATIONS_COUNTED = true;
+thread_local uint64_t allocationCount = 0;
 
-    // Reset monthly withdrawal counter (would be called monthly)
-    void resetMonthlyWithdrawals() {
-        withdrawalsThisMonth = 0;
+// GCC 12 reports the malloc/free pairing below as mismatched once the
+// replacement operators are inlined into their callers
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t size) {
+    allocationCount++;
+    void* memory = malloc(size ? size : 1);
+    if (!memory) {
+        throw bad_alloc();
     }
+    return memory;
+}
 
-    // Override displayInfo to show savings-specific information
-    void displayInfo() const override {
-        Account::displayInfo(); // Call base class method
-        cout << "Account Type: Savings Account" << endl;
-        cout << "Interest Rate: " << fixed << setprecision(2) 
-             << (interestRate * 100) << "% annually" << endl;
-        cout << "Withdrawal Limit: $" << fixed << setprecision(2) 
-             << withdrawalLimit << endl;
-        cout << "Withdrawals This Month: " << withdrawalsThisMonth 
-             << "/" << MAX_WITHDRAWALS << endl;
+void* operator new(size_t size, align_val_t alignment) {
+    allocationCount++;
+    void* memory = nullptr;
+    if (posix_memalign(&memory, max((size_t)alignment, sizeof(void*)), size ? size : 1) != 0) {
+        throw bad_alloc();
     }
+    return memory;
+}
 
-    // Getters
-    double getInterestRate() const { return interestRate; }
-    double getWithdrawalLimit() const { return withdrawalLimit; }
-};
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    allocationCount++;
+    return malloc(size ? size : 1);
+}
 
-// Customer class to manage multiple accounts
-class Customer {
-private:
-    string name;
-    int customerID;
-    vector<Account*> accounts; // Using pointers to support polymorphism
-    static int nextCustomerID;
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    allocationCount++;
+    void* memory = nullptr;
+    return posix_memalign(&memory, max((size_t)alignment, sizeof(void*)), size ? size : 1) == 0 ? memory : nullptr;
+}
 
-public:
-    // Constructor
-    Customer(const string& customerName) : name(customerName) {
-        customerID = nextCustomerID++;
-    }
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new[](size_t size, align_val_t alignment) { return operator new(size, alignment); }
+void* operator new[](size_t size, const nothrow_t& tag) noexcept { return operator new(size, tag); }
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t& tag) noexcept {
+    return operator new(size, alignment, tag);
+}
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete[](void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t) noexcept { free(memory); }
+void operator delete[](void* memory, size_t) noexcept { free(memory); }
+void operator delete(void* memory, const nothrow_t&) noexcept { free(memory); }
+void operator delete[](void* memory, const nothrow_t&) noexcept { free(memory); }
+void operator delete(void* memory, align_val_t) noexcept { free(memory); }
+void operator delete[](void* memory, align_val_t) noexcept { free(memory); }
+void operator delete(void* memory, size_t, align_val_t) noexcept { free(memory); }
+void operator delete[](void* memory, size_t, align_val_t) noexcept { free(memory); }
+void operator delete(void* memory, align_val_t, const nothrow_t&) noexcept { free(memory); }
+void operator delete[](void* memory, align_val_t, const nothrow_t&) noexcept { free(memory); }
+#pragma GCC diagnostic pop
+#else
+const bool ALLOCATIONS_COUNTED = false;
+const uint64_t allocationCount = 0;
+#endif
 
-    // Destructor
-    ~Customer() {
-        // Clean up dynamically allocated accounts if any
-        // Note: In this implementation, we're not dynamically allocating
-    }
+// Result of one benchmark
+struct BenchmarkResult {
+    string name;
+    size_t accounts;         // Accounts in the system (0 if not applicable)
+    uint64_t iterations;
+    double nsPerOp;
+    double opsPerSecond;
+    double allocationsPerOp; // Negative if allocations are not counted in this build
+};
 
-    // Add account to customer
-    void addAccount(Account* account) {
-        accounts.push_back(account);
-        cout << "Account " << account->getAccountNumber() 
-             << " added to customer " << name << endl;
-    }
+// Keep the compiler from optimizing away a value that is never used
+template <typename T>
+inline void keepValue(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
 
-    // Calculate total balance across all accounts
-    double getTotalBalance() const {
-        double total = 0.0;
-        for (const auto& account : accounts) {
-            total += account->getBalance();
-        }
-        return total;
-    }
+// Run an operation in growing batches until about a quarter of a second has
+// passed, after one untimed warm-up call
+template <typename Operation>
+BenchmarkResult runBenchmark(const string& name, size_t accounts, Operation operation) {
+    const double TARGET_SECONDS = 0.25;
+    operation(0);
 
-    // Display customer information
-    void displayCustomerInfo() const {
-        cout << "\n=== Customer Information ===" << endl;
-        cout << "Customer ID: " << customerID << endl;
-        cout << "Name: " << name << endl;
-        cout << "Total Accounts: " << accounts.size() << endl;
-        cout << "Total Balance: $" << fixed << setprecision(2) 
-             << getTotalBalance() << endl;
-        
-        cout << "\nAccount Details:" << endl;
-        for (const auto& account : accounts) {
-            cout << *account << endl; // Using overloaded << operator
+    uint64_t iterations = 0;
+    uint64_t batch = 1;
+    uint64_t allocationsBefore = allocationCount;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    double seconds = 0;
+    while (seconds < TARGET_SECONDS) {
+        for (uint64_t i = 0; i < batch; i++) {
+            operation(iterations + i);
         }
-    }
-
-    // Find account by account number
-    Account* findAccount(int accountNum) {
-        for (auto& account : accounts) {
-            if (account->getAccountNumber() == accountNum) {
-                return account;
-            }
+        iterations += batch;
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (batch < (1u << 20)) {
+            batch *= 2;
         }
-        return nullptr;
     }
 
-    // Getters
-    string getName() const { return name; }
-    int getCustomerID() const { return customerID; }
-    const vector<Account*>& getAccounts() const { return accounts; }
-};
-
-// Initialize static member
-int Customer::nextCustomerID = 5001;
+    BenchmarkResult result;
+    result.name = name;
+    result.accounts = accounts;
+    result.iterations = iterations;
+    result.nsPerOp = seconds * 1e9 / iterations;
+    result.opsPerSecond = iterations / seconds;
+    result.allocationsPerOp = ALLOCATIONS_COUNTED ? (double)(allocationCount - allocationsBefore) / iterations : -1;
+    return result;
+}
 
-// Operations class to manage all banking operations
-class Operations {
-private:
-    vector<Customer*> customers;
-    vector<Account*> allAccounts;
+// Benchmark suite for the banking core. For every system size it creates
+// that many accounts (every 4th a savings account) and measures single
+// operations on accounts picked from a fixed table of 64K random ones, so
+// the benchmark's own footprint stays the same at every size. Results are
+// logged and written to jsonPath.
+bool runBenchmarks(const vector<size_t>& sizes, const string& jsonPath) {
+    const size_t PICK_COUNT = 1 << 16;
+    LogLevel savedLevel = Logger::getLevel();
+    vector<BenchmarkResult> results;
 
-public:
-    // Constructor
-    Operations() {}
+    // Operations print per call, so log only the results
+    auto report = [&](const BenchmarkResult& result) {
+        Logger::setLevel(savedLevel);
+        ostringstream allocations;
+        if (result.allocationsPerOp >= 0) {
+            allocations << fixed << setprecision(2) << result.allocationsPerOp;
+        } else {
+            allocations << "n/a";
+        }
+        LOG_INFO << "  " << result.name << string(result.name.size() < 40 ? 40 - result.name.size() : 1, ' ')
+             << result.nsPerOp << " ns/op  " << result.opsPerSecond << " ops/s  "
+             << allocations.str() << " allocs/op";
+        Logger::setLevel(LogLevel::Silent);
+        results.push_back(result);
+    };
 
-    // Destructor
-    ~Operations() {
-        // Clean up if needed
-    }
+    LOG_INFO << "=== Banking Core Benchmarks ===";
+    Logger::setLevel(LogLevel::Silent);
+    report(runBenchmark("Transaction construction", 0, [](uint64_t i) {
+        Transaction trans(Money::fromCents((int64_t)i), TransactionType::Deposit);
+        keepValue(trans);
+    }));
 
-    // Create a new customer
-    Customer* createCustomer(const string& name) {
-        Customer* newCustomer = new Customer(name);
-        customers.push_back(newCustomer);
-        cout << "Customer created: " << name << " (ID: " 
-             << newCustomer->getCustomerID() << ")" << endl;
-        return newCustomer;
-    }
+    for (size_t accountCount : sizes) {
+        if (accountCount == 0) {
+            continue;
+        }
+        unique_ptr<Operations> bankSystem(new Operations());
+        vector<Account*> accounts(accountCount);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (size_t i = 0; i < accountCount; i++) {
+            string owner = "Owner " + to_string(i);
+            accounts[i] = (i % 4 == 0)
+                ? bankSystem->createSavingsAccount(owner, 1000.0, 0.02, 1000.0)
+                : bankSystem->createAccount(owner, 1000.0);
+        }
+        double setupSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        Logger::setLevel(savedLevel);
+        LOG_INFO << "\n" << accountCount << " accounts (created in " << setupSeconds << " s):";
+        Logger::setLevel(LogLevel::Silent);
 
-    // Create a regular account
-    Account* createAccount(const string& ownerName, double initialBalance = 0.0) {
-        Account* newAccount = new Account(ownerName, initialBalance);
-        allAccounts.push_back(newAccount);
-        cout << "Regular account created for " << ownerName 
-             << " (Account #" << newAccount->getAccountNumber() << ")" << endl;
-        return newAccount;
-    }
+        vector<Account*> picks(PICK_COUNT);
+        vector<int> pickedNumbers(PICK_COUNT);
+        mt19937 rng(42);
+        for (size_t i = 0; i < PICK_COUNT; i++) {
+            picks[i] = accounts[rng() % accountCount];
+            pickedNumbers[i] = picks[i]->getAccountNumber();
+        }
+        auto pick = [&](uint64_t i) { return picks[i % PICK_COUNT]; };
 
-    // Create a savings account
-    SavingsAccount* createSavingsAccount(const string& ownerName, 
-                                       double initialBalance = 0.0, 
-                                       double rate = 0.02, 
-                                       double limit = 1000.0) {
-        SavingsAccount* newAccount = new SavingsAccount(ownerName, initialBalance, rate, limit);
-        allAccounts.push_back(newAccount);
-        cout << "Savings account created for " << ownerName 
-             << " (Account #" << newAccount->getAccountNumber() << ")" << endl;
-        return newAccount;
+        report(runBenchmark("Account::deposit", accountCount, [&](uint64_t i) {
+            pick(i)->deposit(1.0);
+        }));
+        report(runBenchmark("Account::withdraw", accountCount, [&](uint64_t i) {
+            pick(i)->withdraw(1.0);
+        }));
+        report(runBenchmark("Account::transfer", accountCount, [&](uint64_t i) {
+            pick(i)->transfer(*pick(i + 7919), 1.0);
+        }));
+        report(runBenchmark("Operations::findAccountByNumber", accountCount, [&](uint64_t i) {
+            keepValue(bankSystem->findAccountByNumber(pickedNumbers[i % PICK_COUNT]));
+        }));
+        report(runBenchmark("Operations::getSystemStatistics", accountCount, [&](uint64_t) {
+            bankSystem->getSystemStatistics();
+        }));
+        report(runBenchmark("Operations::performMonthlyOperations", accountCount, [&](uint64_t) {
+            bankSystem->performMonthlyOperations();
+        }));
     }
+    Logger::setLevel(savedLevel);
 
-    // Link account to customer
-    void assignAccountToCustomer(Customer* customer, Account* account) {
-        if (customer && account) {
-            customer->addAccount(account);
-            cout << "Account " << account->getAccountNumber() 
-                 << " assigned to customer " << customer->getName() << endl;
+    ofstream json(jsonPath);
+    json << fixed << setprecision(3);
+    json << "{\n  \"compiler\": \"" << __VERSION__ << "\",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult& result = results[i];
+        json << (i ? "," : "") << "\n    {\"name\": \"" << result.name << "\", \"accounts\": " << result.accounts
+             << ", \"iterations\": " << result.iterations << ", \"ns_per_op\": " << result.nsPerOp
+             << ", \"ops_per_sec\": " << result.opsPerSecond
+             << ", \"allocs_per_op\": ";
+        if (result.allocationsPerOp >= 0) {
+            json << result.allocationsPerOp << "}";
         } else {
-            cout << "Error: Invalid customer or account!" << endl;
+            json << "null}";
         }
     }
+    json << "\n  ]\n}\n";
+    json.close();
+    if (!json) {
+        LOG_ERROR << "Cannot write benchmark results to " << jsonPath;
+        return false;
+    }
+    LOG_INFO << "\nResults written to " << jsonPath;
+    return true;
+}
 
-    // Perform deposit operation
-    bool performDeposit(int accountNumber, double amount) {
-        Account* account = findAccountByNumber(accountNumber);
-        if (account) {
-            account->deposit(amount);
-            return true;
-        } else {
-            cout << "Error: Account " << accountNumber << " not found!" << endl;
-            return false;
+// Sharding test on one machine: starts 'shardCount' shard servers and a
+// spare as child processes (this program with --serve), routes a load-client
+// run through a ShardRouter while the first shard is split onto the spare,
+// and checks that no money was created or lost across the shards.
+bool runShardClusterTest(int shardCount, int accountsPerShard, uint64_t requestsPerConnection) {
+    const int FIRST_ACCOUNT = 1001;
+    const int CONNECTIONS = 4;
+    const int DEPTH = 16;
+    string prefix = "unix:/tmp/bank-cluster-" + to_string(getpid()) + "-";
+    LOG_INFO << "\n=== Shard Cluster Test ===";
+    LOG_INFO << shardCount << " shards of " << accountsPerShard << " accounts plus a spare, " << CONNECTIONS
+         << " connections x " << requestsPerConnection << " requests";
+
+    // The last shard is the spare
+    vector<string> addresses;
+    vector<pid_t> children;
+    bool ok = true;
+    for (int i = 0; ok && i <= shardCount; i++) {
+        string address = prefix + to_string(i) + ".sock";
+        string accounts = to_string(i < shardCount ? accountsPerShard : 0);
+        string first = to_string(FIRST_ACCOUNT + i * accountsPerShard);
+        pid_t pid = fork();
+        if (pid == 0) {
+            execl("/proc/self/exe", "bank", "--log-level", "error", "--serve", address.c_str(), accounts.c_str(), "1",
+                  first.c_str(), (char*)nullptr);
+            _exit(127);
+        }
+        ok = pid > 0;
+        if (ok) {
+            children.push_back(pid);
+            addresses.push_back(address);
         }
     }
-
-    // Perform withdrawal operation
-    bool performWithdrawal(int accountNumber, double amount) {
-        Account* account = findAccountByNumber(accountNumber);
-        if (account) {
-            return account->withdraw(amount);
-        } else {
-            cout << "Error: Account " << accountNumber << " not found!" << endl;
-            return false;
+    // Wait until every shard answers
+    WireRequest summary = WireRequest();
+    summary.type = RequestType::Summary;
+    for (size_t i = 0; ok && i < addresses.size(); i++) {
+        WireResponse response;
+        int attempts = 0;
+        while (!exchangeRequest(addresses[i], summary, response) && ++attempts < 500) {
+            this_thread::sleep_for(chrono::milliseconds(20));
+        }
+        ok = attempts < 500;
+        if (!ok) {
+            LOG_ERROR << "Shard " << addresses[i] << " did not start";
         }
     }
 
-    // Perform transfer operation
-    bool performTransfer(int fromAccountNumber, int toAccountNumber, double amount) {
-        Account* fromAccount = findAccountByNumber(fromAccountNumber);
-        Account* toAccount = findAccountByNumber(toAccountNumber);
-        
-        if (fromAccount && toAccount) {
-            return fromAccount->transfer(*toAccount, amount);
+    ShardRouter router;
+    for (int i = 0; i < (int)addresses.size(); i++) {
+        if (i < shardCount) {
+            router.addShard(FIRST_ACCOUNT + i * accountsPerShard, addresses[i]);
         } else {
-            cout << "Error: One or both accounts not found!" << endl;
-            return false;
+            router.addSpare(addresses[i]);
         }
     }
+    string decisionLogPath = "/tmp/bank-cluster-" + to_string(getpid()) + "-decisions.log";
+    ok = ok && router.openDecisionLog(decisionLogPath);
+    BankServer server(router);
+    string routerAddress = prefix + "router.sock";
+    atomic<bool> stop(false);
+    ok = ok && server.listen(routerAddress);
+    thread routing;
+    if (ok) {
+        routing = thread([&]() { server.run(stop, ShardRouter::LOOP_THREADS); });
+    }
 
-    // Apply interest to all savings accounts
-    void applyInterestToAllSavings() {
-        cout << "\n--- Applying Interest to All Savings Accounts ---" << endl;
-        int count = 0;
-        for (Account* account : allAccounts) {
-            // Try to cast to SavingsAccount
-            SavingsAccount* savingsAcc = dynamic_cast<SavingsAccount*>(account);
-            if (savingsAcc) {
-                savingsAcc->applyInterest();
-                count++;
+    WireResponse before = WireResponse();
+    WireResponse after = WireResponse();
+    ok = ok && exchangeRequest(routerAddress, summary, before);
+    int64_t netDeposited = 0;
+    bool loadOk = false;
+    thread load;
+    if (ok) {
+        load = thread([&]() {
+            loadOk = runLoadClient(routerAddress, CONNECTIONS, requestsPerConnection, DEPTH,
+                                   shardCount * accountsPerShard, FIRST_ACCOUNT, &netDeposited);
+        });
+    }
+    // Split the first shard in half while the load runs
+    this_thread::sleep_for(chrono::milliseconds(50));
+    WireRequest split = WireRequest();
+    split.type = RequestType::Split;
+    split.account = FIRST_ACCOUNT + accountsPerShard / 2;
+    WireResponse splitResponse = WireResponse();
+    bool splitOk = ok && exchangeRequest(routerAddress, split, splitResponse) &&
+                   splitResponse.status == (uint8_t)OperationStatus::Success;
+    if (load.joinable()) {
+        load.join();
+    }
+    ok = ok && loadOk && exchangeRequest(routerAddress, summary, after);
+    size_t unsettled = router.getUnsettledTransfers();
+
+    stop.store(true);
+    if (routing.joinable()) {
+        routing.join();
+    }
+    for (pid_t pid : children) {
+        kill(pid, SIGTERM);
+    }
+    for (pid_t pid : children) {
+        waitpid(pid, nullptr, 0);
+    }
+    unlink(decisionLogPath.c_str());
+
+    LOG_INFO << "Cross-shard transfers: " << router.getCrossShardTransfers() << " (" << unsettled
+         << " not settled yet), shards after the split: " << router.getShardCount();
+    LOG_INFO << "Expected total: $" << Money::fromCents(before.totalCents + netDeposited)
+         << ", actual total: $" << Money::fromCents(after.totalCents);
+    bool conserved = ok && before.status == (uint8_t)OperationStatus::Success &&
+                     after.status == (uint8_t)OperationStatus::Success &&
+                     after.totalCents == before.totalCents + netDeposited;
+    LOG_INFO << (conserved ? "PASSED: total system balance conserved across shards"
+                           : "FAILED: total system balance changed across shards");
+    bool counted = ok && before.accounts == (uint64_t)shardCount * accountsPerShard && after.accounts == before.accounts;
+    LOG_INFO << (counted ? "PASSED: every account still found after the split"
+                         : "FAILED: accounts lost or duplicated by the split");
+    bool moved = splitOk && splitResponse.balance == accountsPerShard - accountsPerShard / 2;
+    LOG_INFO << (moved ? "PASSED: split moved " : "FAILED: split moved ") << splitResponse.balance
+         << " accounts while serving";
+    return conserved && counted && moved;
+}
+
+// Set by SIGINT/SIGTERM to shut the network service down
+atomic<bool> serviceStopRequested(false);
+
+void requestServiceStop(int) {
+    serviceStopRequested.store(true);
+}
+
+// Main function with comprehensive testing
+int main(int argc, char* argv[]) {
+    // Options: "--log-level silent|error|info|debug", "--log-file <path>",
+    // "--journal <path>" (recover from and keep a write-ahead journal),
+    // "--snapshot <path>" (snapshot to start from / to write at the end),
+    // "--bench-json <path>" (where --bench writes its results),
+    // "--metrics-json <path>" (operation metrics written at the end of the demo),
+    // "--trace <path>" (Chrome trace of the run; needs a -DBANK_TRACING build)
+    int argIndex = 1;
+    string journalPath;
+    string snapshotPath;
+    string benchJsonPath = "bench_results.json";
+    string metricsJsonPath;
+    string tracePath;
+    while (argIndex + 1 < argc && (string(argv[argIndex]).compare(0, 6, "--log-") == 0 ||
+                                   string(argv[argIndex]) == "--journal" ||
+                                   string(argv[argIndex]) == "--snapshot" ||
+                                   string(argv[argIndex]) == "--bench-json" ||
+                                   string(argv[argIndex]) == "--metrics-json" ||
+                                   string(argv[argIndex]) == "--trace")) {
+        string option = argv[argIndex];
+        string value = argv[argIndex + 1];
+        if (option == "--journal") {
+            journalPath = value;
+        } else if (option == "--snapshot") {
+            snapshotPath = value;
+        } else if (option == "--bench-json") {
+            benchJsonPath = value;
+        } else if (option == "--metrics-json") {
+            metricsJsonPath = value;
+        } else if (option == "--trace") {
+            tracePath = value;
+        } else if (option == "--log-level") {
+            if (value == "silent") Logger::setLevel(LogLevel::Silent);
+            else if (value == "error") Logger::setLevel(LogLevel::Error);
+            else if (value == "debug") Logger::setLevel(LogLevel::Debug);
+            else Logger::setLevel(LogLevel::Info);
+        } else if (option == "--log-file") {
+            if (!Logger::instance().setOutputFile(value)) {
+                cerr << "Cannot open log file " << value << endl;
+                return 1;
             }
         }
-        cout << "Interest applied to " << count << " savings accounts." << endl;
+        argIndex += 2;
     }
+    TraceSession traceSession(tracePath); // Written when main returns
 
-    // Display all customers
-    void displayAllCustomers() const {
-        cout << "\n=== ALL CUSTOMERS ===" << endl;
-        if (customers.empty()) {
-            cout << "No customers in the system." << endl;
-            return;
+    // "--stress [threads] [operations]" runs the concurrency stress test
+    if (argIndex < argc && string(argv[argIndex]) == "--stress") {
+        int threadCount = argIndex + 1 < argc ? atoi(argv[argIndex + 1]) : 8;
+        int operationsPerThread = argIndex + 2 < argc ? atoi(argv[argIndex + 2]) : 100000;
+        return runConcurrencyStressTest(threadCount, operationsPerThread, journalPath) ? 0 : 1;
+    }
+
+    // "--bench [accounts...]" runs the benchmarks (default 1K, 1M and 10M accounts;
+    // allocations per operation need a -DBANK_COUNT_ALLOCATIONS build)
+    if (argIndex < argc && string(argv[argIndex]) == "--bench") {
+        vector<size_t> sizes;
+        for (int i = argIndex + 1; i < argc; i++) {
+            sizes.push_back((size_t)strtoull(argv[i], nullptr, 10));
         }
-        
-        for (const Customer* customer : customers) {
-            customer->displayCustomerInfo();
-            cout << string(50, '-') << endl;
+        if (sizes.empty()) {
+            sizes = {1000, 1000000, 10000000};
         }
+        return runBenchmarks(sizes, benchJsonPath) ? 0 : 1;
     }
 
-    // Display all accounts
-    void displayAllAccounts() const {
-        cout << "\n=== ALL ACCOUNTS ===" << endl;
-        if (allAccounts.empty()) {
-            cout << "No accounts in the system." << endl;
-            return;
+    // "--recover" rebuilds the system from the snapshot and/or journal and reports on it
+    if (argIndex < argc && string(argv[argIndex]) == "--recover") {
+        Operations recovered;
+        if (journalPath.empty() && snapshotPath.empty()) {
+            LOG_ERROR << "--recover needs --snapshot <path> and/or --journal <path>";
+            return 1;
         }
-        
-        for (const Account* account : allAccounts) {
-            account->displayInfo();
-            cout << string(40, '-') << endl;
+        if (!snapshotPath.empty() && !recovered.openSnapshot(snapshotPath)) {
+            LOG_ERROR << "Cannot load snapshot " << snapshotPath;
+            return 1;
         }
+        if (!journalPath.empty() && !recovered.openJournal(journalPath)) {
+            LOG_ERROR << "Cannot open journal " << journalPath;
+            return 1;
+        }
+        recovered.displaySystemSummary();
+        recovered.getSystemStatistics();
+        return 0;
     }
 
-    // Display system summary
-    void displaySystemSummary() const {
-        cout << "\n=== BANKING SYSTEM SUMMARY ===" << endl;
-        cout << "Total Customers: " << customers.size() << endl;
-        cout << "Total Accounts: " << allAccounts.size() << endl;
-        
-        double totalSystemBalance = 0.0;
-        int regularAccounts = 0, savingsAccounts = 0;
-        
-        for (const Account* account : allAccounts) {
-            totalSystemBalance += account->getBalance();
-            if (dynamic_cast<const SavingsAccount*>(account)) {
-                savingsAccounts++;
-            } else {
-                regularAccounts++;
+    // "--import <file> [threads]" applies a settlement file to the system
+    // restored from the snapshot and/or journal, then reports on it
+    if (argIndex < argc && string(argv[argIndex]) == "--import") {
+        if (argIndex + 1 >= argc) {
+            LOG_ERROR << "--import needs a settlement file";
+            return 1;
+        }
+        Operations bankSystem;
+        if (!snapshotPath.empty() && !bankSystem.openSnapshot(snapshotPath)) {
+            LOG_ERROR << "Cannot load snapshot " << snapshotPath;
+            return 1;
+        }
+        if (!journalPath.empty() && !bankSystem.openJournal(journalPath)) {
+            LOG_ERROR << "Cannot open journal " << journalPath;
+            return 1;
+        }
+        unsigned threadCount = argIndex + 2 < argc ? (unsigned)atoi(argv[argIndex + 2]) : 0;
+        ImportResult result = bankSystem.importSettlementFile(argv[argIndex + 1], threadCount);
+        for (int s = 1; s < OPERATION_STATUS_COUNT; s++) {
+            if (result.failures[s]) {
+                LOG_INFO << "  " << operationStatusName((OperationStatus)s) << ": " << result.failures[s];
             }
         }
-        
-        cout << "Regular Accounts: " << regularAccounts << endl;
-        cout << "Savings Accounts: " << savingsAccounts << endl;
-        cout << "Total System Balance: $" << fixed << setprecision(2) 
-             << totalSystemBalance << endl;
+        LOG_INFO << "Read " << result.bytes / 1048576.0 << " MB in " << result.seconds << " s ("
+             << (result.seconds > 0 ? result.bytes / 1048576.0 / result.seconds : 0.0) << " MB/s)";
+        bankSystem.displaySystemSummary();
+        return 0;
     }
 
-    // Find customer by ID
-    Customer* findCustomerById(int customerID) {
-        for (Customer* customer : customers) {
-            if (customer->getCustomerID() == customerID) {
-                return customer;
-            }
+    // "--statements <prefix> [shards]" writes every account's statement
+    // from the system restored from the snapshot and/or journal
+    if (argIndex < argc && string(argv[argIndex]) == "--statements") {
+        if (argIndex + 1 >= argc) {
+            LOG_ERROR << "--statements needs an output path prefix";
+            return 1;
         }
-        return nullptr;
+        Operations bankSystem;
+        if (!snapshotPath.empty() && !bankSystem.openSnapshot(snapshotPath)) {
+            LOG_ERROR << "Cannot load snapshot " << snapshotPath;
+            return 1;
+        }
+        if (!journalPath.empty() && !bankSystem.openJournal(journalPath)) {
+            LOG_ERROR << "Cannot open journal " << journalPath;
+            return 1;
+        }
+        unsigned shardCount = argIndex + 2 < argc ? (unsigned)atoi(argv[argIndex + 2]) : 0;
+        StatementExportResult result = bankSystem.exportStatements(argv[argIndex + 1], shardCount);
+        LOG_INFO << "Wrote " << result.bytes / 1048576.0 << " MB in " << result.seconds << " s";
+        return result.ok ? 0 : 1;
     }
 
-    // Find account by account number
-    Account* findAccountByNumber(int accountNumber) {
-        for (Account* account : allAccounts) {
-            if (account->getAccountNumber() == accountNumber) {
-                return account;
+    // "--serve <address> [accounts] [threads] [first account]" serves the
+    // system restored from the snapshot and/or journal over the binary
+    // protocol, after opening 'accounts' new accounts (numbered from 'first
+    // account' if given), until SIGINT or SIGTERM. The address is
+    // "unix:<path>" or "[host]:<port>".
+    if (argIndex < argc && string(argv[argIndex]) == "--serve") {
+        if (argIndex + 1 >= argc) {
+            LOG_ERROR << "--serve needs an address (unix:<path> or host:port)";
+            return 1;
+        }
+        Operations bankSystem;
+        if (!snapshotPath.empty() && !bankSystem.openSnapshot(snapshotPath)) {
+            LOG_ERROR << "Cannot load snapshot " << snapshotPath;
+            return 1;
+        }
+        if (!journalPath.empty() && !bankSystem.openJournal(journalPath)) {
+            LOG_ERROR << "Cannot open journal " << journalPath;
+            return 1;
+        }
+        int accountCount = argIndex + 2 < argc ? atoi(argv[argIndex + 2]) : 0;
+        unsigned threadCount = argIndex + 3 < argc ? (unsigned)atoi(argv[argIndex + 3]) : 1;
+        int firstNumber = argIndex + 4 < argc ? atoi(argv[argIndex + 4]) : 0;
+        OperationsService service(bankSystem);
+        BankServer server(service);
+        if (!server.listen(argv[argIndex + 1])) {
+            LOG_ERROR << "Cannot listen on " << argv[argIndex + 1];
+            return 1;
+        }
+        // Per-operation messages would swamp the log, as in the stress test
+        LogLevel savedLevel = Logger::getLevel();
+        Logger::setLevel(LogLevel::Silent);
+        int firstAccount = 0;
+        for (int i = 0; i < accountCount; i++) {
+            Account* account = bankSystem.createAccount("Service Owner " + to_string(i), 1000.0,
+                                                        firstNumber > 0 ? firstNumber + i : 0);
+            if (!account) {
+                Logger::setLevel(savedLevel);
+                LOG_ERROR << "Cannot open account " << firstNumber + i;
+                return 1;
             }
+            firstAccount = i == 0 ? account->getAccountNumber() : firstAccount;
         }
-        return nullptr;
+        Logger::setLevel(savedLevel);
+        if (accountCount > 0) {
+            LOG_INFO << "Opened accounts " << firstAccount << " to " << firstAccount + accountCount - 1;
+        }
+        signal(SIGINT, requestServiceStop);
+        signal(SIGTERM, requestServiceStop);
+        signal(SIGPIPE, SIG_IGN);
+        LOG_INFO << "Serving on " << argv[argIndex + 1] << " with " << max(threadCount, 1u) << " event loop(s)";
+        Logger::setLevel(LogLevel::Silent);
+        server.run(serviceStopRequested, max(threadCount, 1u));
+        Logger::setLevel(savedLevel);
+        LOG_INFO << "Served " << server.getRequestsServed() << " requests";
+        bankSystem.displaySystemSummary();
+        return 0;
     }
 
-    // Monthly operations (reset withdrawal counters, apply interest)
-    void performMonthlyOperations() {
-        cout << "\n--- Performing Monthly Operations ---" << endl;
-        
-        // Reset withdrawal counters for savings accounts
-        for (Account* account : allAccounts) {
-            SavingsAccount* savingsAcc = dynamic_cast<SavingsAccount*>(account);
-            if (savingsAcc) {
-                savingsAcc->resetMonthlyWithdrawals();
-            }
+    // "--client <address> [connections] [requests] [depth] [accounts] [first]"
+    // runs the load client against a server started with --serve
+    if (argIndex < argc && string(argv[argIndex]) == "--client") {
+        if (argIndex + 1 >= argc) {
+            LOG_ERROR << "--client needs an address (unix:<path> or host:port)";
+            return 1;
         }
-        
-        // Apply interest to all savings accounts
-        applyInterestToAllSavings();
-        
-        cout << "Monthly operations completed." << endl;
+        int connections = argIndex + 2 < argc ? atoi(argv[argIndex + 2]) : 4;
+        uint64_t requests = argIndex + 3 < argc ? strtoull(argv[argIndex + 3], nullptr, 10) : 100000;
+        int depth = argIndex + 4 < argc ? atoi(argv[argIndex + 4]) : 64;
+        int accountCount = argIndex + 5 < argc ? atoi(argv[argIndex + 5]) : 1000;
+        int firstAccount = argIndex + 6 < argc ? atoi(argv[argIndex + 6]) : 1001;
+        signal(SIGPIPE, SIG_IGN);
+        return runLoadClient(argv[argIndex + 1], max(connections, 1), requests, max(depth, 1),
+                             max(accountCount, 1), firstAccount) ? 0 : 1;
     }
 
-    // Get system statistics
-    void getSystemStatistics() const {
-        cout << "\n=== SYSTEM STATISTICS ===" << endl;
-        
-        if (allAccounts.empty()) {
-            cout << "No accounts in the system for statistics." << endl;
-            return;
+    // "--route <address> <first account>@<shard address>... [spare@<shard address>...] [log@<path>]"
+    // routes the binary protocol over shard servers started with --serve.
+    // Each shard owns the accounts from its first account up to the next
+    // shard's; a spare takes over part of a range when a shard is split.
+    // With log@, cross-shard transfer decisions (and accounts a failed split
+    // has not placed yet) survive a router restart.
+    if (argIndex < argc && string(argv[argIndex]) == "--route") {
+        if (argIndex + 2 >= argc) {
+            LOG_ERROR << "--route needs an address and at least one <first account>@<shard address>";
+            return 1;
         }
-        
-        double totalBalance = 0.0;
-        double maxBalance = allAccounts[0]->getBalance();
-        double minBalance = allAccounts[0]->getBalance();
-        Account* richestAccount = allAccounts[0];
-        
-        for (const Account* account : allAccounts) {
-            double balance = account->getBalance();
-            totalBalance += balance;
-            
-            if (balance > maxBalance) {
-                maxBalance = balance;
-                richestAccount = const_cast<Account*>(account);
+        ShardRouter router;
+        string decisionLogPath;
+        for (int i = argIndex + 2; i < argc; i++) {
+            string shard = argv[i];
+            size_t at = shard.find('@');
+            if (at == string::npos || at == 0 || at + 1 == shard.size()) {
+                LOG_ERROR << "Bad shard " << shard << " (expected <first account>@<address> or spare@<address>)";
+                return 1;
             }
-            if (balance < minBalance) {
-                minBalance = balance;
+            if (shard.compare(0, at, "log") == 0) {
+                decisionLogPath = shard.substr(at + 1);
+            } else if (shard.compare(0, at, "spare") == 0) {
+                router.addSpare(shard.substr(at + 1));
+            } else {
+                router.addShard(atoi(shard.c_str()), shard.substr(at + 1));
             }
         }
-        
-        double averageBalance = totalBalance / allAccounts.size();
-        
-        cout << "Average Account Balance: $" << fixed << setprecision(2) 
-             << averageBalance << endl;
-        cout << "Highest Balance: $" << fixed << setprecision(2) 
-             << maxBalance << " (Account #" << richestAccount->getAccountNumber() << ")" << endl;
-        cout << "Lowest Balance: $" << fixed << setprecision(2) << minBalance << endl;
+        if (router.getShardCount() == 0) {
+            LOG_ERROR << "--route needs at least one shard that is not a spare";
+            return 1;
+        }
+        if (!decisionLogPath.empty() && !router.openDecisionLog(decisionLogPath)) {
+            LOG_ERROR << "Cannot open decision log " << decisionLogPath;
+            return 1;
+        }
+        BankServer server(router);
+        if (!server.listen(argv[argIndex + 1])) {
+            LOG_ERROR << "Cannot listen on " << argv[argIndex + 1];
+            return 1;
+        }
+        signal(SIGINT, requestServiceStop);
+        signal(SIGTERM, requestServiceStop);
+        signal(SIGPIPE, SIG_IGN);
+        LOG_INFO << "Routing " << argv[argIndex + 1] << " over " << router.getShardCount() << " shard(s)";
+        server.run(serviceStopRequested, ShardRouter::LOOP_THREADS);
+        LOG_INFO << "Routed " << server.getRequestsServed() << " requests (" << router.getCrossShardTransfers()
+             << " cross-shard transfers)";
+        return 0;
     }
-};
 
-// Main function with comprehensive testing
-int main() {
-    cout << "=== Bank Account Management System ===" << endl;
-    cout << "Testing Object-Oriented Programming Concepts with Operations Class\n" << endl;
+    // "--split <router address> <first account>" splits the shard holding
+    // that account onto one of the router's spares, from that account up
+    if (argIndex < argc && string(argv[argIndex]) == "--split") {
+        if (argIndex + 2 >= argc) {
+            LOG_ERROR << "--split needs the router address and the first account to move";
+            return 1;
+        }
+        WireRequest request = WireRequest();
+        request.type = RequestType::Split;
+        request.account = atoi(argv[argIndex + 2]);
+        WireResponse response;
+        if (!exchangeRequest(argv[argIndex + 1], request, response) ||
+            response.status != (uint8_t)OperationStatus::Success) {
+            LOG_ERROR << "Split at account " << request.account << " failed";
+            return 1;
+        }
+        LOG_INFO << "Split at account " << request.account << ": " << response.balance << " accounts moved";
+        return 0;
+    }
+
+    // "--cluster [shards] [accounts per shard] [requests per connection]"
+    // runs the sharding test with shard processes on this machine
+    if (argIndex < argc && string(argv[argIndex]) == "--cluster") {
+        int shardCount = argIndex + 1 < argc ? atoi(argv[argIndex + 1]) : 3;
+        int accountsPerShard = argIndex + 2 < argc ? atoi(argv[argIndex + 2]) : 1000;
+        uint64_t requests = argIndex + 3 < argc ? strtoull(argv[argIndex + 3], nullptr, 10) : 20000;
+        signal(SIGPIPE, SIG_IGN);
+        return runShardClusterTest(max(shardCount, 1), max(accountsPerShard, 2), requests) ? 0 : 1;
+    }
+
+    LOG_INFO << "=== Bank Account Management System ===";
+    LOG_INFO << "Testing Object-Oriented Programming Concepts with Operations Class\n";
 
     // Create the Operations manager
     Operations bankSystem;
+    if (!journalPath.empty() && !bankSystem.openJournal(journalPath)) {
+        LOG_ERROR << "Cannot open journal " << journalPath;
+        return 1;
+    }
 
     // Test 1: Create customers using Operations class
-    cout << "1. Creating Customers using Operations class..." << endl;
+    LOG_INFO << "1. Creating Customers using Operations class...";
     Customer* alice = bankSystem.createCustomer("Alice Johnson");
     Customer* bob = bankSystem.createCustomer("Bob Smith");
     Customer* charlie = bankSystem.createCustomer("Charlie Brown");
 
     // Test 2: Create different types of accounts using Operations class
-    cout << "\n2. Creating Accounts using Operations class..." << endl;
+    LOG_INFO << "\n2. Creating Accounts using Operations class...";
     Account* aliceChecking = bankSystem.createAccount("Alice Johnson", 1000.0);
     SavingsAccount* aliceSavings = bankSystem.createSavingsAccount("Alice Johnson", 5000.0, 0.025, 500.0);
     Account* bobChecking = bankSystem.createAccount("Bob Smith", 750.0);
     SavingsAccount* charlieSavings = bankSystem.createSavingsAccount("Charlie Brown", 3000.0, 0.03, 300.0);
 
     // Test 3: Assign accounts to customers using Operations class
-    cout << "\n3. Assigning Accounts to Customers..." << endl;
+    LOG_INFO << "\n3. Assigning Accounts to Customers...";
     bankSystem.assignAccountToCustomer(alice, aliceChecking);
     bankSystem.assignAccountToCustomer(alice, aliceSavings);
     bankSystem.assignAccountToCustomer(bob, bobChecking);
     bankSystem.assignAccountToCustomer(charlie, charlieSavings);
 
     // Test 4: Perform operations using Operations class
-    cout << "\n4. Performing Banking Operations..." << endl;
+    LOG_INFO << "\n4. Performing Banking Operations...";
     bankSystem.performDeposit(aliceChecking->getAccountNumber(), 200.0);
     bankSystem.performWithdrawal(aliceChecking->getAccountNumber(), 150.0);
     bankSystem.performDeposit(aliceSavings->getAccountNumber(), 1000.0);
 
     // Test 5: Transfer operations using Operations class
-    cout << "\n5. Testing Transfer Operations..." << endl;
+    LOG_INFO << "\n5. Testing Transfer Operations...";
     bankSystem.performTransfer(aliceChecking->getAccountNumber(), 
                               bobChecking->getAccountNumber(), 100.0);
 
     // Test 6: Apply interest to all savings accounts
-    cout << "\n6. Applying Interest to All Savings Accounts..." << endl;
+    LOG_INFO << "\n6. Applying Interest to All Savings Accounts...";
     bankSystem.applyInterestToAllSavings();
 
     // Test 7: Test operator overloading (original functionality)
-    cout << "\n7. Testing Operator Overloading..." << endl;
+    LOG_INFO << "\n7. Testing Operator Overloading...";
     
     // Test += operator
-    cout << "Adding transaction using += operator:" << endl;
-    Transaction bonusDeposit(100.0, "Deposit");
+    LOG_INFO << "Adding transaction using += operator:";
+    Transaction bonusDeposit(100.0, TransactionType::Deposit);
     *aliceChecking += bonusDeposit;
 
     // Test == operator
-    cout << "\nComparing account balances using == operator:" << endl;
+    LOG_INFO << "\nComparing account balances using == operator:";
     if (*aliceChecking == *bobChecking) {
-        cout << "Alice's checking and Bob's checking have equal balances" << endl;
+        LOG_INFO << "Alice's checking and Bob's checking have equal balances";
     } else {
-        cout << "Alice's checking and Bob's checking have different balances" << endl;
+        LOG_INFO << "Alice's checking and Bob's checking have different balances";
     }
 
     // Test > operator
-    cout << "Comparing account balances using > operator:" << endl;
+    LOG_INFO << "Comparing account balances using > operator:";
     if (*aliceSavings > *aliceChecking) {
-        cout << "Alice's savings account has more money than her checking account" << endl;
+        LOG_INFO << "Alice's savings account has more money than her checking account";
     }
 
     // Test 8: Error handling with Operations class
-    cout << "\n8. Testing Error Handling..." << endl;
-    cout << "Attempting invalid operations:" << endl;
+    LOG_INFO << "\n8. Testing Error Handling...";
+    LOG_INFO << "Attempting invalid operations:";
     bankSystem.performDeposit(9999, 100.0); // Non-existent account
     bankSystem.performWithdrawal(bobChecking->getAccountNumber(), 10000.0); // Overdraft attempt
     bankSystem.performTransfer(9999, 1001, 100.0); // Invalid account numbers
 
     // Test 9: Display system information using Operations class
-    cout << "\n9. Displaying System Information..." << endl;
+    LOG_INFO << "\n9. Displaying System Information...";
     bankSystem.displaySystemSummary();
     bankSystem.getSystemStatistics();
 
     // Test 10: Monthly operations
-    cout << "\n10. Performing Monthly Operations..." << endl;
+    LOG_INFO << "\n10. Performing Monthly Operations...";
     bankSystem.performMonthlyOperations();
 
     // Test 11: Display all customers and accounts
-    cout << "\n11. Displaying All Customers..." << endl;
+    LOG_INFO << "\n11. Displaying All Customers...";
     bankSystem.displayAllCustomers();
 
-    cout << "\n12. Displaying All Accounts..." << endl;
+    LOG_INFO << "\n12. Displaying All Accounts...";
     bankSystem.displayAllAccounts();
 
     // Test 12: Search functionality
-    cout << "\n13. Testing Search Functionality..." << endl;
+    LOG_INFO << "\n13. Testing Search Functionality...";
     Customer* foundCustomer = bankSystem.findCustomerById(alice->getCustomerID());
     if (foundCustomer) {
-        cout << "Found customer: " << foundCustomer->getName() << endl;
+        LOG_INFO << "Found customer: " << foundCustomer->getName();
+    }
+
+    for (Customer* customer : bankSystem.findCustomersByNamePrefix("Al")) {
+        LOG_INFO << "Customer name starting with \"Al\": " << customer->getName()
+             << " (ID: " << customer->getCustomerID() << ")";
     }
 
     Account* foundAccount = bankSystem.findAccountByNumber(aliceChecking->getAccountNumber());
     if (foundAccount) {
-        cout << "Found account: " << *foundAccount << endl;
+        LOG_INFO << "Found account: " << *foundAccount;
     }
 
     // Test 13: Polymorphism demonstration
-    cout << "\n14. Demonstrating Polymorphism..." << endl;
-    cout << "Adding small bonus to all accounts (polymorphic behavior):" << endl;
+    LOG_INFO << "\n14. Demonstrating Polymorphism...";
+    LOG_INFO << "Adding small bonus to all accounts (polymorphic behavior):";
     vector<Account*> allSystemAccounts = {aliceChecking, aliceSavings, bobChecking, charlieSavings};
     
     for (Account* acc : allSystemAccounts) {
-        cout << "Before bonus: " << *acc << endl;
+        LOG_INFO << "Before bonus: " << *acc;
         acc->deposit(25.0); // Virtual function call - polymorphic behavior
-        cout << "After bonus: " << *acc << endl;
-        cout << "---" << endl;
+        LOG_INFO << "After bonus: " << *acc;
+        LOG_INFO << "---";
+    }
+
+    // Test 14: Batch operations
+    LOG_INFO << "\n15. Processing a Batch of Operations...";
+    vector<BatchOperation> batch = {
+        {BatchOperationType::Deposit, bobChecking->getAccountNumber(), 0, 50.0},
+        {BatchOperationType::Withdrawal, aliceChecking->getAccountNumber(), 0, 20.0},
+        {BatchOperationType::Transfer, bobChecking->getAccountNumber(), aliceChecking->getAccountNumber(), 30.0},
+        {BatchOperationType::Deposit, 9999, 0, 10.0}, // Non-existent account
+        {BatchOperationType::Withdrawal, bobChecking->getAccountNumber(), 0, 10000.0} // Overdraft attempt
+    };
+    BatchResult batchResult = bankSystem.performBatch(batch);
+    for (size_t i = 0; i < batch.size(); i++) {
+        LOG_INFO << "  Operation " << (i + 1) << ": " << operationStatusName(batchResult.statuses[i]);
     }
 
     // Final system summary
-    cout << "\n15. Final System Summary..." << endl;
+    LOG_INFO << "\n16. Final System Summary...";
     bankSystem.displaySystemSummary();
     bankSystem.getSystemStatistics();
 
-    cout << "\n=== Complete System Testing with Operations Class Complete ===" << endl;
+    // Test 15: Balance rankings
+    LOG_INFO << "\n17. Ranking Accounts by Balance...";
+    bankSystem.displayTopAccounts(3);
+    Money feeThreshold = 1000.0;
+    vector<Account*> belowMinimum = bankSystem.getAccountsBelow(feeThreshold);
+    LOG_INFO << "Accounts below $" << feeThreshold << " minimum balance: " << belowMinimum.size();
+    for (Account* account : belowMinimum) {
+        LOG_INFO << "  " << *account;
+    }
+
+    // Test 18: Operation metrics (counts only; latencies vary run to run)
+    LOG_INFO << "\n18. Operation Metrics...";
+    for (int k = 0; k < OPERATION_KIND_COUNT; k++) {
+        OperationSummary summary = bankSystem.getOperationMetrics((OperationKind)k);
+        LOG_INFO << operationKindName((OperationKind)k) << ": " << summary.count << " recorded, "
+             << summary.failures() << " failed";
+    }
+    if (!metricsJsonPath.empty()) {
+        ofstream metricsJson(metricsJsonPath);
+        bankSystem.writeMetricsJson(metricsJson);
+        if (!metricsJson) {
+            LOG_ERROR << "Cannot write metrics to " << metricsJsonPath;
+        }
+    }
+
+    if (!snapshotPath.empty() && !bankSystem.writeSnapshot(snapshotPath)) {
+        LOG_ERROR << "Cannot write snapshot " << snapshotPath;
+    }
+
+    LOG_INFO << "\n=== Complete System Testing with Operations Class Complete ===";
     return 0;
 }
\ No newline at end of file